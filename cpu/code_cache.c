@@ -0,0 +1,608 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "code_cache.h"
+#include "disk_cache.h"
+#include "jit.h"
+#include "virtual_memory.h"
+
+// Direct-mapped by the low bits of the address, which keeps any contiguous
+// 16KB of code free of conflicts.
+#define DECODE_CACHE_BITS 14
+#define DECODE_CACHE_ENTRIES (1 << DECODE_CACHE_BITS)
+#define EMPTY_RIP UINT64_MAX
+
+#define BLOCK_HASH_BITS 12
+#define BLOCK_HASH_SIZE (1 << BLOCK_HASH_BITS)
+// Keeps a block within two pages, so two generations cover it.
+#define BLOCK_MAX_INSTRS 64
+
+// A block that ran this many times starts a trace, if the jumps after it
+// went one way at least 3 times out of 4 in TRACE_MIN_SAMPLES runs or more.
+#define TRACE_THRESHOLD 8
+#define TRACE_MIN_SAMPLES 4
+#define TRACE_MAX_INSTRS 128
+
+typedef struct {
+    uint64_t rip;
+    // vm_code_gen() of the first and the last byte at decode time.
+    uint32_t gen;
+    uint32_t end_gen;
+    Instr instr;
+} DecodeEntry;
+
+struct CodeCache_t {
+    DecodeEntry entries[DECODE_CACHE_ENTRIES];
+    // Indices of the occupied entries, so that revalidation does not scan
+    // the whole table.
+    int used[DECODE_CACHE_ENTRIES];
+    int num_used;
+    Block* blocks[BLOCK_HASH_SIZE];
+    Block* all_blocks;
+    // vm_code_epoch() when the entries were last known to be valid.
+    uint32_t epoch;
+    DiskCache* disk;  // or NULL
+    CodeCacheStats stats;
+};
+
+CodeCache* cache_init(void) {
+    CodeCache* cache = malloc(sizeof(CodeCache));
+    int i;
+    for (i = 0; i < DECODE_CACHE_ENTRIES; i++) {
+        cache->entries[i].rip = EMPTY_RIP;
+    }
+    cache->num_used = 0;
+    memset(cache->blocks, 0, sizeof(cache->blocks));
+    cache->all_blocks = NULL;
+    cache->epoch = 0;
+    cache->disk = NULL;
+    memset(&cache->stats, 0, sizeof(CodeCacheStats));
+    return cache;
+}
+
+void cache_destroy(CodeCache* cache) {
+    Block* block = cache->all_blocks;
+    while (block != NULL) {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(cache);
+}
+
+void cache_set_disk(CodeCache* cache, DiskCache* disk) {
+    cache->disk = disk;
+}
+
+static int block_hash(uint64_t rip) {
+    return (rip ^ (rip >> BLOCK_HASH_BITS)) & (BLOCK_HASH_SIZE - 1);
+}
+
+static void set_link(Block* from, BlockLink* link, Block* block, uint32_t epoch) {
+    link->block = block;
+    link->epoch = epoch;
+    jit_link(from, link);
+}
+
+static void insert_block(CodeCache* cache, Block* block) {
+    Block** bucket = &cache->blocks[block_hash(block->start)];
+    block->hash_next = *bucket;
+    *bucket = block;
+    block->next = cache->all_blocks;
+    cache->all_blocks = block;
+    cache->stats.num_blocks++;
+}
+
+static void remove_block(CodeCache* cache, Block* block) {
+    Block** p = &cache->blocks[block_hash(block->start)];
+    while (*p != block) {
+        p = &(*p)->hash_next;
+    }
+    *p = block->hash_next;
+    p = &cache->all_blocks;
+    while (*p != block) {
+        p = &(*p)->next;
+    }
+    *p = block->next;
+    cache->stats.num_blocks--;
+    jit_forget(block);
+    free(block);
+}
+
+static void unlink_invalid(Block* from, BlockLink* link, uint32_t epoch) {
+    if (link->block != NULL && link->block->invalid) {
+        set_link(from, link, NULL, epoch);
+    }
+}
+
+// Frees the blocks marked invalid, unlinking them from the others before
+// any of them is freed. Returns how many there were.
+static int remove_invalid_blocks(CodeCache* cache, uint32_t epoch) {
+    Block* block;
+    int i, n = 0;
+    for (block = cache->all_blocks; block != NULL; block = block->next) {
+        for (i = 0; i < BLOCK_LINKS; i++) {
+            unlink_invalid(block, &block->links[i], epoch);
+        }
+        unlink_invalid(NULL, &block->return_link, epoch);
+    }
+    block = cache->all_blocks;
+    while (block != NULL) {
+        Block* next = block->next;
+        if (block->invalid) {
+            remove_block(cache, block);
+            n++;
+        }
+        block = next;
+    }
+    return n;
+}
+
+static int is_valid(VirtualMemory* vm, Block* block) {
+    for (int i = 0; i < block->num_ranges; i++) {
+        BlockRange* range = &block->ranges[i];
+        if (vm_code_gen(vm, range->start) != range->gen || vm_code_gen(vm, range->end - 1) != range->end_gen) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Drops the entries whose code was written since they were decoded.
+static void revalidate(Emulator* emu) {
+    CodeCache* cache = emu->cache;
+    VirtualMemory* vm = emu->memory;
+    int i, n = 0;
+    for (i = 0; i < cache->num_used; i++) {
+        DecodeEntry* entry = &cache->entries[cache->used[i]];
+        if (entry->rip == EMPTY_RIP) {
+            continue;
+        }
+        uint64_t end = entry->rip + entry->instr.len - 1;
+        if (vm_code_gen(vm, entry->rip) != entry->gen || vm_code_gen(vm, end) != entry->end_gen) {
+            entry->rip = EMPTY_RIP;
+            cache->stats.invalidations++;
+            continue;
+        }
+        cache->used[n++] = cache->used[i];
+    }
+    cache->num_used = n;
+
+    uint32_t epoch = vm_code_epoch(vm);
+    Block* block;
+    for (block = cache->all_blocks; block != NULL; block = block->next) {
+        block->invalid = !is_valid(vm, block);
+    }
+    cache->stats.block_invalidations += remove_invalid_blocks(cache, epoch);
+    // The entries may point into the blocks that went.
+    emu->ras_count = 0;
+    cache->epoch = epoch;
+}
+
+Instr* cache_lookup(Emulator* emu, uint64_t rip) {
+    CodeCache* cache = emu->cache;
+    if (vm_code_epoch(emu->memory) != cache->epoch) {
+        revalidate(emu);
+    }
+    DecodeEntry* entry = &cache->entries[rip & (DECODE_CACHE_ENTRIES - 1)];
+    if (entry->rip == rip) {
+        cache->stats.hits++;
+        return &entry->instr;
+    }
+    cache->stats.misses++;
+    uint32_t gen = vm_code_gen(emu->memory, rip);
+    Instr instr;
+    if (!decode_instruction(emu, rip, &instr)) {
+        return NULL;
+    }
+    if (entry->rip == EMPTY_RIP) {
+        cache->used[cache->num_used++] = entry - cache->entries;
+    }
+    entry->instr = instr;
+    entry->rip = rip;
+    entry->gen = gen;
+    entry->end_gen = vm_code_gen(emu->memory, rip + entry->instr.len - 1);
+    return &entry->instr;
+}
+
+Block* cache_new_block(uint64_t start, int num_instrs) {
+    Block* block = malloc(sizeof(Block) + (num_instrs + 1) * sizeof(Instr));
+    block->start = start;
+    block->num_ranges = 1;
+    block->exec_count = 0;
+    block->native = NULL;
+    block->jit_queued = 0;
+    for (int i = 0; i <= BLOCK_LINKS; i++) {
+        BlockLink* link = i < BLOCK_LINKS ? &block->links[i] : &block->return_link;
+        link->rip = EMPTY_RIP;
+        link->block = NULL;
+        link->side_exit = 0;
+        link->count = 0;
+        link->native = NULL;
+        link->jump = NULL;
+    }
+    block->indirect = 0;
+    block->next_link = 0;
+    block->invalid = 0;
+    block->idiom.kind = IDIOM_NONE;
+    block->warm = 0;
+    block->num_instrs = num_instrs;
+    init_block_end(&block->instrs[num_instrs]);
+    return block;
+}
+
+static void add_link(Block* block, uint64_t rip, int side_exit) {
+    int i = 0;
+    while (i < BLOCK_LINKS - 1 && block->links[i].rip != EMPTY_RIP && block->links[i].rip != rip) {
+        i++;
+    }
+    if (block->links[i].rip == EMPTY_RIP) {
+        block->links[i].rip = rip;
+        block->links[i].side_exit = side_exit;
+    }
+}
+
+// The links of the way block leaves through last, its last instruction.
+static void add_exits(Block* block, Instr* last) {
+    if (last->op == OP_CALL || last->op == OP_CALL_RM) {
+        block->return_link.rip = block->end;
+    }
+    if (!last->ends_block) {
+        add_link(block, block->end, 0);
+    } else if (last->op == OP_JMP || last->op == OP_CALL) {
+        add_link(block, last->imm, 0);
+    } else if (OP_JO <= last->op && last->op <= OP_JG) {
+        add_link(block, last->imm, 0);
+        add_link(block, block->end, 0);
+    } else {
+        block->indirect = 1;
+    }
+}
+
+// A backward pass over the instructions of block that drops the flags of
+// those that set them only for the next flag setter to set them again.
+// The flags are live wherever block may be left, so at the end and at the
+// jumps of a trace, which read them anyway.
+static void drop_dead_flags(CodeCache* cache, Block* block) {
+    int live = 1;
+    for (int i = block->num_instrs - 1; i >= 0; i--) {
+        Instr* instr = &block->instrs[i];
+        int access = flags_access(instr);
+        if (access & WRITES_FLAGS) {
+            cache->stats.flag_writes++;
+            if (!live && (instr->flags_dead || drop_flags(instr))) {
+                cache->stats.dead_flag_writes++;
+            }
+            live = 0;
+        }
+        if (access & READS_FLAGS) {
+            live = 1;
+        }
+    }
+}
+
+// Turns the sequences of enum Fusion in block into superinstructions.
+// Runs after drop_dead_flags(), which may give an instruction another
+// thread.
+static void fuse_block(Block* block) {
+    memset(block->fusions, 0, sizeof(block->fusions));
+    int i = 0;
+    while (i < block->num_instrs) {
+        int fusion = fuse_instrs(&block->instrs[i], block->num_instrs - i);
+        block->fusions[fusion]++;
+        i += fusion_length(fusion);
+    }
+}
+
+Block* cache_get_block(Emulator* emu, uint64_t rip) {
+    CodeCache* cache = emu->cache;
+    if (vm_code_epoch(emu->memory) != cache->epoch) {
+        revalidate(emu);
+    }
+    Block* block;
+    for (block = cache->blocks[block_hash(rip)]; block != NULL; block = block->hash_next) {
+        if (block->start == rip) {
+            return block;
+        }
+    }
+    if (cache->disk != NULL && (block = disk_cache_load(cache->disk, emu, rip)) != NULL) {
+        cache->stats.idioms[block->idiom.kind]++;
+        insert_block(cache, block);
+        return block;
+    }
+
+    Instr instrs[BLOCK_MAX_INSTRS];
+    uint32_t gen = vm_code_gen(emu->memory, rip);
+    uint64_t end = rip;
+    int n = 0;
+    while (n < BLOCK_MAX_INSTRS) {
+        Instr* instr = cache_lookup(emu, end);
+        if (instr == NULL) {
+            break;
+        }
+        instrs[n++] = *instr;
+        end += instr->len;
+        if (instr->ends_block) {
+            break;
+        }
+    }
+    if (n == 0) {
+        return NULL;
+    }
+
+    block = cache_new_block(rip, n);
+    block->end = end;
+    block->ranges[0].start = rip;
+    block->ranges[0].end = end;
+    block->ranges[0].gen = gen;
+    block->ranges[0].end_gen = vm_code_gen(emu->memory, end - 1);
+    memcpy(block->instrs, instrs, n * sizeof(Instr));
+    add_exits(block, &block->instrs[n - 1]);
+    drop_dead_flags(cache, block);
+    fuse_block(block);
+    cache->stats.idioms[find_loop_idiom(block->instrs, n, rip, &block->idiom)]++;
+    insert_block(cache, block);
+    return block;
+}
+
+// Blocks whose exits are all direct, other than calls, which the
+// return-address stack needs at the end of a block. Loops of enum Idiom
+// stay on their own, since they run in one go.
+static int can_trace(Block* block) {
+    return block->num_ranges == 1 && !block->indirect && block->return_link.rip == EMPTY_RIP
+           && block->idiom.kind == IDIOM_NONE;
+}
+
+// The way the jump at the end of block usually went, or TRACE_NONE.
+static int usual_direction(Block* block) {
+    Instr* last = &block->instrs[block->num_instrs - 1];
+    if (last->op == OP_JMP) {
+        return TRACE_TAKEN;
+    }
+    if (last->op < OP_JO || OP_JG < last->op) {
+        return TRACE_NONE;
+    }
+    // links[1] is missing if the jump goes to the next instruction.
+    uint64_t taken = block->links[0].count;
+    uint64_t not_taken = block->links[1].count;
+    uint64_t total = taken + not_taken;
+    if (total < TRACE_MIN_SAMPLES) {
+        return TRACE_NONE;
+    }
+    if (taken * 4 >= total * 3) {
+        return TRACE_TAKEN;
+    }
+    if (not_taken * 4 >= total * 3) {
+        return TRACE_FALLTHROUGH;
+    }
+    return TRACE_NONE;
+}
+
+// Builds a trace from head and the blocks that usually run after it, and
+// puts it in place of head. Returns NULL if there is no such block.
+static Block* build_trace(Emulator* emu, Block* head) {
+    CodeCache* cache = emu->cache;
+    Block* parts[TRACE_MAX_BLOCKS];
+    int dirs[TRACE_MAX_BLOCKS];
+    int i, n = 0, num_instrs = 0;
+    Block* part = head;
+    while (1) {
+        parts[n++] = part;
+        num_instrs += part->num_instrs;
+        if (n == TRACE_MAX_BLOCKS) {
+            break;
+        }
+        Instr* last = &part->instrs[part->num_instrs - 1];
+        uint64_t next = part->end;
+        dirs[n - 1] = TRACE_NONE;
+        if (last->ends_block) {
+            dirs[n - 1] = usual_direction(part);
+            if (dirs[n - 1] == TRACE_NONE) {
+                break;
+            }
+            if (dirs[n - 1] == TRACE_TAKEN) {
+                next = last->imm;
+            }
+        }
+        if (next == head->start) {
+            break;  // a loop, which the last exit links back to
+        }
+        part = cache_get_block(emu, next);
+        if (part == NULL || !can_trace(part) || num_instrs + part->num_instrs > TRACE_MAX_INSTRS) {
+            break;
+        }
+        for (i = 0; i < n && parts[i] != part; i++) {
+        }
+        if (i < n) {
+            break;
+        }
+    }
+    if (n == 1) {
+        return NULL;
+    }
+
+    Block* trace = cache_new_block(head->start, num_instrs);
+    Instr* instr = trace->instrs;
+    for (i = 0; i < n; i++) {
+        memcpy(instr, parts[i]->instrs, parts[i]->num_instrs * sizeof(Instr));
+        instr += parts[i]->num_instrs;
+        trace->ranges[i] = parts[i]->ranges[0];
+        Instr* last = instr - 1;
+        if (i < n - 1 && last->ends_block) {
+            init_trace_jump(last, dirs[i]);
+            if (last->op != OP_JMP) {
+                add_link(trace, dirs[i] == TRACE_TAKEN ? parts[i]->end : last->imm, 1);
+            }
+        }
+    }
+    trace->num_ranges = n;
+    trace->end = parts[n - 1]->end;
+    add_exits(trace, instr - 1);
+    drop_dead_flags(cache, trace);
+    fuse_block(trace);
+
+    head->invalid = 1;
+    remove_invalid_blocks(cache, cache->epoch);
+    insert_block(cache, trace);
+    cache->stats.num_traces++;
+    cache->stats.trace_blocks += n;
+    cache->stats.trace_instrs += num_instrs;
+    return trace;
+}
+
+static void ras_push(Emulator* emu, BlockLink* link) {
+    emu->ras_top = (emu->ras_top + 1) % RAS_SIZE;
+    emu->ras[emu->ras_top].rip = link->rip;
+    emu->ras[emu->ras_top].link = link;
+    if (emu->ras_count < RAS_SIZE) {
+        emu->ras_count++;
+    }
+}
+
+static Block* follow(Emulator* emu, Block* from, int native) {
+    CodeCache* cache = emu->cache;
+    uint64_t rip = emu->rip;
+    if (vm_code_epoch(emu->memory) != cache->epoch) {
+        // from may be one of the blocks that go.
+        revalidate(emu);
+        from = NULL;
+    }
+    if (from == NULL) {
+        return cache_get_block(emu, rip);
+    }
+
+    // Translated blocks push and pop the return-address stack themselves,
+    // except for a ret they could not follow.
+    BlockLink* link = NULL;
+    int op = from->instrs[from->num_instrs - 1].op;
+    if (op == OP_CALL || op == OP_CALL_RM) {
+        if (!native) {
+            ras_push(emu, &from->return_link);
+        }
+    } else if (op == OP_RET && emu->ras_count > 0) {
+        ReturnAddress* top = &emu->ras[emu->ras_top];
+        emu->ras_top = (emu->ras_top - 1) % RAS_SIZE;
+        emu->ras_count--;
+        if (top->rip == rip) {
+            link = top->link;
+        }
+    }
+    if (link != NULL) {
+        cache->stats.ras_hits++;
+        if (link->block == NULL) {
+            set_link(NULL, link, cache_get_block(emu, rip), cache->epoch);
+        } else {
+            set_link(NULL, link, link->block, cache->epoch);
+        }
+        return link->block;
+    }
+    if (op == OP_RET) {
+        cache->stats.ras_misses++;
+    }
+
+    for (int i = 0; i < BLOCK_LINKS; i++) {
+        if (from->links[i].rip == rip) {
+            link = &from->links[i];
+            break;
+        }
+    }
+    if (link != NULL && !native) {
+        link->count++;
+    }
+    if (link != NULL && link->block != NULL) {
+        cache->stats.link_hits++;
+        // Either end may have been translated since, or the link is stale
+        // after other code changed.
+        set_link(from, link, link->block, cache->epoch);
+        return link->block;
+    }
+    if (link == NULL && from->indirect) {
+        link = &from->links[from->next_link];
+        from->next_link = (from->next_link + 1) % BLOCK_LINKS;
+        set_link(from, link, NULL, cache->epoch);
+        link->rip = rip;
+    }
+    Block* block = cache_get_block(emu, rip);
+    if (block != NULL && link != NULL) {
+        set_link(from, link, block, cache->epoch);
+    }
+    return block;
+}
+
+Block* cache_next_block(Emulator* emu, Block* from, int native) {
+    Block* block = follow(emu, from, native);
+    if (block != NULL && block->exec_count == TRACE_THRESHOLD && can_trace(block)) {
+        Block* trace = build_trace(emu, block);
+        if (trace != NULL) {
+            return trace;
+        }
+    }
+    return block;
+}
+
+void run_block(Emulator* emu, Block* block) {
+    Instr* instr = block->instrs;
+    block->exec_count++;
+    if (block->idiom.kind != IDIOM_NONE) {
+        uint64_t bytes = run_loop_idiom(emu, &block->idiom, block->start, block->end);
+        if (bytes > 0) {
+            emu->rip = block->end;
+            emu->cache->stats.idiom_runs++;
+            emu->cache->stats.idiom_bytes += bytes;
+            return;
+        }
+    }
+    emu->rip += instr->len;
+    instr->thread(emu, instr);
+}
+
+int cache_hot_blocks(CodeCache* cache, Block** blocks, int max) {
+    int n = 0;
+    Block* block;
+    for (block = cache->all_blocks; block != NULL; block = block->next) {
+        if (max == 0 || (n == max && blocks[n - 1]->exec_count >= block->exec_count)) {
+            continue;
+        }
+        // Insert into the sorted array, dropping the coldest one if full.
+        int i = n < max ? n++ : n - 1;
+        while (i > 0 && blocks[i - 1]->exec_count < block->exec_count) {
+            blocks[i] = blocks[i - 1];
+            i--;
+        }
+        blocks[i] = block;
+    }
+    return n;
+}
+
+Block* cache_blocks(CodeCache* cache) {
+    return cache->all_blocks;
+}
+
+void cache_get_stats(CodeCache* cache, CodeCacheStats* stats) {
+    *stats = cache->stats;
+    stats->trace_runs = 0;
+    stats->side_exits = 0;
+    stats->instrs_run = 0;
+    stats->trace_instrs_run = 0;
+    for (int i = FUSE_NONE + 1; i < NUM_FUSIONS; i++) {
+        stats->fusion_runs[i] = fusion_run_count(i);
+    }
+    Block* block;
+    for (block = cache->all_blocks; block != NULL; block = block->next) {
+        uint64_t instrs_run = block->exec_count * block->num_instrs;
+        stats->instrs_run += instrs_run;
+        for (int i = FUSE_NONE + 1; i < NUM_FUSIONS; i++) {
+            stats->fusions[i] += block->fusions[i];
+        }
+        if (block->num_ranges == 1) {
+            continue;
+        }
+        stats->trace_runs += block->exec_count;
+        stats->trace_instrs_run += instrs_run;
+        for (int i = 0; i < BLOCK_LINKS; i++) {
+            if (block->links[i].side_exit) {
+                stats->side_exits += block->links[i].count;
+            }
+        }
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef CODE_CACHE_H_
+#define CODE_CACHE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "idiom.h"
+#include "instruction.h"
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;  // entries dropped because their code was written
+    uint64_t num_blocks;
+    uint64_t block_invalidations;
+    uint64_t link_hits;  // next blocks found through a link of the previous one
+    uint64_t ras_hits;   // returns found through the return-address stack
+    uint64_t ras_misses;
+    uint64_t num_traces;     // built so far
+    uint64_t trace_blocks;   // blocks copied into them
+    uint64_t trace_instrs;
+    // Of the traces still cached: how often they ran, left by a side exit,
+    // and the instructions of all blocks and of traces that ran, counting
+    // each run as a whole block.
+    uint64_t trace_runs;
+    uint64_t side_exits;
+    uint64_t instrs_run;
+    uint64_t trace_instrs_run;
+    // Flag-setting instructions in the blocks built so far, and those whose
+    // flags nothing reads.
+    uint64_t flag_writes;
+    uint64_t dead_flag_writes;
+    // Superinstructions in the blocks still cached, by enum Fusion, and how
+    // often any ran (see fusion_run_count()).
+    uint64_t fusions[NUM_FUSIONS];
+    uint64_t fusion_runs[NUM_FUSIONS];
+    // Blocks found to be loops of enum Idiom, and how often they ran as
+    // such, on how many bytes in all.
+    uint64_t idioms[NUM_IDIOMS];
+    uint64_t idiom_runs;
+    uint64_t idiom_bytes;
+} CodeCacheStats;
+
+// A trace strings together up to this many blocks along the way their jumps
+// usually go, so that it has a side exit for each but the last one.
+#define TRACE_MAX_BLOCKS 4
+#define BLOCK_LINKS (TRACE_MAX_BLOCKS + 1)
+
+struct Block_t;
+
+// A successor of a block, cached so that going there needs no lookup.
+// Direct exits have a fixed rip per link: the side exits of a trace, the
+// branch target, then the fall-through. Indirect exits (ret, jmp and call
+// through r/m) keep the last targets seen.
+typedef struct BlockLink_t {
+    uint64_t rip;
+    struct Block_t* block;  // the block at rip, or NULL while unlinked
+    uint32_t epoch;         // vm_code_epoch() when block was last known valid
+    int side_exit;
+    // Times the interpreter left through it, which picks the way a trace
+    // goes. Translated code counts side exits only.
+    uint64_t count;
+    // For translated blocks (see jit.c): the entry of block->native if both
+    // ends are translated, and the rel32 of the jmp of a direct exit.
+    void* native;
+    uint8_t* jump;
+} BlockLink;
+
+// Guest code that a block was built from.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    // vm_code_gen() of the first and the last byte when it was built.
+    uint32_t gen;
+    uint32_t end_gen;
+} BlockRange;
+
+// A basic block: straight-line instructions up to and including the first
+// one that ends a block (a jump, call or ret). Or a trace, which replaces
+// the block at its start with the blocks that usually run after it, and
+// whose inner jumps leave it only when they go the other way (see
+// init_trace_jump()).
+typedef struct Block_t {
+    uint64_t start;
+    uint64_t end;  // address following the last instruction
+    BlockRange ranges[TRACE_MAX_BLOCKS];
+    int num_ranges;  // more than one for a trace
+    uint64_t exec_count;
+    // Host code translated by the JIT (see jit.h), or NULL. It returns the
+    // block it left from, which is another one if it followed links. Set by
+    // the compiler thread.
+    struct Block_t* (*_Atomic native)(Emulator* emu);
+    int jit_queued;
+    BlockLink links[BLOCK_LINKS];
+    // For blocks that end in a call: the link to where it returns, which
+    // the call pushes on the return-address stack.
+    BlockLink return_link;
+    int indirect;   // links are a cache of indirect targets
+    int next_link;  // the indirect link to replace next
+    int invalid;
+    struct Block_t* hash_next;
+    struct Block_t* next;
+    uint16_t fusions[NUM_FUSIONS];  // superinstructions by enum Fusion
+    LoopIdiom idiom;  // what run_block() runs in bulk instead
+    // Loaded from the disk cache (see disk_cache.h) after an earlier run
+    // translated it.
+    int warm;
+    int num_instrs;
+    Instr instrs[];  // followed by the init_block_end() sentinel
+} Block;
+
+struct DiskCache_t;
+
+CodeCache* cache_init(void);
+void cache_destroy(CodeCache* cache);
+// Makes cache_get_block() take the blocks it finds in disk before decoding
+// them (see disk_cache.h).
+void cache_set_disk(CodeCache* cache, struct DiskCache_t* disk);
+// Allocates a block of num_instrs instructions at start, ending in the
+// init_block_end() sentinel, with no links.
+Block* cache_new_block(uint64_t start, int num_instrs);
+// Returns the decoded instruction at rip, decoding it on the first call and
+// whenever the guest wrote to its bytes since. Returns NULL if the opcode
+// is unknown.
+Instr* cache_lookup(Emulator* emu, uint64_t rip);
+// Returns the block starting at rip, building it if needed. Returns NULL
+// if the opcode at rip is unknown.
+Block* cache_get_block(Emulator* emu, uint64_t rip);
+// Returns the block at emu->rip, which from (or NULL) has just jumped to,
+// and links from to it. Same as cache_get_block() otherwise. native tells
+// whether from ran as host code.
+Block* cache_next_block(Emulator* emu, Block* from, int native);
+// Runs the block with threaded dispatch, or all iterations of a loop of
+// enum Idiom at once. emu->rip must be block->start.
+void run_block(Emulator* emu, Block* block);
+// Stores up to max blocks with the highest exec_count into blocks, hottest
+// first, and returns how many were stored.
+int cache_hot_blocks(CodeCache* cache, Block** blocks, int max);
+// The cached blocks, linked through Block.next.
+Block* cache_blocks(CodeCache* cache);
+void cache_get_stats(CodeCache* cache, CodeCacheStats* stats);
+
+#endif
@@ -0,0 +1,407 @@
+#define _DEFAULT_SOURCE  // MAP_PRIVATE and fstat()
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "disk_cache.h"
+#include "virtual_memory.h"
+
+// The file is a DiskHeader, an index of DiskIndex sorted by rip, then a
+// DiskBlock with its instructions for each entry, all 8-byte aligned.
+#define DISK_CACHE_MAGIC "x86blk01"
+
+// Remembers the hash of a guest page for as long as its write generation
+// stays the same, so that the blocks on one page hash it once.
+#define PAGE_HASH_BITS 8
+#define PAGE_HASH_ENTRIES (1 << PAGE_HASH_BITS)
+
+typedef struct {
+    char magic[8];
+    uint64_t build;  // hash of the emulator binary
+    uint64_t num_entries;
+} DiskHeader;
+
+typedef struct {
+    uint64_t rip;
+    uint64_t offset;  // of the DiskBlock from the start of the file
+} DiskIndex;
+
+// A BlockRange and the hashes of the pages of its first and its last byte.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t page_hash[2];
+} DiskRange;
+
+// A Block without its run-time state. The exec and thread handlers of the
+// instructions are offsets from init_instructions().
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    DiskRange ranges[TRACE_MAX_BLOCKS];
+    uint64_t link_rips[BLOCK_LINKS];
+    uint64_t return_rip;
+    LoopIdiom idiom;
+    uint16_t fusions[NUM_FUSIONS];
+    uint8_t side_exits[BLOCK_LINKS];
+    uint8_t num_ranges;
+    uint8_t indirect;
+    uint8_t translated;  // by the JIT in the run that saved it
+    uint32_t num_instrs;
+    Instr instrs[];
+} DiskBlock;
+
+typedef struct {
+    uint64_t page;
+    uint32_t gen;
+    uint64_t hash;
+} PageHash;
+
+struct DiskCache_t {
+    char* path;
+    uint64_t build;
+    uint8_t* map;  // the file, or NULL if there was none
+    size_t size;
+    const DiskIndex* index;
+    uint64_t num_entries;
+    // Per entry: its code changed, so that the file drops it.
+    uint8_t* stale;
+    PageHash page_hashes[PAGE_HASH_ENTRIES];
+    DiskCacheStats stats;
+};
+
+static uint64_t hash_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 29);
+}
+
+// Hashes the emulator binary, which tells one build from another.
+static int hash_build(uint64_t* hash) {
+    FILE* fp = fopen("/proc/self/exe", "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    uint64_t words[512];
+    size_t n;
+    *hash = 0;
+    while ((n = fread(words, 1, sizeof(words), fp)) > 0) {
+        // A short last read leaves stale bytes past n, so pad with zeros.
+        memset((uint8_t*) words + n, 0, sizeof(words) - n);
+        for (size_t i = 0; i < (n + 7) / 8; i++) {
+            *hash = hash_word(*hash, words[i]);
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static uint64_t page_hash(DiskCache* disk, VirtualMemory* vm, uint64_t addr) {
+    uint64_t page = addr & ~(uint64_t) (VM_PAGE_SIZE - 1);
+    // Getting the generation first makes any later store change it.
+    uint32_t gen = vm_code_gen(vm, page);
+    PageHash* entry = &disk->page_hashes[(page / VM_PAGE_SIZE) & (PAGE_HASH_ENTRIES - 1)];
+    if (entry->page == page && entry->gen == gen) {
+        return entry->hash;
+    }
+    uint64_t hash = page;
+    for (uint64_t i = 0; i < VM_PAGE_SIZE; i += 8) {
+        hash = hash_word(hash, vm_get_memory64(vm, page + i));
+    }
+    entry->page = page;
+    entry->gen = gen;
+    entry->hash = hash;
+    return hash;
+}
+
+static size_t disk_block_size(uint64_t num_instrs) {
+    return sizeof(DiskBlock) + num_instrs * sizeof(Instr);
+}
+
+static uintptr_t handler_base(void) {
+    return (uintptr_t) &init_instructions;
+}
+
+// Checks the header and that every entry lies within the file.
+static int check_file(DiskCache* disk) {
+    const DiskHeader* header = (const DiskHeader*) disk->map;
+    if (disk->size < sizeof(DiskHeader) || memcmp(header->magic, DISK_CACHE_MAGIC, 8) != 0
+        || header->build != disk->build
+        || header->num_entries > (disk->size - sizeof(DiskHeader)) / sizeof(DiskIndex)) {
+        return 0;
+    }
+    disk->index = (const DiskIndex*) (disk->map + sizeof(DiskHeader));
+    disk->num_entries = header->num_entries;
+    for (uint64_t i = 0; i < disk->num_entries; i++) {
+        uint64_t offset = disk->index[i].offset;
+        if (offset % 8 != 0 || offset > disk->size - sizeof(DiskBlock)) {
+            return 0;
+        }
+        const DiskBlock* entry = (const DiskBlock*) (disk->map + offset);
+        if (entry->num_instrs == 0 || disk_block_size(entry->num_instrs) > disk->size - offset
+            || entry->num_ranges == 0 || entry->num_ranges > TRACE_MAX_BLOCKS) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+DiskCache* disk_cache_open(const char* path) {
+    DiskCache* disk = calloc(1, sizeof(DiskCache));
+    if (!hash_build(&disk->build)) {
+        free(disk);
+        return NULL;
+    }
+    disk->path = strdup(path);
+    for (int i = 0; i < PAGE_HASH_ENTRIES; i++) {
+        disk->page_hashes[i].page = UINT64_MAX;
+    }
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return disk;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        disk->size = st.st_size;
+        disk->map = mmap(NULL, disk->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (disk->map == MAP_FAILED) {
+            disk->map = NULL;
+        }
+    }
+    close(fd);
+    if (disk->map != NULL && !check_file(disk)) {
+        // Written by another build, or cut short.
+        munmap(disk->map, disk->size);
+        disk->map = NULL;
+        disk->num_entries = 0;
+    }
+    disk->stale = calloc(disk->num_entries + 1, 1);
+    disk->stats.entries = disk->num_entries;
+    return disk;
+}
+
+void disk_cache_close(DiskCache* disk) {
+    if (disk->map != NULL) {
+        munmap(disk->map, disk->size);
+    }
+    free(disk->stale);
+    free(disk->path);
+    free(disk);
+}
+
+// Returns the index of the entry for rip, or -1.
+static int64_t find_entry(DiskCache* disk, uint64_t rip) {
+    uint64_t lo = 0, hi = disk->num_entries;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (disk->index[mid].rip < rip) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < disk->num_entries && disk->index[lo].rip == rip ? (int64_t) lo : -1;
+}
+
+Block* disk_cache_load(DiskCache* disk, Emulator* emu, uint64_t rip) {
+    int64_t i = find_entry(disk, rip);
+    if (i < 0 || disk->stale[i]) {
+        return NULL;
+    }
+    const DiskBlock* entry = (const DiskBlock*) (disk->map + disk->index[i].offset);
+    VirtualMemory* vm = emu->memory;
+    int r;
+    for (r = 0; r < entry->num_ranges; r++) {
+        const DiskRange* range = &entry->ranges[r];
+        if (page_hash(disk, vm, range->start) != range->page_hash[0]
+            || page_hash(disk, vm, range->end - 1) != range->page_hash[1]) {
+            disk->stale[i] = 1;
+            disk->stats.stale++;
+            return NULL;
+        }
+    }
+
+    Block* block = cache_new_block(rip, entry->num_instrs);
+    block->end = entry->end;
+    block->num_ranges = entry->num_ranges;
+    for (r = 0; r < entry->num_ranges; r++) {
+        BlockRange* range = &block->ranges[r];
+        range->start = entry->ranges[r].start;
+        range->end = entry->ranges[r].end;
+        // Unchanged since page_hash() took them.
+        range->gen = vm_code_gen(vm, range->start);
+        range->end_gen = vm_code_gen(vm, range->end - 1);
+    }
+    for (int l = 0; l < BLOCK_LINKS; l++) {
+        block->links[l].rip = entry->link_rips[l];
+        block->links[l].side_exit = entry->side_exits[l];
+    }
+    block->return_link.rip = entry->return_rip;
+    block->indirect = entry->indirect;
+    block->idiom = entry->idiom;
+    memcpy(block->fusions, entry->fusions, sizeof(block->fusions));
+    block->warm = entry->translated;
+    memcpy(block->instrs, entry->instrs, entry->num_instrs * sizeof(Instr));
+    uintptr_t base = handler_base();
+    for (uint32_t k = 0; k < entry->num_instrs; k++) {
+        Instr* instr = &block->instrs[k];
+        instr->exec = (instruction_func_t*) (base + (uintptr_t) instr->exec);
+        instr->thread = (instruction_func_t*) (base + (uintptr_t) instr->thread);
+    }
+    disk->stats.loaded++;
+    return block;
+}
+
+// An entry of the new file: a block of this run, or an entry of the old
+// file kept as it is.
+typedef struct {
+    uint64_t rip;
+    Block* block;
+    const DiskBlock* old;
+    uint64_t offset;
+} SaveEntry;
+
+static int compare_entries(const void* a, const void* b) {
+    uint64_t rip_a = ((const SaveEntry*) a)->rip;
+    uint64_t rip_b = ((const SaveEntry*) b)->rip;
+    return rip_a < rip_b ? -1 : rip_a > rip_b;
+}
+
+static int is_valid(VirtualMemory* vm, Block* block) {
+    for (int i = 0; i < block->num_ranges; i++) {
+        BlockRange* range = &block->ranges[i];
+        if (vm_code_gen(vm, range->start) != range->gen || vm_code_gen(vm, range->end - 1) != range->end_gen) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void write_block(DiskCache* disk, VirtualMemory* vm, Block* block, FILE* fp) {
+    size_t size = disk_block_size(block->num_instrs);
+    DiskBlock* entry = calloc(1, size);
+    entry->start = block->start;
+    entry->end = block->end;
+    entry->num_ranges = block->num_ranges;
+    for (int r = 0; r < block->num_ranges; r++) {
+        DiskRange* range = &entry->ranges[r];
+        range->start = block->ranges[r].start;
+        range->end = block->ranges[r].end;
+        // The pages are as they were when the block was built, or it would
+        // not be valid.
+        range->page_hash[0] = page_hash(disk, vm, range->start);
+        range->page_hash[1] = page_hash(disk, vm, range->end - 1);
+    }
+    for (int l = 0; l < BLOCK_LINKS; l++) {
+        entry->link_rips[l] = block->links[l].rip;
+        entry->side_exits[l] = block->links[l].side_exit;
+    }
+    entry->return_rip = block->return_link.rip;
+    entry->indirect = block->indirect;
+    entry->idiom = block->idiom;
+    memcpy(entry->fusions, block->fusions, sizeof(entry->fusions));
+    entry->translated = block->native != NULL || block->warm;
+    entry->num_instrs = block->num_instrs;
+    uintptr_t base = handler_base();
+    for (int k = 0; k < block->num_instrs; k++) {
+        Instr* instr = &entry->instrs[k];
+        // Field by field, so that the padding stays zero.
+        instr->modrm = block->instrs[k].modrm;
+        instr->reg = block->instrs[k].reg;
+        instr->size = block->instrs[k].size;
+        instr->rep = block->instrs[k].rep;
+        instr->len = block->instrs[k].len;
+        instr->ends_block = block->instrs[k].ends_block;
+        instr->op = block->instrs[k].op;
+        instr->trace_dir = block->instrs[k].trace_dir;
+        instr->flags_dead = block->instrs[k].flags_dead;
+        instr->imm = block->instrs[k].imm;
+        instr->exec = (instruction_func_t*) ((uintptr_t) block->instrs[k].exec - base);
+        instr->thread = (instruction_func_t*) ((uintptr_t) block->instrs[k].thread - base);
+    }
+    fwrite(entry, size, 1, fp);
+    free(entry);
+}
+
+int disk_cache_save(DiskCache* disk, Emulator* emu) {
+    VirtualMemory* vm = emu->memory;
+    uint64_t num_blocks = 0, n = 0, i;
+    Block* block;
+    for (block = cache_blocks(emu->cache); block != NULL; block = block->next) {
+        num_blocks++;
+    }
+    SaveEntry* entries = malloc((num_blocks + disk->num_entries + 1) * sizeof(SaveEntry));
+    for (block = cache_blocks(emu->cache); block != NULL; block = block->next) {
+        if (is_valid(vm, block)) {
+            entries[n].rip = block->start;
+            entries[n].block = block;
+            entries[n].old = NULL;
+            n++;
+        }
+    }
+    // The blocks of this run replace the old entries at the same rip.
+    qsort(entries, n, sizeof(SaveEntry), compare_entries);
+    uint64_t num_new = n;
+    for (i = 0; i < disk->num_entries; i++) {
+        SaveEntry key = {.rip = disk->index[i].rip};
+        if (disk->stale[i] || bsearch(&key, entries, num_new, sizeof(SaveEntry), compare_entries) != NULL) {
+            continue;
+        }
+        entries[n].rip = key.rip;
+        entries[n].block = NULL;
+        entries[n].old = (const DiskBlock*) (disk->map + disk->index[i].offset);
+        n++;
+    }
+    qsort(entries, n, sizeof(SaveEntry), compare_entries);
+
+    uint64_t offset = sizeof(DiskHeader) + n * sizeof(DiskIndex);
+    for (i = 0; i < n; i++) {
+        entries[i].offset = offset;
+        offset += disk_block_size(entries[i].block != NULL ? entries[i].block->num_instrs : entries[i].old->num_instrs);
+    }
+
+    // Written next to the file and renamed over it, so that a run starting
+    // meanwhile maps either the old file or the new one.
+    size_t len = strlen(disk->path) + 32;
+    char* tmp_path = malloc(len);
+    snprintf(tmp_path, len, "%s.%ld", disk->path, (long) getpid());
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(tmp_path);
+        free(entries);
+        return -1;
+    }
+    DiskHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_CACHE_MAGIC, 8);
+    header.build = disk->build;
+    header.num_entries = n;
+    fwrite(&header, sizeof(header), 1, fp);
+    for (i = 0; i < n; i++) {
+        DiskIndex index = {entries[i].rip, entries[i].offset};
+        fwrite(&index, sizeof(index), 1, fp);
+    }
+    for (i = 0; i < n; i++) {
+        if (entries[i].block != NULL) {
+            write_block(disk, vm, entries[i].block, fp);
+        } else {
+            fwrite(entries[i].old, disk_block_size(entries[i].old->num_instrs), 1, fp);
+        }
+    }
+    int ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok && rename(tmp_path, disk->path) == 0;
+    if (!ok) {
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    free(entries);
+    return ok ? (int) n : -1;
+}
+
+void disk_cache_get_stats(DiskCache* disk, DiskCacheStats* stats) {
+    *stats = disk->stats;
+}
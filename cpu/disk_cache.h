@@ -0,0 +1,39 @@
+#ifndef DISK_CACHE_H_
+#define DISK_CACHE_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "code_cache.h"
+
+// Blocks (see code_cache.h) saved by earlier runs, so that running the same
+// program again takes them as they are instead of decoding and optimizing
+// them again, and queues the ones translated before for the JIT at once.
+//
+// The file belongs to one build of the emulator: it is keyed by a hash of
+// the emulator binary, and handler pointers are stored relative to it.
+// Each entry keeps a hash of the guest pages its code is on, and is used
+// only while those pages hash the same.
+typedef struct DiskCache_t DiskCache;
+
+typedef struct {
+    uint64_t entries;  // in the file when it was opened
+    uint64_t loaded;   // blocks built from them
+    uint64_t stale;    // entries whose code changed since
+} DiskCacheStats;
+
+// Maps the file at path if it exists and was written by this build, or
+// starts an empty cache for disk_cache_save() to create it. Returns NULL if
+// the emulator binary cannot be read to tell its build.
+DiskCache* disk_cache_open(const char* path);
+void disk_cache_close(DiskCache* disk);
+// Builds the block at rip from its entry, if there is one and the pages it
+// was built from are unchanged. Returns NULL otherwise.
+Block* disk_cache_load(DiskCache* disk, Emulator* emu, uint64_t rip);
+// Replaces the file with the valid blocks of emu->cache and the entries of
+// the old file that this run did not reach. Returns the number of entries,
+// or -1 if the file cannot be written.
+int disk_cache_save(DiskCache* disk, Emulator* emu);
+void disk_cache_get_stats(DiskCache* disk, DiskCacheStats* stats);
+
+#endif
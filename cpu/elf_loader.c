@@ -63,13 +63,18 @@ void parse_elf64(void *head, Emulator* emu) {
         exit(1);
     }
 
-    // It is not required to clear .bss fields by zero because memories are initialized with 0.
+    // Segments are not copied here. Pages are faulted in from the file mapping
+    // on first touch, and .bss (p_memsz > p_filesz) reads as zero.
     Elf64_Phdr *phdr;
     for (i = 0; i < ehdr->e_phnum; i++) {
         phdr = (Elf64_Phdr *) (head + ehdr->e_phoff + ehdr->e_phentsize * i);
         if (phdr->p_type == PT_LOAD) {
-            vm_memcpy(emu->memory, phdr->p_vaddr,
-                      head+phdr->p_offset, phdr->p_filesz);
+            int prot = 0;
+            if (phdr->p_flags & PF_R) prot |= VM_PROT_READ;
+            if (phdr->p_flags & PF_W) prot |= VM_PROT_WRITE;
+            if (phdr->p_flags & PF_X) prot |= VM_PROT_EXEC;
+            vm_map(emu->memory, phdr->p_vaddr, phdr->p_memsz,
+                   head+phdr->p_offset, phdr->p_filesz, prot);
         }
     }
 
@@ -88,7 +93,7 @@ Emulator* load_elf64(char* filepath) {
     struct stat sb;
     fstat(fd, &sb);
 
-    head = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    head = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
     // Set dummy RIP address which is overwritten in parse_elf64().
     // Here we set RSP as 0x8000000 since I found following interesting article
@@ -97,7 +102,8 @@ Emulator* load_elf64(char* filepath) {
     Emulator* emu = create_emu(0x0, 0x8000000);
     parse_elf64(head, emu);
 
-    munmap(head, sb.st_size);
+    // Read-only pages keep pointing into the file mapping.
+    vm_adopt_mmap(emu->memory, head, sb.st_size);
     close(fd);
 
     push64(emu, 0x00); // Push return address
@@ -12,14 +12,50 @@ enum Register {
     SPL = RSP, BPL = RBP, SIL = RSI, DIL = RDI,
     R8B = R8, R9B = R9, R10B = R10, R11B = R11,
     R12B = R12, R13B = R13, R14B = R14, R15B = R15,
-    AH = AL + 4, CH = CL + 4, DH = DL + 4, BH = BL + 4,
-    SPH = SPL + 4, BPH = BPL + 4, SIH = SIL + 4, DIH = DIL + 4};
+    // Byte registers 4-7 without a REX prefix. The decoder maps them here.
+    AH = REGISTERS_COUNT, CH, DH, BH};
+
+struct CodeCache_t;
+typedef struct CodeCache_t CodeCache;
+struct BlockLink_t;
+
+// Depth of the return-address stack. Deeper calls overwrite the oldest
+// entries, whose returns then take the slow path.
+#define RAS_SIZE 64
+
+// A call in flight: where it returns to, and the link of the calling block
+// to the block there (see code_cache.h).
+typedef struct {
+    uint64_t rip;
+    struct BlockLink_t* link;
+} ReturnAddress;
+
+// Flag-setting operations whose flags are computed on demand.
+enum FlagsOp {
+    FLAGS_NONE,  // rflags is up to date
+    FLAGS_ADD, FLAGS_SUB,
+    FLAGS_RESULT};  // CF and OF given in flags_v1 and flags_v2
 
 typedef struct {
     uint64_t registers[REGISTERS_COUNT];
     uint64_t rflags;
+    // The last flag-setting operation: its kind, operand size in bytes,
+    // operands and result. The status flags are derived from them only when
+    // read (see is_carry), since most are overwritten before anything reads
+    // them.
+    int flags_op;
+    int flags_size;
+    uint64_t flags_v1;
+    uint64_t flags_v2;
+    uint64_t flags_result;
     VirtualMemory* memory;  // Memory (byte array)
     uint64_t rip;
+    CodeCache* cache;  // decoded instructions (see code_cache.h)
+    // Return-address stack, which predicts the target of ret without a
+    // lookup. ras[ras_top] is the latest call.
+    ReturnAddress ras[RAS_SIZE];
+    uint32_t ras_top;
+    uint32_t ras_count;
 } Emulator;
 
 #endif
\ No newline at end of file
@@ -2,87 +2,106 @@
 #include <stdlib.h>
 #include "emulator_function.h"
 #include "virtual_memory.h"
+#include "code_cache.h"
 
 Emulator* create_emu(uint64_t rip, uint64_t rsp) {
     Emulator* emu = malloc(sizeof(Emulator));
     emu->memory = vm_init();
+    emu->cache = cache_init();
 
     memset(emu->registers, 0, sizeof(emu->registers));
+    emu->rflags = 0;
+    emu->flags_op = FLAGS_NONE;
     emu->rip = rip;
+    emu->ras_top = 0;
+    emu->ras_count = 0;
     emu->registers[RSP] = rsp;
     return emu;
 }
 
 void destroy_emu(Emulator* emu) {
-    free(emu->memory);
+    cache_destroy(emu->cache);
+    vm_destroy(emu->memory);
     free(emu);
 }
 
+void emu_snapshot(Emulator* emu, EmulatorSnapshot* snapshot) {
+    memcpy(snapshot->registers, emu->registers, sizeof(emu->registers));
+    snapshot->rflags = get_rflags(emu);
+    snapshot->rip = emu->rip;
+    vm_snapshot(emu->memory);
+}
+
+void emu_restore(Emulator* emu, EmulatorSnapshot* snapshot) {
+    memcpy(emu->registers, snapshot->registers, sizeof(emu->registers));
+    set_rflags(emu, snapshot->rflags);
+    emu->rip = snapshot->rip;
+    emu->ras_count = 0;
+    vm_restore(emu->memory);
+}
+
 uint8_t get_code8(Emulator* emu, int index) {
-    return vm_get_memory8(emu->memory, emu->rip + index);
+    return vm_fetch8(emu->memory, emu->rip + index);
 }
 
 int8_t get_sign_code8(Emulator* emu, int index) {
     return (int8_t)get_code8(emu, index);
 }
 
-uint32_t get_code32(Emulator* emu, int index) {
-    int i;
-    uint32_t ret = 0;
+uint16_t get_code16(Emulator* emu, int index) {
+    return vm_fetch16(emu->memory, emu->rip + index);
+}
 
-    // little endian
-    for (i=0;i<4; i++) {
-        ret |= get_code8(emu, index+i) << (i * 8);
-    }
-    return ret;
+uint32_t get_code32(Emulator* emu, int index) {
+    return vm_fetch32(emu->memory, emu->rip + index);
 }
 
 int32_t get_sign_code32(Emulator* emu, int index) {
     return (int32_t) get_code32(emu, index);
 }
 
+uint64_t get_code64(Emulator* emu, int index) {
+    return vm_fetch64(emu->memory, emu->rip + index);
+}
+
 void set_memory8(Emulator* emu, uint64_t address, uint64_t value) {
-    vm_set_memory8(emu->memory, address, value & 0xFF);
+    vm_set_memory8(emu->memory, address, value);
+}
+
+void set_memory16(Emulator* emu, uint64_t address, uint64_t value) {
+    vm_set_memory16(emu->memory, address, value);
 }
 
 void set_memory32(Emulator* emu, uint64_t address, uint64_t value) {
-    int i;
-    for (i = 0; i<4; i++) {
-        set_memory8(emu, address+i, value >> (i*8));
-    }
+    vm_set_memory32(emu->memory, address, value);
 }
 
 void set_memory64(Emulator* emu, uint64_t address, uint64_t value) {
-    int i;
-    for (i = 0; i<8; i++) {
-        set_memory8(emu, address+i, value >> (i*8));
-    }
+    vm_set_memory64(emu->memory, address, value);
 }
 
 uint64_t get_memory8(Emulator* emu, uint64_t address) {
     return vm_get_memory8(emu->memory, address);
 }
 
+uint64_t get_memory16(Emulator* emu, uint64_t address) {
+    return vm_get_memory16(emu->memory, address);
+}
+
 uint64_t get_memory32(Emulator* emu, uint64_t address) {
-    int i;
-    uint32_t ret = 0;
-    for (i=0; i<4; i++) {
-        ret |= get_memory8(emu, address+i) << (i*8);
-    }
-    return ret;
+    return vm_get_memory32(emu->memory, address);
 }
 
 uint64_t get_memory64(Emulator* emu, uint64_t address) {
-    int i;
-    uint64_t ret = 0;
-    for (i=0; i<8; i++) {
-        ret |= get_memory8(emu, address+i) << (i*8);
-    }
-    return ret;
+    return vm_get_memory64(emu->memory, address);
+}
+
+uint64_t get_register16(Emulator* emu, int index) {
+    return emu->registers[index] & 0xffff;
 }
 
 uint64_t get_register32(Emulator* emu, int index) {
-    return emu->registers[index];
+    return emu->registers[index] & 0xffffffff;
 }
 
 uint64_t get_register64(Emulator* emu, int index) {
@@ -107,23 +126,28 @@ uint64_t get_register64(Emulator* emu, int index) {
  *                         |--------|
  * */
 uint64_t get_register8(Emulator* emu, int index) {
-    if (index < 8) { // al, cl, dl, bl, spl, bpl, sil, dil
+    if (index < AH) { // al, cl, dl, bl, spl, bpl, sil, dil, r8b - r15b
         return emu->registers[index] & 0xff;
-    } else { // ah, ch, dh, bh, sph, bph, bpl, sih, dih
-        return (emu->registers[index - 8] >> 8) & 0xff;
+    } else { // ah, ch, dh, bh
+        return (emu->registers[index - AH] >> 8) & 0xff;
     }
 }
 
 void set_register8(Emulator* emu, int index, uint8_t value) {
-    if (index < 8) {
-        uint32_t r = emu->registers[index] & 0xffffff00;
-        emu->registers[index] = r | (uint32_t)value;
+    if (index < AH) {
+        uint64_t r = emu->registers[index] & ~0xffULL;
+        emu->registers[index] = r | value;
     } else {
-        uint32_t r = emu->registers[index] & 0xffff00ff;
-        emu->registers[index-4] = r | ((uint32_t)value << 8);
+        uint64_t r = emu->registers[index - AH] & ~0xff00ULL;
+        emu->registers[index - AH] = r | ((uint64_t) value << 8);
     }
 }
 
+void set_register16(Emulator* emu, int index, uint16_t value) {
+    emu->registers[index] = (emu->registers[index] & ~0xffffULL) | value;
+}
+
+// Like the CPU, a 32-bit write clears the upper half of the register.
 void set_register32(Emulator* emu, int index, uint32_t value) {
     emu->registers[index] = value;
 }
@@ -132,19 +156,6 @@ void set_register64(Emulator* emu, int index, uint64_t value) {
     emu->registers[index] = value;
 }
 
-// TODO: should be removed.
-void push32(Emulator* emu, uint32_t value) {
-    uint32_t  address = get_register32(emu, RSP) - 4;
-    set_register32(emu, RSP, address);
-    set_memory32(emu, address, value);
-}
-uint32_t pop32(Emulator* emu) {
-    uint32_t address = get_register32(emu, RSP);
-    uint32_t ret = get_memory32(emu, address);
-    set_register32(emu, RSP, address + 4);
-    return ret;
-}
-
 void push64(Emulator* emu, uint64_t value) {
     uint64_t address = get_register64(emu, RSP) - 8;
     set_register64(emu, RSP, address);
@@ -158,76 +169,107 @@ uint64_t pop64(Emulator* emu) {
     return ret;
 }
 
-void set_carry(Emulator* emu, int is_carry) {
-    if (is_carry) {
-        emu->rflags |= CARRY_FLAG;
-    } else {
-        emu->rflags &= ~CARRY_FLAG;
-    }
+static uint64_t size_mask(int size) {
+    return size == 8 ? UINT64_MAX : (1ULL << (size * 8)) - 1;
 }
 
-void set_zero(Emulator* emu, int is_zero) {
-    if (is_zero) {
-        emu->rflags |= ZERO_FLAG;
-    } else {
-        emu->rflags &= ~ZERO_FLAG;
-    }
+static uint64_t sign_bit(int size) {
+    return 1ULL << (size * 8 - 1);
 }
 
-void set_sign(Emulator* emu, int is_sign) {
-    if (is_sign) {
-        emu->rflags |= SIGN_FLAG;
-    } else {
-        emu->rflags &= ~SIGN_FLAG;
-    }
+void update_rflags_add(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int size) {
+    emu->flags_op = FLAGS_ADD;
+    emu->flags_size = size;
+    emu->flags_v1 = v1;
+    emu->flags_v2 = v2;
+    emu->flags_result = result;
 }
 
-void set_overflow(Emulator* emu, int is_overflow) {
-    if (is_overflow) {
-        emu->rflags |= OVERFLOW_FLAG;
-    } else {
-        emu->rflags &= ~OVERFLOW_FLAG;
-    }
+void update_rflags_sub(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int size) {
+    emu->flags_op = FLAGS_SUB;
+    emu->flags_size = size;
+    emu->flags_v1 = v1;
+    emu->flags_v2 = v2;
+    emu->flags_result = result;
 }
 
-int carry_flag_sub(uint64_t v1, uint64_t v2) {
-    int sign1 = v1 >> 63;
-    int signr = (v1 - v2) >> 63;
-    int is_carry = (sign1 == 0) && (signr == 1);
-    return is_carry;
+void update_rflags_result(Emulator* emu, uint64_t result, int size, int carry, int overflow) {
+    emu->flags_op = FLAGS_RESULT;
+    emu->flags_size = size;
+    emu->flags_v1 = carry;
+    emu->flags_v2 = overflow;
+    emu->flags_result = result;
 }
 
-int carry_flag_add(uint64_t v1, uint64_t v2) {
-    int sign1 = v1 >> 63;
-    int sign2 = v2 >> 63;
-    if (sign1 == 1 && sign2 == 2) {
-        return 1;
+int is_carry(Emulator* emu) {
+    uint64_t mask = size_mask(emu->flags_size);
+    switch (emu->flags_op) {
+        case FLAGS_ADD:
+            return (emu->flags_result & mask) < (emu->flags_v1 & mask);
+        case FLAGS_SUB:
+            return (emu->flags_v1 & mask) < (emu->flags_v2 & mask);
+        case FLAGS_RESULT:
+            return emu->flags_v1;
+        default:
+            return (emu->rflags & CARRY_FLAG) != 0;
     }
-    int signr = (v1 + v2) >> 63;
-    return (sign1 + sign2) >= 1 && (signr == 0);
 }
 
-void update_rflags_sub(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int is_carry) {
-    int sign1 = v1 >> 63;
-    int sign2 = v2 >> 63;
-    int signr = (result >> 63) & 1;
-    set_carry(emu, is_carry);
-    set_zero(emu, result==0);
-    set_sign(emu, signr);
-    set_overflow(emu, sign1 != sign2 && sign1 != signr);
+int is_zero(Emulator* emu) {
+    if (emu->flags_op == FLAGS_NONE) {
+        return (emu->rflags & ZERO_FLAG) != 0;
+    }
+    return (emu->flags_result & size_mask(emu->flags_size)) == 0;
 }
 
-int is_carry(Emulator* emu) {
-    return (emu->rflags & CARRY_FLAG) != 0;
+int is_sign(Emulator* emu) {
+    if (emu->flags_op == FLAGS_NONE) {
+        return (emu->rflags & SIGN_FLAG) != 0;
+    }
+    return (emu->flags_result & sign_bit(emu->flags_size)) != 0;
 }
 
-int is_zero(Emulator* emu) {
-    return (emu->rflags & ZERO_FLAG) != 0;
+// Set if the low byte of the result has an even number of 1 bits.
+int is_parity(Emulator* emu) {
+    if (emu->flags_op == FLAGS_NONE) {
+        return (emu->rflags & PARITY_FLAG) != 0;
+    }
+    return !__builtin_parity(emu->flags_result & 0xff);
 }
 
-int is_sign(Emulator* emu) {
-    return (emu->rflags & SIGN_FLAG) != 0;
-}
 int is_overflow(Emulator* emu) {
-    return (emu->rflags & OVERFLOW_FLAG) != 0;
+    uint64_t v1 = emu->flags_v1;
+    uint64_t v2 = emu->flags_v2;
+    uint64_t result = emu->flags_result;
+    switch (emu->flags_op) {
+        case FLAGS_ADD:
+            // Both operands have the same sign, and the result the other one.
+            return ((v1 ^ result) & (v2 ^ result) & sign_bit(emu->flags_size)) != 0;
+        case FLAGS_SUB:
+            // The operands have different signs, and the result that of v2.
+            return ((v1 ^ v2) & (v1 ^ result) & sign_bit(emu->flags_size)) != 0;
+        case FLAGS_RESULT:
+            return v2;
+        default:
+            return (emu->rflags & OVERFLOW_FLAG) != 0;
+    }
+}
+
+uint64_t get_rflags(Emulator* emu) {
+    if (emu->flags_op != FLAGS_NONE) {
+        uint64_t rflags = emu->rflags & ~(CARRY_FLAG | PARITY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG);
+        rflags |= is_carry(emu) ? CARRY_FLAG : 0;
+        rflags |= is_parity(emu) ? PARITY_FLAG : 0;
+        rflags |= is_zero(emu) ? ZERO_FLAG : 0;
+        rflags |= is_sign(emu) ? SIGN_FLAG : 0;
+        rflags |= is_overflow(emu) ? OVERFLOW_FLAG : 0;
+        emu->rflags = rflags;
+        emu->flags_op = FLAGS_NONE;
+    }
+    return emu->rflags;
+}
+
+void set_rflags(Emulator* emu, uint64_t rflags) {
+    emu->rflags = rflags;
+    emu->flags_op = FLAGS_NONE;
 }
@@ -6,43 +6,68 @@
 #include "emulator.h"
 
 #define CARRY_FLAG (1)
+#define PARITY_FLAG (1 << 2)
 #define ZERO_FLAG (1 << 6)
 #define SIGN_FLAG (1 << 7)
+#define DIRECTION_FLAG (1 << 10)
 #define OVERFLOW_FLAG (1 << 11)
 
+typedef struct {
+    uint64_t registers[REGISTERS_COUNT];
+    uint64_t rflags;
+    uint64_t rip;
+} EmulatorSnapshot;
+
 Emulator* create_emu(uint64_t rip, uint64_t rsp);
 void destroy_emu(Emulator* emu);
 
+// Saves registers, rflags and rip into snapshot, and the guest memory
+// copy-on-write (see vm_snapshot). emu_restore() brings both back.
+void emu_snapshot(Emulator* emu, EmulatorSnapshot* snapshot);
+void emu_restore(Emulator* emu, EmulatorSnapshot* snapshot);
+
 uint8_t get_code8(Emulator* emu, int index);
 int8_t get_sign_code8(Emulator* emu, int index);
+uint16_t get_code16(Emulator* emu, int index);
 uint32_t get_code32(Emulator* emu, int index);
 int32_t get_sign_code32(Emulator* emu, int index);
+uint64_t get_code64(Emulator* emu, int index);
 
 void set_memory8(Emulator* emu, uint64_t address, uint64_t value);
+void set_memory16(Emulator* emu, uint64_t address, uint64_t value);
 void set_memory32(Emulator* emu, uint64_t address, uint64_t value);
 void set_memory64(Emulator* emu, uint64_t address, uint64_t value);
 uint64_t get_memory8(Emulator* emu, uint64_t address);
+uint64_t get_memory16(Emulator* emu, uint64_t address);
 uint64_t get_memory32(Emulator* emu, uint64_t address);
 uint64_t get_memory64(Emulator* emu, uint64_t address);
 
+// 8-bit register indices are RAX..R15 for the low bytes and AH..BH.
 uint64_t get_register8(Emulator* emu, int index);
+uint64_t get_register16(Emulator* emu, int index);
 uint64_t get_register32(Emulator* emu, int index);
 uint64_t get_register64(Emulator* emu, int index);
 
 void set_register8(Emulator* emu, int index, uint8_t value);
+void set_register16(Emulator* emu, int index, uint16_t value);
 void set_register32(Emulator* emu, int index, uint32_t value);
 void set_register64(Emulator* emu, int index, uint64_t value);
 
-void push32(Emulator* emu, uint32_t value);
-uint32_t pop32(Emulator* emu);
 void push64(Emulator* emu, uint64_t value);
 uint64_t pop64(Emulator* emu);
 
-void update_rflags_sub(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int is_carry);
-int carry_flag_add(uint64_t v1, uint64_t v2);
-int carry_flag_sub(uint64_t v1, uint64_t v2);
+// Record an add or a sub of size bytes (1, 2, 4 or 8) with result = v1 op v2.
+// Only the low size bytes of each value are looked at.
+void update_rflags_add(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int size);
+void update_rflags_sub(Emulator* emu, uint64_t v1, uint64_t v2, uint64_t result, int size);
+// For everything else: CF and OF are given, ZF, SF and PF follow the result.
+void update_rflags_result(Emulator* emu, uint64_t result, int size, int carry, int overflow);
+// Evaluates any pending flags into the returned value.
+uint64_t get_rflags(Emulator* emu);
+void set_rflags(Emulator* emu, uint64_t rflags);
 
 int is_carry(Emulator* emu);
+int is_parity(Emulator* emu);
 int is_zero(Emulator* emu);
 int is_sign(Emulator* emu);
 int is_overflow(Emulator* emu);
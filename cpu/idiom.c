@@ -0,0 +1,155 @@
+#include <string.h>
+
+#include "idiom.h"
+#include "emulator_function.h"
+#include "virtual_memory.h"
+
+// The register that byte register index is part of.
+static int full_register(int index) {
+    return index >= AH ? index - AH : index;
+}
+
+// A byte operand [base + disp] whose base the loop adds 1 to, plus an
+// unscaled index it leaves alone, if any, at position position in the
+// loop. step_at gives the position of the add to each register, or -1.
+static int match_access(const Instr* instr, int position, const int* step_at, IdiomAccess* access) {
+    const ModRM* modrm = &instr->modrm;
+    int base = modrm->base, index = -1;
+    if (modrm->form == EA_BASE_INDEX && modrm->scale == 0) {
+        index = modrm->index;
+        if (step_at[base] < 0) {
+            base = modrm->index;
+            index = modrm->base;
+        }
+        if (step_at[index] >= 0) {
+            return 0;
+        }
+    } else if (modrm->form != EA_BASE && modrm->form != EA_BASE_DISP) {
+        return 0;
+    }
+    if (step_at[base] < 0) {
+        return 0;
+    }
+    access->base = base;
+    access->index = index;
+    access->offset = step_at[base] < position;
+    access->disp = modrm->disp;
+    return 1;
+}
+
+int find_loop_idiom(const Instr* instrs, int n, uint64_t start, LoopIdiom* idiom) {
+    memset(idiom, 0, sizeof(LoopIdiom));
+    if (n < 4 || n > 7) {
+        return IDIOM_NONE;
+    }
+    const Instr* jump = &instrs[n - 1];
+    const Instr* cmp = &instrs[n - 2];
+    if (jump->op != OP_JNE || jump->imm != start
+        || (cmp->op != OP_CMP_RM_R && cmp->op != OP_CMP_R_RM) || cmp->size != 8 || cmp->modrm.mod != 3) {
+        return IDIOM_NONE;
+    }
+
+    int step_at[REGISTERS_COUNT];
+    int i, store_at = -1, load_at = -1;
+    for (i = 0; i < REGISTERS_COUNT; i++) {
+        step_at[i] = -1;
+    }
+    for (i = 0; i < n - 2; i++) {
+        const Instr* instr = &instrs[i];
+        int memory = instr->modrm.mod != 3;
+        if (instr->op == OP_ADD_RM_IMM && instr->size == 8 && !memory && instr->imm == 1
+            && step_at[instr->modrm.rm] < 0 && idiom->num_steps < 2) {
+            step_at[instr->modrm.rm] = i;
+            idiom->steps[idiom->num_steps++] = instr->modrm.rm;
+        } else if ((instr->op == OP_MOV_RM_IMM || instr->op == OP_MOV_RM_R) && instr->size == 1 && memory
+                   && store_at < 0) {
+            store_at = i;
+        } else if (((instr->op == OP_MOVZX_R_RM8 && instr->size >= 4) || (instr->op == OP_MOV_R_RM && instr->size == 1))
+                   && memory && load_at < 0) {
+            load_at = i;
+        } else {
+            return IDIOM_NONE;
+        }
+    }
+    const Instr* store = &instrs[store_at < 0 ? 0 : store_at];
+    if (store_at < 0 || !match_access(store, store_at, step_at, &idiom->store)) {
+        return IDIOM_NONE;
+    }
+
+    // The register the load writes, if any, and the one the store reads.
+    int loaded = -1;
+    int stored = store->op == OP_MOV_RM_R ? store->modrm.reg_index : -1;
+    if (load_at >= 0) {
+        const Instr* load = &instrs[load_at];
+        if (load_at > store_at || stored != load->modrm.reg_index
+            || !match_access(load, load_at, step_at, &idiom->load)) {
+            return IDIOM_NONE;
+        }
+        idiom->zero_extend = load->op == OP_MOVZX_R_RM8;
+        loaded = idiom->zero_extend ? stored : full_register(stored);
+        if (step_at[loaded] >= 0 || idiom->load.index == loaded || idiom->store.index == loaded) {
+            return IDIOM_NONE;
+        }
+        idiom->kind = IDIOM_COPY;
+    } else {
+        if (stored >= 0 && step_at[full_register(stored)] >= 0) {
+            return IDIOM_NONE;
+        }
+        idiom->value = store->imm;
+        idiom->kind = IDIOM_FILL;
+    }
+    idiom->reg = stored;
+
+    // One side of the cmp goes up, and the loop does not write the other.
+    int a = cmp->modrm.rm;
+    int b = cmp->modrm.reg_index;
+    if (step_at[a] >= 0 && step_at[b] < 0 && b != loaded) {
+        idiom->counter = a;
+        idiom->limit = b;
+    } else if (step_at[b] >= 0 && step_at[a] < 0 && a != loaded) {
+        idiom->counter = b;
+        idiom->limit = a;
+    } else {
+        idiom->kind = IDIOM_NONE;
+    }
+    return idiom->kind;
+}
+
+static uint64_t access_address(Emulator* emu, const IdiomAccess* access) {
+    uint64_t address = get_register64(emu, access->base) + access->offset + access->disp;
+    return access->index < 0 ? address : address + get_register64(emu, access->index);
+}
+
+uint64_t run_loop_idiom(Emulator* emu, const LoopIdiom* idiom, uint64_t code_start, uint64_t code_end) {
+    uint64_t limit = get_register64(emu, idiom->limit);
+    // The counter goes up by 1 before each compare.
+    uint64_t n = limit - get_register64(emu, idiom->counter);
+    if (n == 0 || n > IDIOM_MAX_BYTES) {
+        return 0;
+    }
+    uint64_t dst = access_address(emu, &idiom->store);
+    if (dst < code_end && code_start < dst + n) {
+        return 0;
+    }
+
+    if (idiom->kind == IDIOM_FILL) {
+        uint8_t value = idiom->reg < 0 ? idiom->value : get_register8(emu, idiom->reg);
+        vm_fill(emu->memory, dst, value, n);
+    } else {
+        uint64_t src = access_address(emu, &idiom->load);
+        vm_copy(emu->memory, dst, src, n);
+        // What the last iteration loaded, which only its own store could
+        // have changed since, to the same value.
+        uint8_t last = get_memory8(emu, src + n - 1);
+        if (idiom->zero_extend) {
+            set_register64(emu, idiom->reg, last);
+        } else {
+            set_register8(emu, idiom->reg, last);
+        }
+    }
+    for (int i = 0; i < idiom->num_steps; i++) {
+        set_register64(emu, idiom->steps[i], get_register64(emu, idiom->steps[i]) + n);
+    }
+    update_rflags_sub(emu, limit, limit, 0, 8);
+    return n;
+}
@@ -0,0 +1,63 @@
+#ifndef IDIOM_H_
+#define IDIOM_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "instruction.h"
+
+// Loops that fill or copy memory a byte at a time, which the code cache
+// (see code_cache.h) runs as one bulk operation on guest memory instead:
+//
+//   fill: mov byte [p], v; add p, 1; cmp p, end; jne fill
+//   copy: movzx t, byte [s]; mov byte [d], t; add s, 1; add d, 1;
+//         cmp s, end; jne copy
+//
+// in any order before the cmp, with a displacement on each address, the
+// register the loop stops on compared either way round, and the load
+// also as mov t8, byte [s]. The same register may be both s and d, and
+// an address may add a register that the loop leaves alone, as in
+// [d + i] with i going up.
+enum Idiom {
+    IDIOM_NONE,
+    IDIOM_FILL,
+    IDIOM_COPY,
+    NUM_IDIOMS
+};
+
+// A byte access at [base + index + disp] in the first iteration, where
+// base has gone up by offset already. index is -1 if there is none.
+typedef struct {
+    uint8_t base;
+    int8_t index;
+    uint8_t offset;
+    int32_t disp;
+} IdiomAccess;
+
+typedef struct {
+    uint8_t kind;  // enum Idiom
+    // The loop runs until counter, which it adds 1 to, equals limit.
+    uint8_t counter;
+    uint8_t limit;
+    uint8_t steps[2];  // the registers it adds 1 to
+    uint8_t num_steps;
+    IdiomAccess store;
+    IdiomAccess load;
+    // fill: the byte register stored, or -1 for value. copy: the register
+    // loaded, which is a byte register unless zero_extend.
+    int8_t reg;
+    uint8_t value;
+    uint8_t zero_extend;
+} LoopIdiom;
+
+// Looks for one of the loops of enum Idiom in the n instructions of the
+// block at start. Returns its kind, and fills in idiom.
+int find_loop_idiom(const Instr* instrs, int n, uint64_t start, LoopIdiom* idiom);
+// Runs every iteration of the loop, which starts in the current state, and
+// leaves emu as the last one of them would. Returns the number of bytes, or
+// 0 if the loop has to run an instruction at a time: it would not stop
+// within IDIOM_MAX_BYTES, or it writes [code_start, code_end), its code.
+#define IDIOM_MAX_BYTES (1ULL << 32)
+uint64_t run_loop_idiom(Emulator* emu, const LoopIdiom* idiom, uint64_t code_start, uint64_t code_end);
+
+#endif
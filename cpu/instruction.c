@@ -7,745 +7,1469 @@
 #include "emulator.h"
 #include "emulator_function.h"
 #include "modrm.h"
+#include "virtual_memory.h"
+
+// Operand encodings of the opcode table entries, after the notation of
+// Intel SDM Vol. 2, Appendix A. Immediates are stored sign-extended to 64
+// bits in Instr.imm and branch targets as absolute addresses.
+enum Encoding {
+    ENC_NONE,
+    ENC_MODRM,         // Eb/Ev and Gb/Gv
+    ENC_MODRM_1,       // ModR/M, and the implied count 1 of D0/D1
+    ENC_MODRM_IB,      // ModR/M and imm8
+    ENC_MODRM_IZ,      // ModR/M and imm16/imm32 (Iz)
+    ENC_MODRM_GROUP3,  // F6/F7: an immediate for TEST only (/0 and /1)
+    ENC_ACC_IB,        // AL and imm8, decoded as r/m = AL
+    ENC_ACC_IZ,        // rAX and Iz, decoded as r/m = rAX
+    ENC_IB,
+    ENC_IZ,
+    ENC_IW,            // imm16, zero-extended
+    ENC_REL8,
+    ENC_REL32,
+    ENC_OPREG,         // register in the low 3 bits of the opcode
+    ENC_OPREG_IV,      // the same and an immediate of the operand size
+};
+
+// Operand widths.
+enum Width {
+    W_NONE,
+    W_BYTE,  // b: always 8 bits
+    W_V,     // v: 32 bits, 16 with 66, 64 with REX.W
+    W_D64,   // 64 bits in 64-bit mode (push, pop and near branches)
+};
+
+#define F_RM_BYTE 0x01   // r/m is a byte even though the width is v (movzx Gv, Eb)
+#define F_MEM_ONLY 0x02  // r/m must be a memory operand (lea)
+
+// The handlers of an instruction for operand sizes of 1, 2, 4 and 8 bytes,
+// and their threaded variants. Instructions whose operation does not
+// depend on the operand size use one handler for all four.
+typedef struct {
+    instruction_func_t* exec[4];
+    instruction_func_t* thread[4];
+    int ends_block;  // may change rip to anything but the next instruction
+    int op;          // enum Op, for instructions the JIT translates itself
+} Handler;
+
+// The threaded variant of a handler runs the instruction, moves rip past
+// the next one and tail-calls its handler. A basic block is an array of
+// Instr ending with a block_end() sentinel, so running it takes one
+// indirect jump per instruction and no trip back to the dispatcher.
+#define DEFINE_THREADED(name) \
+static void name ## _threaded(Emulator* emu, Instr* instr) { \
+    name(emu, instr); \
+    instr++; \
+    emu->rip += instr->len; \
+    instr->thread(emu, instr); \
+}
 
-instruction_func_t* instructions[256];
-
-static void mov_r8_imm8(Emulator* emu) {
-    uint8_t reg= get_code8(emu, 0) - 0xB0;
-    uint8_t imm8 = get_code8(emu, 1);
-    set_register8(emu, reg, imm8);
-    emu->rip += 2;
-}
-
-static void mov_r32_imm32(Emulator* emu) {
-    uint8_t reg = get_code8(emu, 0) - 0xB8;
-    uint64_t value = get_code32(emu, 1);
-    emu->registers[reg] = value;
-    emu->rip += 5;  // opcode 1 byte, operand 4 bytes
-}
-
-static void mov_rm32_imm32(Emulator* emu) {
-    fprintf(stderr, "CPU Warning: mov_rm32_imm32 may be wrong behavior.\n");
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t value = get_code32(emu, 0);
-    emu->rip += 4;  // operand 4 bytes
-    set_rm32(emu, &modrm, value);
-}
-
-static void mov_r32_rm32(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_rm32(emu, &modrm);
-    set_r32(emu, &modrm, r32);
-}
-
-static void mov_rm32_r32(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    set_rm32(emu, &modrm, r32);
-}
-
-static void mov_rm8_r8(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint8_t r8 = get_r8(emu, &modrm);
-    set_rm8(emu, &modrm, r8);
-}
-
-static void mov_r8_rm8(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint8_t rm8 = get_rm8(emu, &modrm);
-    set_r8(emu, &modrm, rm8);
-}
-
-static void add_rm32_r32(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_rm32(emu, &modrm, rm32 + r32);
-}
-
-static void add_r32_rm32(Emulator* emu) {
-    // 03 45 f8 => addl -0x8(%rbp), %eax
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_r32(emu, &modrm, rm32 + r32);
-}
-
-static void sub_r32_rm32(Emulator* emu) {
-    // 2b 45 f8 => subl -0x8(%rbp), %eax
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_r32(emu, &modrm, r32 - rm32);
-}
-
-static void xor_rm32_r32(Emulator* emu) {
-    // 31 db => xor ebx,ebx
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    set_rm32(emu, &modrm, r32 ^ rm32);  // set_r32?
-    fprintf(stderr, "CPU Warning: xor_rm32_r32 may be wrong behavior.\n");
-}
-
-static void cmp_r32_rm32(Emulator* emu) {
-    fprintf(stderr, "CPU Warning: cmp_r32_rm32 may be wrong behavior.\n");
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint32_t r32 = get_r32(emu, &modrm);
-    uint32_t rm32 = get_rm32(emu, &modrm);
-    uint64_t result = (uint64_t) r32 - (uint64_t) rm32;
-    int is_carry = carry_flag_sub(r32, rm32);
-    update_rflags_sub(emu, r32, rm32, result, is_carry);
-}
-
-static void cmp_al_imm8(Emulator* emu) {
-    fprintf(stderr, "CPU Warning: cmp_r32_rm32 may be wrong behavior.\n");
-    uint8_t al = get_register8(emu, AL);
-    uint8_t imm8 = get_code8(emu, 1);
-    uint64_t result = (uint64_t) al - (uint64_t) imm8;
-    int is_carry = carry_flag_sub(al, imm8);
-    update_rflags_sub(emu, al, imm8, result, is_carry);
-    emu->rip += 2;
-}
-
-static void add_rm32_imm8(Emulator* emu, ModRM* modrm) {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t)get_sign_code8(emu, 0);
-    emu->rip += 1;
-    set_rm32(emu, modrm, rm32 + imm8);
-}
-
-static void sub_rm32_imm8(Emulator* emu, ModRM* modrm) {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t) get_sign_code8(emu, 0);
-    emu->rip += 1;
-    uint64_t result = (uint64_t)rm32 - (uint64_t)imm8;
-    set_rm32(emu, modrm, (uint32_t) result);
-    int is_carry = carry_flag_sub(rm32, imm8);
-    update_rflags_sub(emu, rm32, imm8, result, is_carry);
-}
-
-static void cmp_rm32_imm8(Emulator* emu, ModRM* modrm) {
-    uint32_t rm32 = get_rm32(emu, modrm);
-    uint32_t imm8 = (int32_t) get_sign_code8(emu, 0);
-    emu->rip += 1;
-    uint64_t result = (uint64_t)rm32 - (uint64_t)imm8;
-    int is_carry = carry_flag_sub(rm32, imm8);
-    update_rflags_sub(emu, rm32, imm8, result, is_carry);
-}
-
-static void code_83(Emulator* emu) {
-    fprintf(stderr, "CPU Warning: code_83 may be wrong behavior.\n");
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-
-    switch (modrm.opecode) {
-        case 0:
-            add_rm32_imm8(emu, &modrm);
-            break;
-        case 5:
-            sub_rm32_imm8(emu, &modrm);
-            break;
-        case 7:
-            cmp_rm32_imm8(emu, &modrm);
-            break;
-        default:
-            printf("not implemented: 83 /%d\n", modrm.opecode);
-            exit(1);
-    }
-}
-
-static void code_0f(Emulator* emu) {
-    uint8_t po = get_code8(emu, 1);
-    if (po == 0x94 || po == 0x95 || po == 0x9C || po == 0x9E) {
-        uint8_t oprand = get_code8(emu, 2);
-        emu->rip += 3;
-
-        // TODO: Check What 'oprand & 0xF0' means?
-        uint8_t reg = oprand & 0x0F;
-
-        switch (po) {
-            case 0x94:
-                // 0F 94 C0 => sete al
-                set_register8(emu, reg, is_zero(emu));
-                return;
-            case 0x95:
-                // 0F 95 C0 => setne al
-                set_register8(emu, reg, !is_zero(emu));
-                return;
-            case 0x9C:
-                // 0F 9C C0 => setl al
-                set_register8(emu, reg, is_sign(emu));
-                return;
-            case 0x9E:
-                // 0F 9E C0 => setle al
-                set_register8(emu, reg, is_sign(emu) || is_zero(emu));
-                return;
-        }
-    } else if (po >= 0x80 && po <= 0x8E) {
-        int diff;
-        switch (po) {
-            case 0x80:
-                diff = is_overflow(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x81:
-                diff = !is_overflow(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x82:
-                diff = is_carry(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x83:
-                diff = !is_carry(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x84:
-                // 0f 84 0c 00 00 00 => je 0x0c
-                diff = is_zero(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x85:
-                diff = !is_zero(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x88:
-                diff = is_sign(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            case 0x89:
-                diff = !is_sign(emu) ? get_sign_code32(emu, 2) : 0;
-                break;
-            default:
-                printf("not implemented: 0F /%d\n", po);
-                exit(1);
-        }
-        emu->rip += (diff + 6);
-        return;
-    } else {
-        printf("not implemented: 0F /%d\n", po);
-        exit(1);
+#define DEFINE_HANDLER_OP(name, ends_block, op) \
+DEFINE_THREADED(name) \
+static const Handler name ## _handler = { \
+    {name, name, name, name}, \
+    {name ## _threaded, name ## _threaded, name ## _threaded, name ## _threaded}, \
+    ends_block, \
+    op, \
+};
+
+#define DEFINE_HANDLER(name, ends_block) DEFINE_HANDLER_OP(name, ends_block, OP_OTHER)
+
+#define DEFINE_SIZED_HANDLER_OP(family, op, name8, name16, name32, name64) \
+DEFINE_THREADED(name8) DEFINE_THREADED(name16) DEFINE_THREADED(name32) DEFINE_THREADED(name64) \
+static const Handler family ## _handler = { \
+    {name8, name16, name32, name64}, \
+    {name8 ## _threaded, name16 ## _threaded, name32 ## _threaded, name64 ## _threaded}, \
+    0, \
+    op, \
+};
+
+#define DEFINE_SIZED_HANDLER(family, name8, name16, name32, name64) \
+DEFINE_SIZED_HANDLER_OP(family, OP_OTHER, name8, name16, name32, name64)
+
+// The same for instructions without a byte form (width v only).
+#define DEFINE_SIZED_HANDLER_V_OP(family, op, name16, name32, name64) \
+DEFINE_THREADED(name16) DEFINE_THREADED(name32) DEFINE_THREADED(name64) \
+static const Handler family ## _handler = { \
+    {NULL, name16, name32, name64}, \
+    {NULL, name16 ## _threaded, name32 ## _threaded, name64 ## _threaded}, \
+    0, \
+    op, \
+};
+
+#define DEFINE_SIZED_HANDLER_V(family, name16, name32, name64) \
+DEFINE_SIZED_HANDLER_V_OP(family, OP_OTHER, name16, name32, name64)
+
+// The unsigned and signed types of an operand of bits bits.
+#define UINT(bits) uint ## bits ## _t
+#define INT(bits) int ## bits ## _t
+
+static void not_implemented(Emulator* emu, Instr* instr) {
+    int i;
+    emu->rip -= instr->len;
+    printf("not implemented:");
+    for (i = 0; i < instr->len; i++) {
+        printf(" %02x", get_code8(emu, i));
     }
+    printf(" (rip = 0x%llx)\n", (unsigned long long) emu->rip);
+    exit(1);
 }
+DEFINE_HANDLER(not_implemented, 1)
 
-static void code_fe(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
+static inline uint64_t size_mask(int size) {
+    return size == 8 ? UINT64_MAX : (1ULL << (size * 8)) - 1;
+}
 
-    // See Table A.6, Volume 2D A-18.
-    switch (modrm.opecode) {
-        case 0:  // INC Eb
-        case 1:  // INC Eb
-        default:
-            printf("not implemented: FE, modrm.opecode=%d\n", modrm.opecode);
-            exit(1);
+static inline uint64_t sign_bit(int size) {
+    return 1ULL << (size * 8 - 1);
+}
+
+static inline int64_t sign_extend(uint64_t value, int size) {
+    switch (size) {
+        case 1: return (int8_t) value;
+        case 2: return (int16_t) value;
+        case 4: return (int32_t) value;
+        default: return (int64_t) value;
     }
 }
 
-static void code_ff(Emulator* emu) {
-    emu->rip += 1;
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
+// The ALU operations: each computes v1 op v2, records the flags unless
+// flags is 0 and returns the result. size and flags are constants in every
+// caller, so the parts that do not apply fold away once inlined.
+static inline uint64_t alu_add(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    if (flags) {
+        update_rflags_add(emu, v1, v2, v1 + v2, size);
+    }
+    return v1 + v2;
+}
 
-    // See Table A.6, Volume 2D A-18.
-    switch (modrm.opecode) {
-        case 0: {
-            // INC rm32
-            uint32_t value = get_rm32(emu, &modrm);
-            set_rm32(emu, &modrm, value + 1);
-            break;
+static inline uint64_t alu_sub(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    if (flags) {
+        update_rflags_sub(emu, v1, v2, v1 - v2, size);
+    }
+    return v1 - v2;
+}
+
+static inline uint64_t alu_adc(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    uint64_t mask = size_mask(size);
+    int carry_in = is_carry(emu);
+    uint64_t result = (v1 + v2 + carry_in) & mask;
+    if (flags) {
+        v1 &= mask;
+        int carry = carry_in ? result <= v1 : result < v1;
+        int overflow = (~(v1 ^ v2) & (v1 ^ result) & sign_bit(size)) != 0;
+        update_rflags_result(emu, result, size, carry, overflow);
+    }
+    return result;
+}
+
+static inline uint64_t alu_sbb(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    uint64_t mask = size_mask(size);
+    int carry_in = is_carry(emu);
+    uint64_t result = (v1 - v2 - carry_in) & mask;
+    if (flags) {
+        v1 &= mask;
+        v2 &= mask;
+        int carry = carry_in ? v1 <= v2 : v1 < v2;
+        int overflow = ((v1 ^ v2) & (v1 ^ result) & sign_bit(size)) != 0;
+        update_rflags_result(emu, result, size, carry, overflow);
+    }
+    return result;
+}
+
+static inline uint64_t alu_and(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    if (flags) {
+        update_rflags_result(emu, v1 & v2, size, 0, 0);
+    }
+    return v1 & v2;
+}
+
+static inline uint64_t alu_or(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    if (flags) {
+        update_rflags_result(emu, v1 | v2, size, 0, 0);
+    }
+    return v1 | v2;
+}
+
+static inline uint64_t alu_xor(Emulator* emu, uint64_t v1, uint64_t v2, int size, int flags) {
+    if (flags) {
+        update_rflags_result(emu, v1 ^ v2, size, 0, 0);
+    }
+    return v1 ^ v2;
+}
+
+// The three forms of a two-operand ALU instruction: Eb/Ev op Gb/Gv (00),
+// Gb/Gv op Eb/Ev (02) and Eb/Ev op imm (80 /n, 04). cmp and test are sub
+// and and without the write back; test has no Gb/Gv op Eb/Ev form. Each
+// comes with a _nf variant for where the flags it sets are dead (see
+// drop_flags()).
+#define DEFINE_ALU_R_RM_FORM(name, suffix, op, writes, flags, bits) \
+static void name ## _r ## bits ## _rm ## bits ## suffix(Emulator* emu, Instr* instr) { \
+    UINT(bits) v1 = get_r ## bits(emu, &instr->modrm); \
+    UINT(bits) v2 = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) result = alu_ ## op(emu, v1, v2, bits / 8, flags); \
+    if (writes) { \
+        set_r ## bits(emu, &instr->modrm, result); \
+    } \
+}
+
+#define DEFINE_ALU_R_RM_WIDTH(name, op, writes, bits) \
+DEFINE_ALU_R_RM_FORM(name, , op, writes, 1, bits) \
+DEFINE_ALU_R_RM_FORM(name, _nf, op, writes, 0, bits)
+
+#define DEFINE_ALU_FORMS(name, suffix, op, writes, flags, bits) \
+static void name ## _rm ## bits ## _r ## bits ## suffix(Emulator* emu, Instr* instr) { \
+    UINT(bits) v1 = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) v2 = get_r ## bits(emu, &instr->modrm); \
+    UINT(bits) result = alu_ ## op(emu, v1, v2, bits / 8, flags); \
+    if (writes) { \
+        set_rm ## bits(emu, &instr->modrm, result); \
+    } \
+} \
+static void name ## _rm ## bits ## _imm ## suffix(Emulator* emu, Instr* instr) { \
+    UINT(bits) v1 = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) v2 = instr->imm; \
+    UINT(bits) result = alu_ ## op(emu, v1, v2, bits / 8, flags); \
+    if (writes) { \
+        set_rm ## bits(emu, &instr->modrm, result); \
+    } \
+}
+
+#define DEFINE_ALU_WIDTH(name, op, writes, bits) \
+DEFINE_ALU_FORMS(name, , op, writes, 1, bits) \
+DEFINE_ALU_FORMS(name, _nf, op, writes, 0, bits)
+
+#define DEFINE_ALU_RM(name, NAME, op, writes) \
+DEFINE_ALU_WIDTH(name, op, writes, 8) \
+DEFINE_ALU_WIDTH(name, op, writes, 16) \
+DEFINE_ALU_WIDTH(name, op, writes, 32) \
+DEFINE_ALU_WIDTH(name, op, writes, 64) \
+DEFINE_SIZED_HANDLER_OP(name ## _rm_r, OP_ ## NAME ## _RM_R, \
+                        name ## _rm8_r8, name ## _rm16_r16, name ## _rm32_r32, name ## _rm64_r64) \
+DEFINE_SIZED_HANDLER_OP(name ## _rm_imm, OP_ ## NAME ## _RM_IMM, \
+                        name ## _rm8_imm, name ## _rm16_imm, name ## _rm32_imm, name ## _rm64_imm) \
+DEFINE_SIZED_HANDLER_OP(name ## _rm_r_nf, OP_ ## NAME ## _RM_R, \
+                        name ## _rm8_r8_nf, name ## _rm16_r16_nf, name ## _rm32_r32_nf, name ## _rm64_r64_nf) \
+DEFINE_SIZED_HANDLER_OP(name ## _rm_imm_nf, OP_ ## NAME ## _RM_IMM, \
+                        name ## _rm8_imm_nf, name ## _rm16_imm_nf, name ## _rm32_imm_nf, name ## _rm64_imm_nf)
+
+#define DEFINE_ALU(name, NAME, op, writes) \
+DEFINE_ALU_RM(name, NAME, op, writes) \
+DEFINE_ALU_R_RM_WIDTH(name, op, writes, 8) \
+DEFINE_ALU_R_RM_WIDTH(name, op, writes, 16) \
+DEFINE_ALU_R_RM_WIDTH(name, op, writes, 32) \
+DEFINE_ALU_R_RM_WIDTH(name, op, writes, 64) \
+DEFINE_SIZED_HANDLER_OP(name ## _r_rm, OP_ ## NAME ## _R_RM, \
+                        name ## _r8_rm8, name ## _r16_rm16, name ## _r32_rm32, name ## _r64_rm64) \
+DEFINE_SIZED_HANDLER_OP(name ## _r_rm_nf, OP_ ## NAME ## _R_RM, \
+                        name ## _r8_rm8_nf, name ## _r16_rm16_nf, name ## _r32_rm32_nf, name ## _r64_rm64_nf)
+
+DEFINE_ALU(add, ADD, add, 1)
+DEFINE_ALU(or, OR, or, 1)
+DEFINE_ALU(adc, ADC, adc, 1)
+DEFINE_ALU(sbb, SBB, sbb, 1)
+DEFINE_ALU(and, AND, and, 1)
+DEFINE_ALU(sub, SUB, sub, 1)
+DEFINE_ALU(xor, XOR, xor, 1)
+DEFINE_ALU(cmp, CMP, sub, 0)
+DEFINE_ALU_RM(test, TEST, and, 0)
+
+// 89 => mov Ev, Gv, 8B => mov Gv, Ev, C7 => mov Ev, Iz, B8+r => mov r, Iv
+// (movabs with REX.W), 87 => xchg Ev, Gv and 90+r => xchg r, rAX.
+#define DEFINE_MOV(bits) \
+static void mov_rm ## bits ## _r ## bits(Emulator* emu, Instr* instr) { \
+    set_rm ## bits(emu, &instr->modrm, get_r ## bits(emu, &instr->modrm)); \
+} \
+static void mov_r ## bits ## _rm ## bits(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, get_rm ## bits(emu, &instr->modrm)); \
+} \
+static void mov_rm ## bits ## _imm(Emulator* emu, Instr* instr) { \
+    set_rm ## bits(emu, &instr->modrm, instr->imm); \
+} \
+static void mov_r ## bits ## _imm(Emulator* emu, Instr* instr) { \
+    set_register ## bits(emu, instr->reg, instr->imm); \
+} \
+static void xchg_rm ## bits ## _r ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) rm = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) r = get_r ## bits(emu, &instr->modrm); \
+    set_rm ## bits(emu, &instr->modrm, r); \
+    set_r ## bits(emu, &instr->modrm, rm); \
+} \
+static void xchg_r ## bits ## _rax(Emulator* emu, Instr* instr) { \
+    /* 90 is nop rather than xchg eax, eax, which would clear the upper half. */ \
+    if (instr->reg == RAX) { \
+        return; \
+    } \
+    UINT(bits) value = get_register ## bits(emu, instr->reg); \
+    set_register ## bits(emu, instr->reg, get_register ## bits(emu, RAX)); \
+    set_register ## bits(emu, RAX, value); \
+}
+
+DEFINE_MOV(8)
+DEFINE_MOV(16)
+DEFINE_MOV(32)
+DEFINE_MOV(64)
+DEFINE_SIZED_HANDLER_OP(mov_rm_r, OP_MOV_RM_R, mov_rm8_r8, mov_rm16_r16, mov_rm32_r32, mov_rm64_r64)
+DEFINE_SIZED_HANDLER_OP(mov_r_rm, OP_MOV_R_RM, mov_r8_rm8, mov_r16_rm16, mov_r32_rm32, mov_r64_rm64)
+DEFINE_SIZED_HANDLER_OP(mov_rm_imm, OP_MOV_RM_IMM, mov_rm8_imm, mov_rm16_imm, mov_rm32_imm, mov_rm64_imm)
+DEFINE_SIZED_HANDLER_OP(mov_r_imm, OP_MOV_R_IMM, mov_r8_imm, mov_r16_imm, mov_r32_imm, mov_r64_imm)
+DEFINE_SIZED_HANDLER(xchg_rm_r, xchg_rm8_r8, xchg_rm16_r16, xchg_rm32_r32, xchg_rm64_r64)
+DEFINE_SIZED_HANDLER(xchg_r_rax, xchg_r8_rax, xchg_r16_rax, xchg_r32_rax, xchg_r64_rax)
+
+// Moves into a register that are wider than their source, and lea.
+#define DEFINE_EXTEND(bits) \
+static void movzx_r ## bits ## _rm8(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, get_rm8(emu, &instr->modrm)); \
+} \
+static void movzx_r ## bits ## _rm16(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, get_rm16(emu, &instr->modrm)); \
+} \
+static void movsx_r ## bits ## _rm8(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, (int8_t) get_rm8(emu, &instr->modrm)); \
+} \
+static void movsx_r ## bits ## _rm16(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, (int16_t) get_rm16(emu, &instr->modrm)); \
+} \
+static void movsxd_r ## bits ## _rm32(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, (int32_t) get_rm32(emu, &instr->modrm)); \
+} \
+static void lea_r ## bits ## _m(Emulator* emu, Instr* instr) { \
+    set_r ## bits(emu, &instr->modrm, calc_memory_address(emu, &instr->modrm)); \
+}
+
+DEFINE_EXTEND(16)
+DEFINE_EXTEND(32)
+DEFINE_EXTEND(64)
+// 48 0F B6 C0 => movzx rax, al
+DEFINE_SIZED_HANDLER_V_OP(movzx_r_rm8, OP_MOVZX_R_RM8, movzx_r16_rm8, movzx_r32_rm8, movzx_r64_rm8)
+DEFINE_SIZED_HANDLER_V(movzx_r_rm16, movzx_r16_rm16, movzx_r32_rm16, movzx_r64_rm16)
+DEFINE_SIZED_HANDLER_V(movsx_r_rm8, movsx_r16_rm8, movsx_r32_rm8, movsx_r64_rm8)
+DEFINE_SIZED_HANDLER_V(movsx_r_rm16, movsx_r16_rm16, movsx_r32_rm16, movsx_r64_rm16)
+// 48 63 C7 => movsxd rax, edi
+DEFINE_SIZED_HANDLER_V_OP(movsxd_r_rm32, OP_MOVSXD, movsxd_r16_rm32, movsxd_r32_rm32, movsxd_r64_rm32)
+// 48 8D 45 F8 => lea rax, [rbp-0x8]
+DEFINE_SIZED_HANDLER_V_OP(lea_r_m, OP_LEA, lea_r16_m, lea_r32_m, lea_r64_m)
+
+// inc and dec leave CF unchanged.
+#define DEFINE_UNARY(bits) \
+static void inc_rm ## bits ## _nf(Emulator* emu, Instr* instr) { \
+    set_rm ## bits(emu, &instr->modrm, get_rm ## bits(emu, &instr->modrm) + 1); \
+} \
+static void dec_rm ## bits ## _nf(Emulator* emu, Instr* instr) { \
+    set_rm ## bits(emu, &instr->modrm, get_rm ## bits(emu, &instr->modrm) - 1); \
+} \
+static void inc_rm ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) result = get_rm ## bits(emu, &instr->modrm) + 1; \
+    set_rm ## bits(emu, &instr->modrm, result); \
+    update_rflags_result(emu, result, bits / 8, is_carry(emu), result == sign_bit(bits / 8)); \
+} \
+static void dec_rm ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) value = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) result = value - 1; \
+    set_rm ## bits(emu, &instr->modrm, result); \
+    update_rflags_result(emu, result, bits / 8, is_carry(emu), value == sign_bit(bits / 8)); \
+} \
+static void not_rm ## bits(Emulator* emu, Instr* instr) { \
+    set_rm ## bits(emu, &instr->modrm, ~get_rm ## bits(emu, &instr->modrm)); \
+} \
+static void neg_rm ## bits(Emulator* emu, Instr* instr) { \
+    /* 49 F7 DA => neg r10 */ \
+    UINT(bits) value = get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) result = -value; \
+    set_rm ## bits(emu, &instr->modrm, result); \
+    update_rflags_sub(emu, 0, value, result, bits / 8); \
+}
+
+DEFINE_UNARY(8)
+DEFINE_UNARY(16)
+DEFINE_UNARY(32)
+DEFINE_UNARY(64)
+DEFINE_SIZED_HANDLER_OP(inc_rm, OP_INC, inc_rm8, inc_rm16, inc_rm32, inc_rm64)
+DEFINE_SIZED_HANDLER_OP(dec_rm, OP_DEC, dec_rm8, dec_rm16, dec_rm32, dec_rm64)
+DEFINE_SIZED_HANDLER_OP(inc_rm_nf, OP_INC, inc_rm8_nf, inc_rm16_nf, inc_rm32_nf, inc_rm64_nf)
+DEFINE_SIZED_HANDLER_OP(dec_rm_nf, OP_DEC, dec_rm8_nf, dec_rm16_nf, dec_rm32_nf, dec_rm64_nf)
+DEFINE_SIZED_HANDLER(not_rm, not_rm8, not_rm16, not_rm32, not_rm64)
+DEFINE_SIZED_HANDLER(neg_rm, neg_rm8, neg_rm16, neg_rm32, neg_rm64)
+
+// The double-width operand of mul and div: rDX:rAX, or AH:AL for bytes.
+static inline uint16_t get_rdx_rax8(Emulator* emu) {
+    return get_register16(emu, RAX);
+}
+
+static inline void set_rdx_rax8(Emulator* emu, uint8_t high, uint8_t low) {
+    set_register8(emu, AH, high);
+    set_register8(emu, AL, low);
+}
+
+#define DEFINE_RDX_RAX(bits, wide) \
+static inline wide get_rdx_rax ## bits(Emulator* emu) { \
+    return ((wide) get_register ## bits(emu, RDX) << bits) | get_register ## bits(emu, RAX); \
+} \
+static inline void set_rdx_rax ## bits(Emulator* emu, UINT(bits) high, UINT(bits) low) { \
+    set_register ## bits(emu, RDX, high); \
+    set_register ## bits(emu, RAX, low); \
+}
+
+DEFINE_RDX_RAX(16, uint32_t)
+DEFINE_RDX_RAX(32, uint64_t)
+DEFINE_RDX_RAX(64, unsigned __int128)
+
+static void divide_error(Emulator* emu, Instr* instr) {
+    printf("divide error (rip = 0x%llx)\n", (unsigned long long) (emu->rip - instr->len));
+    exit(1);
+}
+
+// mul, imul, div and idiv of rDX:rAX (F7 /4-7). wide and swide are the
+// double-width types.
+#define DEFINE_MULDIV(bits, wide, swide) \
+static void mul_rm ## bits(Emulator* emu, Instr* instr) { \
+    wide result = (wide) get_register ## bits(emu, RAX) * get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) low = result; \
+    UINT(bits) high = result >> bits; \
+    set_rdx_rax ## bits(emu, high, low); \
+    update_rflags_result(emu, low, bits / 8, high != 0, high != 0); \
+} \
+static void imul_rm ## bits(Emulator* emu, Instr* instr) { \
+    swide result = (swide) (INT(bits)) get_register ## bits(emu, RAX) \
+                   * (INT(bits)) get_rm ## bits(emu, &instr->modrm); \
+    UINT(bits) low = result; \
+    UINT(bits) high = result >> bits; \
+    set_rdx_rax ## bits(emu, high, low); \
+    int overflow = result != (INT(bits)) low; \
+    update_rflags_result(emu, low, bits / 8, overflow, overflow); \
+} \
+static void div_rm ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) divisor = get_rm ## bits(emu, &instr->modrm); \
+    if (divisor == 0) { \
+        divide_error(emu, instr); \
+    } \
+    wide dividend = get_rdx_rax ## bits(emu); \
+    wide quotient = dividend / divisor; \
+    if (quotient != (UINT(bits)) quotient) { \
+        divide_error(emu, instr); \
+    } \
+    set_rdx_rax ## bits(emu, dividend % divisor, quotient); \
+} \
+static void idiv_rm ## bits(Emulator* emu, Instr* instr) { \
+    /* 48 F7 FF => idiv rdi */ \
+    INT(bits) divisor = get_rm ## bits(emu, &instr->modrm); \
+    swide dividend = get_rdx_rax ## bits(emu); \
+    if (divisor == 0 || (divisor == -1 && dividend == (swide) ((wide) 1 << (2 * bits - 1)))) { \
+        divide_error(emu, instr); \
+    } \
+    swide quotient = dividend / divisor; \
+    if (quotient != (INT(bits)) quotient) { \
+        divide_error(emu, instr); \
+    } \
+    set_rdx_rax ## bits(emu, dividend % divisor, quotient); \
+}
+
+DEFINE_MULDIV(8, uint16_t, int16_t)
+DEFINE_MULDIV(16, uint32_t, int32_t)
+DEFINE_MULDIV(32, uint64_t, int64_t)
+DEFINE_MULDIV(64, unsigned __int128, __int128)
+DEFINE_SIZED_HANDLER(mul_rm, mul_rm8, mul_rm16, mul_rm32, mul_rm64)
+DEFINE_SIZED_HANDLER(imul_rm, imul_rm8, imul_rm16, imul_rm32, imul_rm64)
+DEFINE_SIZED_HANDLER(div_rm, div_rm8, div_rm16, div_rm32, div_rm64)
+DEFINE_SIZED_HANDLER(idiv_rm, idiv_rm8, idiv_rm16, idiv_rm32, idiv_rm64)
+
+// The two- and three-operand forms (0F AF, 69 and 6B).
+#define DEFINE_IMUL(bits, swide) \
+static inline void imul_r ## bits(Emulator* emu, Instr* instr, UINT(bits) value) { \
+    swide result = (swide) (INT(bits)) get_rm ## bits(emu, &instr->modrm) * (INT(bits)) value; \
+    UINT(bits) low = result; \
+    set_r ## bits(emu, &instr->modrm, low); \
+    int overflow = result != (INT(bits)) low; \
+    update_rflags_result(emu, low, bits / 8, overflow, overflow); \
+} \
+static void imul_r ## bits ## _rm ## bits(Emulator* emu, Instr* instr) { \
+    /* 4D 0F AF D3 => imul r10, r11 */ \
+    imul_r ## bits(emu, instr, get_r ## bits(emu, &instr->modrm)); \
+} \
+static void imul_r ## bits ## _rm ## bits ## _imm(Emulator* emu, Instr* instr) { \
+    imul_r ## bits(emu, instr, instr->imm); \
+}
+
+DEFINE_IMUL(16, int32_t)
+DEFINE_IMUL(32, int64_t)
+DEFINE_IMUL(64, __int128)
+DEFINE_SIZED_HANDLER_V(imul_r_rm, imul_r16_rm16, imul_r32_rm32, imul_r64_rm64)
+DEFINE_SIZED_HANDLER_V(imul_r_rm_imm, imul_r16_rm16_imm, imul_r32_rm32_imm, imul_r64_rm64_imm)
+
+// Shifts and rotates of a size bytes value by count, from 1 to 31 or 63
+// for 64-bit operands. They record the flags and return the result.
+static inline uint64_t shift_shl(Emulator* emu, uint64_t value, int count, int size) {
+    int bits = size * 8;
+    uint64_t result = value << count;
+    int carry = count <= bits ? (value >> (bits - count)) & 1 : 0;
+    int overflow = ((result & sign_bit(size)) != 0) != carry;
+    update_rflags_result(emu, result, size, carry, overflow);
+    return result;
+}
+
+static inline uint64_t shift_shr(Emulator* emu, uint64_t value, int count, int size) {
+    uint64_t result = value >> count;
+    update_rflags_result(emu, result, size, (value >> (count - 1)) & 1, (value & sign_bit(size)) != 0);
+    return result;
+}
+
+static inline uint64_t shift_sar(Emulator* emu, uint64_t value, int count, int size) {
+    int64_t signed_value = sign_extend(value, size);
+    uint64_t result = signed_value >> count;
+    update_rflags_result(emu, result, size, (signed_value >> (count - 1)) & 1, 0);
+    return result;
+}
+
+// Rotates change CF and OF only.
+static void set_carry_overflow(Emulator* emu, int carry, int overflow) {
+    uint64_t rflags = get_rflags(emu) & ~(CARRY_FLAG | OVERFLOW_FLAG);
+    set_rflags(emu, rflags | (carry ? CARRY_FLAG : 0) | (overflow ? OVERFLOW_FLAG : 0));
+}
+
+static inline uint64_t shift_rol(Emulator* emu, uint64_t value, int count, int size) {
+    int bits = size * 8;
+    count %= bits;
+    uint64_t result = count ? ((value << count) | (value >> (bits - count))) & size_mask(size) : value;
+    int carry = result & 1;
+    set_carry_overflow(emu, carry, ((result & sign_bit(size)) != 0) != carry);
+    return result;
+}
+
+static inline uint64_t shift_ror(Emulator* emu, uint64_t value, int count, int size) {
+    int bits = size * 8;
+    count %= bits;
+    uint64_t result = count ? ((value >> count) | (value << (bits - count))) & size_mask(size) : value;
+    uint64_t msb = sign_bit(size);
+    set_carry_overflow(emu, (result & msb) != 0, ((result & msb) != 0) != ((result & (msb >> 1)) != 0));
+    return result;
+}
+
+// By imm8, by 1 (D0/D1, decoded as imm = 1) or by CL. A count of 0 keeps
+// the flags, but the operand is still written, which clears the upper half
+// of a 32-bit register.
+#define DEFINE_SHIFT_WIDTH(op, bits) \
+static void op ## _rm ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) value = get_rm ## bits(emu, &instr->modrm); \
+    int count = instr->imm & (bits == 64 ? 0x3F : 0x1F); \
+    if (count != 0) { \
+        value = shift_ ## op(emu, value, count, bits / 8); \
+    } \
+    set_rm ## bits(emu, &instr->modrm, value); \
+} \
+static void op ## _rm ## bits ## _cl(Emulator* emu, Instr* instr) { \
+    UINT(bits) value = get_rm ## bits(emu, &instr->modrm); \
+    int count = get_register8(emu, CL) & (bits == 64 ? 0x3F : 0x1F); \
+    if (count != 0) { \
+        value = shift_ ## op(emu, value, count, bits / 8); \
+    } \
+    set_rm ## bits(emu, &instr->modrm, value); \
+}
+
+#define DEFINE_SHIFT(op) \
+DEFINE_SHIFT_WIDTH(op, 8) \
+DEFINE_SHIFT_WIDTH(op, 16) \
+DEFINE_SHIFT_WIDTH(op, 32) \
+DEFINE_SHIFT_WIDTH(op, 64) \
+DEFINE_SIZED_HANDLER(op ## _rm, op ## _rm8, op ## _rm16, op ## _rm32, op ## _rm64) \
+DEFINE_SIZED_HANDLER(op ## _rm_cl, op ## _rm8_cl, op ## _rm16_cl, op ## _rm32_cl, op ## _rm64_cl)
+
+DEFINE_SHIFT(shl)
+DEFINE_SHIFT(shr)
+DEFINE_SHIFT(sar)
+DEFINE_SHIFT(rol)
+DEFINE_SHIFT(ror)
+
+// Sign-extend rAX into itself (98) and into rDX (99).
+#define DEFINE_CONVERT(name_a, name_d, bits, half) \
+static void name_a(Emulator* emu, Instr* instr) { \
+    set_register ## bits(emu, RAX, (INT(half)) get_register ## half(emu, RAX)); \
+} \
+static void name_d(Emulator* emu, Instr* instr) { \
+    set_register ## bits(emu, RDX, (INT(bits)) get_register ## bits(emu, RAX) < 0 ? -1 : 0); \
+}
+
+DEFINE_CONVERT(cbw, cwd, 16, 8)
+DEFINE_CONVERT(cwde, cdq, 32, 16)
+DEFINE_CONVERT(cdqe, cqo, 64, 32)
+DEFINE_SIZED_HANDLER_V(cdqe, cbw, cwde, cdqe)
+DEFINE_SIZED_HANDLER_V(cqo, cwd, cdq, cqo)
+
+// Instructions whose operands do not depend on the operand size.
+static void push_r(Emulator* emu, Instr* instr) {
+    push64(emu, get_register64(emu, instr->reg));
+}
+DEFINE_HANDLER_OP(push_r, 0, OP_PUSH_R)
+
+static void pop_r(Emulator* emu, Instr* instr) {
+    set_register64(emu, instr->reg, pop64(emu));
+}
+DEFINE_HANDLER_OP(pop_r, 0, OP_POP_R)
+
+static void push_imm(Emulator* emu, Instr* instr) {
+    push64(emu, instr->imm);
+}
+DEFINE_HANDLER_OP(push_imm, 0, OP_PUSH_IMM)
+
+static void push_rm(Emulator* emu, Instr* instr) {
+    push64(emu, get_rm64(emu, &instr->modrm));
+}
+DEFINE_HANDLER(push_rm, 0)
+
+static void pop_rm(Emulator* emu, Instr* instr) {
+    // The address is computed with the incremented rsp.
+    uint64_t value = pop64(emu);
+    set_rm64(emu, &instr->modrm, value);
+}
+DEFINE_HANDLER(pop_rm, 0)
+
+static void pushf(Emulator* emu, Instr* instr) {
+    push64(emu, get_rflags(emu));
+}
+DEFINE_HANDLER(pushf, 0)
+
+static void popf(Emulator* emu, Instr* instr) {
+    set_rflags(emu, pop64(emu));
+}
+DEFINE_HANDLER(popf, 0)
+
+static void clc(Emulator* emu, Instr* instr) {
+    set_rflags(emu, get_rflags(emu) & ~CARRY_FLAG);
+}
+DEFINE_HANDLER(clc, 0)
+
+static void stc(Emulator* emu, Instr* instr) {
+    set_rflags(emu, get_rflags(emu) | CARRY_FLAG);
+}
+DEFINE_HANDLER(stc, 0)
+
+static void cmc(Emulator* emu, Instr* instr) {
+    set_rflags(emu, get_rflags(emu) ^ CARRY_FLAG);
+}
+DEFINE_HANDLER(cmc, 0)
+
+static void cld(Emulator* emu, Instr* instr) {
+    set_rflags(emu, get_rflags(emu) & ~DIRECTION_FLAG);
+}
+DEFINE_HANDLER(cld, 0)
+
+static void std(Emulator* emu, Instr* instr) {
+    set_rflags(emu, get_rflags(emu) | DIRECTION_FLAG);
+}
+DEFINE_HANDLER(std, 0)
+
+// String instructions work on [rsi] and [rdi], which move up by the operand
+// size after each element, or down with DF. With rep (F2 or F3) they run
+// rcx times, and the usual upward cases run as one bulk operation on guest
+// memory with the result of doing it an element at a time.
+static uint64_t get_memory(Emulator* emu, uint64_t address, int size) {
+    switch (size) {
+        case 1: return get_memory8(emu, address);
+        case 2: return get_memory16(emu, address);
+        case 4: return get_memory32(emu, address);
+        default: return get_memory64(emu, address);
+    }
+}
+
+static void set_memory(Emulator* emu, uint64_t address, uint64_t value, int size) {
+    switch (size) {
+        case 1: set_memory8(emu, address, value); break;
+        case 2: set_memory16(emu, address, value); break;
+        case 4: set_memory32(emu, address, value); break;
+        default: set_memory64(emu, address, value); break;
+    }
+}
+
+static int64_t string_step(Emulator* emu, int size) {
+    return (emu->rflags & DIRECTION_FLAG) ? -size : size;
+}
+
+// Moves rsi (if it is an operand) and rdi past count elements, and takes
+// them off rcx with rep.
+static void string_advance(Emulator* emu, Instr* instr, int uses_rsi, uint64_t count, int size) {
+    int64_t offset = (int64_t) count * string_step(emu, size);
+    if (uses_rsi) {
+        set_register64(emu, RSI, get_register64(emu, RSI) + offset);
+    }
+    set_register64(emu, RDI, get_register64(emu, RDI) + offset);
+    if (instr->rep) {
+        set_register64(emu, RCX, get_register64(emu, RCX) - count);
+    }
+}
+
+static void movs(Emulator* emu, Instr* instr, int size) {
+    uint64_t count = instr->rep ? get_register64(emu, RCX) : 1;
+    uint64_t src = get_register64(emu, RSI);
+    uint64_t dst = get_register64(emu, RDI);
+    // An element may not overlap the one after its source, which it would
+    // read before it is written.
+    if (count > 1 && string_step(emu, size) > 0 && (dst - src >= (uint64_t) size || dst == src)) {
+        vm_copy(emu->memory, dst, src, count * size);
+    } else {
+        int64_t step = string_step(emu, size);
+        for (uint64_t i = 0; i < count; i++) {
+            set_memory(emu, dst + i * step, get_memory(emu, src + i * step, size), size);
         }
-        case 1: {
-            // DEC rm32
-            uint32_t value = get_rm32(emu, &modrm);
-            set_rm32(emu, &modrm, value - 1);
-            break;
+    }
+    string_advance(emu, instr, 1, count, size);
+}
+
+static void stos(Emulator* emu, Instr* instr, int size) {
+    uint64_t count = instr->rep ? get_register64(emu, RCX) : 1;
+    uint64_t dst = get_register64(emu, RDI);
+    uint64_t value = get_register64(emu, RAX) & size_mask(size);
+    // A value of one repeated byte, which zeroing is.
+    if (count > 1 && string_step(emu, size) > 0 && value == (value & 0xFF) * (size_mask(size) / 0xFF)) {
+        vm_fill(emu->memory, dst, value, count * size);
+    } else {
+        int64_t step = string_step(emu, size);
+        for (uint64_t i = 0; i < count; i++) {
+            set_memory(emu, dst + i * step, value, size);
         }
-        case 2: {
-            // near CALL Ev
-            // ex) ff 15 72 2f 00 00 => call QWORD PTR [rip+0x2f72]
-            //     rm = 5 (= RSP) but unused.
-            //     disp32 = 0x2f72;
-            push32(emu, emu->rip);
-            emu->rip += ((int32_t) modrm.disp32);
-            break;
+    }
+    string_advance(emu, instr, 0, count, size);
+}
+
+// Compares [rsi] with [rdi]. repe (F3) stops at the first elements that
+// differ and repne (F2) at the first that are equal, or when rcx runs out.
+static void cmps(Emulator* emu, Instr* instr, int size) {
+    uint64_t count = instr->rep ? get_register64(emu, RCX) : 1;
+    uint64_t src = get_register64(emu, RSI);
+    uint64_t dst = get_register64(emu, RDI);
+    int64_t step = string_step(emu, size);
+    uint64_t i = 0;
+    if (count > 1 && instr->rep == 0xF3 && step > 0) {
+        // Only the last element compared sets the flags.
+        i = vm_mismatch(emu->memory, src, dst, count * size) / size;
+        if (i == count) {
+            i--;
+        }
+        alu_sub(emu, get_memory(emu, src + i * size, size), get_memory(emu, dst + i * size, size), size, 1);
+        i++;
+    } else {
+        while (i < count) {
+            alu_sub(emu, get_memory(emu, src + i * step, size), get_memory(emu, dst + i * step, size), size, 1);
+            i++;
+            if (instr->rep == 0xF3 ? !is_zero(emu) : instr->rep == 0xF2 && is_zero(emu)) {
+                break;
+            }
         }
-        case 3: // far CALL Ep
-        case 4: // near JMP Ev
-        case 5: // far JMP Mp
-        case 6: // PUSH Ev
-        default:
-            printf("not implemented: FF /%d\n", modrm.opecode);
-            exit(1);
     }
+    string_advance(emu, instr, 1, i, size);
 }
 
-#define DEFINE_JX(flag, is_flag) \
-static void j ## flag(Emulator *emu) {  \
-    int diff = is_flag(emu) ? get_sign_code8(emu, 1) : 0; \
-    emu->rip += (diff + 2); \
+#define DEFINE_STRING(bits) \
+static void movs ## bits(Emulator* emu, Instr* instr) { \
+    movs(emu, instr, bits / 8); \
 } \
-static void jn ## flag(Emulator *emu) { \
-    int diff = is_flag(emu) ? 0 : get_sign_code8(emu, 1); \
-    emu->rip += (diff + 2); \
-}
-
-DEFINE_JX(c, is_carry)
-DEFINE_JX(z, is_zero)
-DEFINE_JX(s, is_sign)
-DEFINE_JX(o, is_overflow)
-
-static void jl(Emulator* emu) {
-    int diff = (is_sign(emu) != is_overflow(emu)) ? get_sign_code8(emu, 1) : 0;
-    emu->rip += (diff + 2);
-}
-
-static void jle(Emulator* emu) {
-    int diff = ( is_zero(emu) || is_sign(emu) != is_overflow(emu)) ? get_sign_code8(emu, 1) : 0;
-    emu->rip += (diff + 2);
-}
-
-void short_jump(Emulator *emu) {
-    int8_t diff = get_sign_code8(emu, 1);
-    emu->rip += (diff + 2);
-}
-
-void near_jump(Emulator *emu) {
-    int32_t diff = get_sign_code32(emu, 1);
-    emu->rip += diff + 5;  // diff + oprand(1 byte) + opcode(4 bytes)
-}
-
-static void rex_prefix(Emulator* emu) {
-    uint8_t wrxb = get_code8(emu, 0) - 0x40;
-    emu->rip += 1;
-    uint8_t w = (wrxb & 0x08) >> 3;
-    uint8_t r = (wrxb & 0x04) >> 2;
-    // uint16_t x = (wrxb & 0x02) >> 1;
-    uint16_t b = (wrxb & 0x01);
-
-    if (!w) {
-        // 32-bit mode
-        uint8_t opcode32 = get_code8(emu, 0);
-        if (opcode32 >= 0x50 && opcode32 < 0x58) {
-            // 41 54 => push r12
-            uint8_t reg = get_code8(emu, 0) - 0x50 + R8;
-            push64(emu, get_register64(emu, reg));
-            emu->rip += 1;
-        } else if (opcode32 >= 0x58 && opcode32 <= 0x5F) {
-            // 41 5C => pop r12
-            uint8_t reg = get_code8(emu, 0) - 0x58 + R8;
-            uint64_t value = pop64(emu);
-            set_register64(emu, reg, value);
-            emu->rip += 1;
-        } else if (opcode32 >= 0xB8 && opcode32 <= 0xBF ) {
-            // mov_r64_imm32
-            // 41 BA 00 00 00 00 => mov r10, 0x0
-            uint8_t reg = get_code8(emu, 0) - 0xB8 + R8;
-            uint64_t value = get_code32(emu, 1);
-            emu->registers[reg] = value;
-            emu->rip += 5;  // opcode 1 byte, operand 4 bytes
-        } else if (opcode32 == 0x88) {
-            // mov_rm8_r8
-            // ex) 40 88 75 FE => mov BYTE PTR [rbp-0x2],sil
-            emu->rip += 1;
-            ModRM modrm;
-            parse_modrm(emu, &modrm);
-            uint8_t r8 = get_r8(emu, &modrm);
-            set_rm8(emu, &modrm, r8);
-        } else if (opcode32 == 0x89) {
-            // mov_rm32_r32
-            // 44 89 45 ec => movl %r8d, -0x14(%rbp)
-            emu->rip += 1;
-            ModRM modrm;
-            parse_modrm(emu, &modrm);
-
-            uint8_t reg = (r << 3) | (modrm.reg_index + R8);
-            uint32_t r32 = get_register64(emu, reg);
-            set_rm32(emu, &modrm, r32);  // TODO(c-bata): We may be need to implement set_rm64 here.
-        } else {
-            printf("not implemented: rex_prefix=%02x / w=0\n", 0x40 + wrxb);
-            exit(1);
+static void stos ## bits(Emulator* emu, Instr* instr) { \
+    stos(emu, instr, bits / 8); \
+} \
+static void cmps ## bits(Emulator* emu, Instr* instr) { \
+    cmps(emu, instr, bits / 8); \
+}
+
+DEFINE_STRING(8)
+DEFINE_STRING(16)
+DEFINE_STRING(32)
+DEFINE_STRING(64)
+DEFINE_SIZED_HANDLER(movs, movs8, movs16, movs32, movs64)
+DEFINE_SIZED_HANDLER(stos, stos8, stos16, stos32, stos64)
+DEFINE_SIZED_HANDLER(cmps, cmps8, cmps16, cmps32, cmps64)
+
+static void nop(Emulator* emu, Instr* instr) {
+}
+DEFINE_HANDLER(nop, 0)
+
+static void leave(Emulator* emu, Instr* instr) {
+    set_register64(emu, RSP, get_register64(emu, RBP));
+    set_register64(emu, RBP, pop64(emu));
+}
+DEFINE_HANDLER(leave, 0)
+
+static void jump(Emulator* emu, Instr* instr) {
+    emu->rip = instr->imm;
+}
+DEFINE_HANDLER_OP(jump, 1, OP_JMP)
+
+static void jump_rm(Emulator* emu, Instr* instr) {
+    emu->rip = get_rm64(emu, &instr->modrm);
+}
+DEFINE_HANDLER(jump_rm, 1)
+
+static void call_rel(Emulator* emu, Instr* instr) {
+    push64(emu, emu->rip);
+    emu->rip = instr->imm;
+}
+DEFINE_HANDLER_OP(call_rel, 1, OP_CALL)
+
+static void call_rm(Emulator* emu, Instr* instr) {
+    // FF 15 72 2F 00 00 => call QWORD PTR [rip+0x2f72]
+    uint64_t target = get_rm64(emu, &instr->modrm);
+    push64(emu, emu->rip);
+    emu->rip = target;
+}
+DEFINE_HANDLER_OP(call_rm, 1, OP_CALL_RM)
+
+static void ret(Emulator* emu, Instr* instr) {
+    emu->rip = pop64(emu);
+}
+DEFINE_HANDLER_OP(ret, 1, OP_RET)
+
+static void ret_imm(Emulator* emu, Instr* instr) {
+    emu->rip = pop64(emu);
+    set_register64(emu, RSP, get_register64(emu, RSP) + instr->imm);
+}
+DEFINE_HANDLER(ret_imm, 1)
+
+// Condition codes in the order of their encoding (the low 4 bits of 70+cc,
+// 0F 80+cc, 0F 90+cc and 0F 40+cc).
+#define CONDITIONS(X) \
+    X(o, O, is_overflow(emu)) \
+    X(no, NO, !is_overflow(emu)) \
+    X(b, B, is_carry(emu)) \
+    X(ae, AE, !is_carry(emu)) \
+    X(e, E, is_zero(emu)) \
+    X(ne, NE, !is_zero(emu)) \
+    X(be, BE, is_carry(emu) || is_zero(emu)) \
+    X(a, A, !is_carry(emu) && !is_zero(emu)) \
+    X(s, S, is_sign(emu)) \
+    X(ns, NS, !is_sign(emu)) \
+    X(p, P, is_parity(emu)) \
+    X(np, NP, !is_parity(emu)) \
+    X(l, L, is_sign(emu) != is_overflow(emu)) \
+    X(ge, GE, is_sign(emu) == is_overflow(emu)) \
+    X(le, LE, is_zero(emu) || is_sign(emu) != is_overflow(emu)) \
+    X(g, G, !is_zero(emu) && is_sign(emu) == is_overflow(emu))
+
+// A 32-bit cmov clears the upper half even if it does not move.
+#define DEFINE_CMOV_WIDTH(cc, condition, bits) \
+static void cmov ## cc ## _r ## bits ## _rm ## bits(Emulator* emu, Instr* instr) { \
+    UINT(bits) value = get_rm ## bits(emu, &instr->modrm); \
+    if (!(condition)) { \
+        value = get_r ## bits(emu, &instr->modrm); \
+    } \
+    set_r ## bits(emu, &instr->modrm, value); \
+}
+
+// Decoders store the absolute target of a branch in instr->imm, so the
+// short and the near forms share a handler.
+#define DEFINE_CONDITIONAL(cc, CC, condition) \
+static void j ## cc(Emulator* emu, Instr* instr) { \
+    if (condition) { \
+        emu->rip = instr->imm; \
+    } \
+} \
+DEFINE_HANDLER_OP(j ## cc, 1, OP_J ## CC) \
+static void set ## cc(Emulator* emu, Instr* instr) { \
+    set_rm8(emu, &instr->modrm, (condition) ? 1 : 0); \
+} \
+DEFINE_HANDLER(set ## cc, 0) \
+DEFINE_CMOV_WIDTH(cc, condition, 16) \
+DEFINE_CMOV_WIDTH(cc, condition, 32) \
+DEFINE_CMOV_WIDTH(cc, condition, 64) \
+DEFINE_SIZED_HANDLER_V(cmov ## cc, cmov ## cc ## _r16_rm16, cmov ## cc ## _r32_rm32, cmov ## cc ## _r64_rm64)
+
+CONDITIONS(DEFINE_CONDITIONAL)
+
+#define CONDITION_HANDLER(cc, CC, condition) &j ## cc ## _handler,
+static const Handler* const jcc[16] = {CONDITIONS(CONDITION_HANDLER)};
+#undef CONDITION_HANDLER
+#define CONDITION_HANDLER(cc, CC, condition) &set ## cc ## _handler,
+static const Handler* const setcc[16] = {CONDITIONS(CONDITION_HANDLER)};
+#undef CONDITION_HANDLER
+#define CONDITION_HANDLER(cc, CC, condition) &cmov ## cc ## _handler,
+static const Handler* const cmovcc[16] = {CONDITIONS(CONDITION_HANDLER)};
+#undef CONDITION_HANDLER
+
+// Groups, indexed by ModR/M.reg (Table A-6, Vol. 2D). NULL entries are
+// not implemented.
+static const Handler* const group1[8] = {
+    &add_rm_imm_handler, &or_rm_imm_handler, &adc_rm_imm_handler, &sbb_rm_imm_handler,
+    &and_rm_imm_handler, &sub_rm_imm_handler, &xor_rm_imm_handler, &cmp_rm_imm_handler,
+};
+static const Handler* const group1a[8] = {&pop_rm_handler};
+static const Handler* const group2[8] = {
+    &rol_rm_handler, &ror_rm_handler, NULL /* rcl */, NULL /* rcr */,
+    &shl_rm_handler, &shr_rm_handler, &shl_rm_handler /* sal */, &sar_rm_handler,
+};
+static const Handler* const group2_cl[8] = {
+    &rol_rm_cl_handler, &ror_rm_cl_handler, NULL, NULL,
+    &shl_rm_cl_handler, &shr_rm_cl_handler, &shl_rm_cl_handler, &sar_rm_cl_handler,
+};
+static const Handler* const group3[8] = {
+    &test_rm_imm_handler, &test_rm_imm_handler, &not_rm_handler, &neg_rm_handler,
+    &mul_rm_handler, &imul_rm_handler, &div_rm_handler, &idiv_rm_handler,
+};
+static const Handler* const group4[8] = {&inc_rm_handler, &dec_rm_handler};
+// call, jmp and push are always 64-bit.
+static const Handler* const group5[8] = {
+    &inc_rm_handler, &dec_rm_handler, &call_rm_handler, NULL /* far call */,
+    &jump_rm_handler, NULL /* far jmp */, &push_rm_handler, NULL,
+};
+static const Handler* const group11[8] = {&mov_rm_imm_handler};
+
+static void block_end(Emulator* emu, Instr* instr) {
+}
+
+static void trace_jump_threaded(Emulator* emu, Instr* instr) {
+    uint64_t next = instr->trace_dir == TRACE_TAKEN ? instr->imm : emu->rip;
+    instr->exec(emu, instr);
+    if (emu->rip != next) {
+        return;  // a side exit
+    }
+    instr++;
+    emu->rip += instr->len;
+    instr->thread(emu, instr);
+}
+
+// Superinstructions: the threaded variant of the first instruction of a
+// sequence that 9cc emits a lot also runs the ones after it, which saves
+// their dispatch. Their own handlers stay in place for everything but the
+// threaded interpreter. Each moves instr and emu->rip to the last
+// instruction it covers before going on like DEFINE_THREADED.
+
+// Runs of each enum Fusion (see fusion_run_count()).
+static uint64_t fusion_runs[NUM_FUSIONS];
+
+// 50+r 58+r => push r1; pop r2. The stack slot is written as by the push.
+static void push_pop_threaded(Emulator* emu, Instr* instr) {
+    fusion_runs[FUSE_PUSH_POP]++;
+    uint64_t value = get_register64(emu, instr->reg);
+    set_memory64(emu, get_register64(emu, RSP) - 8, value);
+    instr++;
+    emu->rip += instr->len;
+    set_register64(emu, instr->reg, value);
+    instr++;
+    emu->rip += instr->len;
+    instr->thread(emu, instr);
+}
+
+// 55 48 89 E5 48 83 EC ib => push rbp; mov rbp, rsp; sub rsp, imm
+static void prologue_threaded(Emulator* emu, Instr* instr) {
+    fusion_runs[FUSE_PROLOGUE]++;
+    push64(emu, get_register64(emu, RBP));
+    uint64_t rsp = get_register64(emu, RSP);
+    set_register64(emu, RBP, rsp);
+    instr += 2;
+    emu->rip += instr[-1].len + instr->len;
+    if (instr->flags_dead) {
+        set_register64(emu, RSP, rsp - instr->imm);
+    } else {
+        set_register64(emu, RSP, alu_sub(emu, rsp, instr->imm, 8, 1));
+    }
+    instr++;
+    emu->rip += instr->len;
+    instr->thread(emu, instr);
+}
+
+// cmp or test, then jcc, which may be a jump of a trace (see
+// trace_jump_threaded()) or else ends the block.
+#define DEFINE_CMP_JCC(cc, CC, condition) \
+static void cmp_j ## cc ## _threaded(Emulator* emu, Instr* instr) { \
+    fusion_runs[FUSE_CMP_JCC]++; \
+    instr->exec(emu, instr); \
+    instr++; \
+    emu->rip += instr->len; \
+    uint64_t next = instr->trace_dir == TRACE_TAKEN ? instr->imm : emu->rip; \
+    if (condition) { \
+        emu->rip = instr->imm; \
+    } \
+    if (instr->trace_dir == TRACE_NONE || emu->rip != next) { \
+        return; \
+    } \
+    instr++; \
+    emu->rip += instr->len; \
+    instr->thread(emu, instr); \
+}
+
+// 0F 9C C0 48 0F B6 C0 => setl al; movzx rax, al
+#define DEFINE_SETCC_MOVZX(cc, CC, condition) \
+static void set ## cc ## _movzx_threaded(Emulator* emu, Instr* instr) { \
+    fusion_runs[FUSE_SETCC_MOVZX]++; \
+    uint8_t value = (condition) ? 1 : 0; \
+    set_rm8(emu, &instr->modrm, value); \
+    instr++; \
+    emu->rip += instr->len; \
+    if (instr->size == 8) { \
+        set_r64(emu, &instr->modrm, value); \
+    } else { \
+        set_r32(emu, &instr->modrm, value); \
+    } \
+    instr++; \
+    emu->rip += instr->len; \
+    instr->thread(emu, instr); \
+}
+
+CONDITIONS(DEFINE_CMP_JCC)
+CONDITIONS(DEFINE_SETCC_MOVZX)
+
+#define CONDITION_HANDLER(cc, CC, condition) cmp_j ## cc ## _threaded,
+static instruction_func_t* const cmp_jcc[16] = {CONDITIONS(CONDITION_HANDLER)};
+#undef CONDITION_HANDLER
+#define CONDITION_HANDLER(cc, CC, condition) set ## cc ## _movzx_threaded,
+static instruction_func_t* const setcc_movzx[16] = {CONDITIONS(CONDITION_HANDLER)};
+#undef CONDITION_HANDLER
+
+
+typedef struct {
+    const Handler* handler;
+    // Instructions that share an opcode and differ in ModR/M.reg.
+    const Handler* const* group;
+    uint8_t encoding;
+    uint8_t width;
+    uint8_t flags;
+} OpcodeEntry;
+
+static OpcodeEntry primary[256];
+static OpcodeEntry two_byte[256];      // 0F xx
+static OpcodeEntry three_byte_38[256]; // 0F 38 xx
+static OpcodeEntry three_byte_3a[256]; // 0F 3A xx
+
+typedef struct {
+    uint8_t rex;           // the REX byte, or 0
+    uint8_t operand_size;  // 66
+    uint8_t address_size;  // 67
+    uint8_t rep;           // F2 or F3, or 0
+    uint8_t segment;       // segment override, or 0
+} Prefixes;
+
+
+void init_block_end(Instr* instr) {
+    memset(instr, 0, sizeof(Instr));
+    instr->exec = block_end;
+    instr->thread = block_end;
+    instr->ends_block = 1;
+}
+
+void init_trace_jump(Instr* instr, int dir) {
+    instr->thread = trace_jump_threaded;
+    instr->trace_dir = dir;
+}
+
+int flags_access(const Instr* instr) {
+    switch (instr->op) {
+        case OP_MOV_RM_R: case OP_MOV_R_RM: case OP_MOV_RM_IMM: case OP_MOV_R_IMM:
+        case OP_MOVSXD: case OP_LEA: case OP_MOVZX_R_RM8:
+        case OP_PUSH_R: case OP_POP_R: case OP_PUSH_IMM:
+        case OP_JMP: case OP_CALL: case OP_CALL_RM: case OP_RET:
+            return 0;
+        case OP_ADC_RM_R: case OP_ADC_R_RM: case OP_ADC_RM_IMM:
+        case OP_SBB_RM_R: case OP_SBB_R_RM: case OP_SBB_RM_IMM:
+        case OP_INC: case OP_DEC:
+            return READS_FLAGS | WRITES_FLAGS;  // CF
+        default:
+            if (OP_ADD_RM_R <= instr->op && instr->op <= OP_TEST_RM_IMM) {
+                return WRITES_FLAGS;
+            }
+            return READS_FLAGS;
+    }
+}
+
+// The handlers of flag-setting instructions and their _nf variants.
+static const Handler* const flagless[][2] = {
+#define ALU_FLAGLESS(name) \
+    {&name ## _rm_r_handler, &name ## _rm_r_nf_handler}, \
+    {&name ## _r_rm_handler, &name ## _r_rm_nf_handler}, \
+    {&name ## _rm_imm_handler, &name ## _rm_imm_nf_handler},
+    ALU_FLAGLESS(add) ALU_FLAGLESS(or) ALU_FLAGLESS(adc) ALU_FLAGLESS(sbb)
+    ALU_FLAGLESS(and) ALU_FLAGLESS(sub) ALU_FLAGLESS(xor) ALU_FLAGLESS(cmp)
+#undef ALU_FLAGLESS
+    {&test_rm_r_handler, &test_rm_r_nf_handler},
+    {&test_rm_imm_handler, &test_rm_imm_nf_handler},
+    {&inc_rm_handler, &inc_rm_nf_handler},
+    {&dec_rm_handler, &dec_rm_nf_handler},
+};
+
+int drop_flags(Instr* instr) {
+    int i, j;
+    for (i = 0; i < (int) (sizeof(flagless) / sizeof(flagless[0])); i++) {
+        for (j = 0; j < 4; j++) {
+            if (flagless[i][0]->exec[j] != NULL && instr->exec == flagless[i][0]->exec[j]) {
+                instr->exec = flagless[i][1]->exec[j];
+                instr->thread = flagless[i][1]->thread[j];
+                instr->flags_dead = 1;
+                return 1;
+            }
         }
-        return;
-    }
-
-    // 64-bit mode
-    uint16_t po = get_code8(emu, 0); // primary opcode
-    emu->rip += 1;
-
-    // Primary opcode only
-    if (po == 0x99) {
-        // 48 99 => cqo
-        // TODO: Must expand rax value to 128 register (RDX, RAX)
-        // uint64_t rax = get_register64(emu, RAX);
-        // set_register64(emu, RAX, rax & 0x7FFFFFFF);
-        // set_register64(emu, RDX, (rax & 0x8FFFFFFF) >> 63);
-        set_register64(emu, RDX, 0);
-        return;
-    }
-
-    // Primary opcode + Secondary opcode + ModR/M
-    uint8_t so = get_code8(emu, 0);
-    if (po == 0x0F && so == 0xAF) { // Signed multiply
-        // TODO: Parse ModR/M here.
-        uint8_t oprand = get_code8(emu, 1);
-        emu->rip += 2;
-
-        // 0000 1111 : 1010 1111 : 11 : reg1 reg2
-        // ex)
-        //   48 0F AF C7 => imul rax, rdi  // reg1=0, reg2=7
-        //     48 => 0100 1000 => W=1, R=0, X=0, B=0
-        //     C7 => 1100 0111 => reg1 = 000 = 0, reg2 = 111 = 7
-        //
-        //   4D 0F AF D3 => imul r10, r11  // reg1=10, reg2=11
-        //     4D => 0100 1101 => W=1, R=1, X=0, B=1
-        //     D3 => 1101 0011 => reg1 = 010 = 2, reg2 = 011 = 3
-        //
-        //   49 0F AF C3 => imul rax,r11   // reg1=0, reg2=11
-        //     49 => 0100 1001 => W=1, R=0, X=0, B=1
-        //     C3 => 1100 0011 => reg1 = 000 = 0, reg2 = 011 = 3
-        //
-        //   4C 0F AF D7 => imul r10,rdi  // reg1=10, reg2=7
-        //     4C => 0100 1100 => W=1, R=1, X=0, B=0
-        //     D7 => 1101 0111 => reg1 = 010 = 2, reg2 = 111 = 7
-        uint8_t reg1 = (r << 3) | ((oprand & 0x38) >> 3); // 0011 1000
-        uint8_t reg2 = (b << 3) | (oprand & 0x07);  // 0000 B000 | (oprand & 0000 0111)
-
-        // TODO: set overflow values into RDX and set OF=1.
-        uint64_t result = get_register64(emu, reg1) * get_register64(emu, reg2);
-        set_register64(emu, reg1, result);
-        return;
-    } else if (po == 0x0F && so == 0xB6) {
-        emu->rip += 1;
-        ModRM modrm;
-        parse_modrm(emu, &modrm);
-        // TODO: We may rewrite here like 'set_rm8(emu, &modrm, get_r8(emu, &modrm));'
-        if (modrm.mod == 0) {
-            // ex) 48 0F B6 00 => movzx  rax,BYTE PTR [rax]
-            uint8_t reg1 = (r << 3) | (modrm.reg_index >> 3);
-            uint8_t reg2 = (b << 3) | (modrm.rm);
-            uint64_t addr = get_register64(emu, reg2);
-            // movzx - Move zero-extended
-            set_register64(emu, reg1, 0);
-            set_register8(emu, reg1, get_memory8(emu, addr));
-        } else if (modrm.mod == 3) {
-            // ex) 48 0F B6 C0 => movzx rax, al
-            //     48 => 0100 1000 => W=1, R=0, X=0, B=0
-            //     C0 => 1100 0000 => reg1 = 000 = 0, reg2 = 000 = 0
-            // ex) 4C 0F B6 D0 => movzx r10, al
-            //     4C => 0100 1100 => W=1, R=1, X=0, B=0
-            //     D0 => 1101 0000 => reg1 = 000 = 0, reg2 = 000 = 0
-            uint8_t reg1 = (r << 3) | (modrm.reg_index >> 3);
-            uint8_t reg2 = (b << 3) | (modrm.rm);
-            uint64_t result = get_register8(emu, reg2);
-            // movzx - Move zero-extended
-            set_register64(emu, reg1, 0);
-            set_register64(emu, reg1, result);
+    }
+    return 0;
+}
+
+static int is_register(const Instr* instr, int op, int rm) {
+    return instr->op == op && instr->size == 8 && instr->modrm.mod == 3 && instr->modrm.rm == rm;
+}
+
+static int condition_of(instruction_func_t* exec, const Handler* const handlers[16]) {
+    for (int cc = 0; cc < 16; cc++) {
+        if (exec == handlers[cc]->exec[0]) {
+            return cc;
         }
-        return;
-    } else if (po == 0x0F) {
-        printf("not implemented: rex_prefix=%02x / w=1 rex_opcode=%02x%02x\n",
-               0x40 + wrxb, po, so);
-        exit(1);
-    }
-
-    // Primary opcode + ModR/M
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    uint8_t reg = (r << 3) | modrm.reg_index;
-    uint8_t rm = (b << 3) | modrm.rm;
-    // scale = modrm.scale;
-    // index = (x << 3) | modrm.index;
-    // base = (b << 3) | modrm.base;
-    if (po == 0x01) {
-        // 48 01 F8 => add rax, rdi
-        // 4D 01 E3 => add r11,r12
-        uint64_t v1 = get_register64(emu, rm);
-        uint64_t v2 = get_register64(emu, reg);
-        set_register64(emu, rm, v1 + v2);
-
-        int is_carry = carry_flag_add(v1, v2);
-        update_rflags_sub(emu, v1, v2, v1 + v2, is_carry);
-    } else if (po == 0x29) {
-        // 48 29 F8 => sub rax, rdi
-        uint64_t v1 = get_register64(emu, rm);
-        uint64_t v2 = get_register64(emu, reg);
-        set_register64(emu, rm, v1 - v2);
-
-        int is_carry = carry_flag_sub(v1, v2);
-        update_rflags_sub(emu, v1, v2, v1 - v2, is_carry);
-    } else if (po == 0x39) {
-        // 48 39 F8 => cmp rax, rdi
-        uint64_t v1 = get_register64(emu, rm);
-        uint64_t v2 = get_register64(emu, reg);
-
-        int is_carry = carry_flag_sub(v1, v2);
-        update_rflags_sub(emu, v1, v2, v1 - v2, is_carry);
-    } else if (po == 0x81) {
-        // SUB: immediate -> register
-        // 1000 00sw : 11 101 reg : immediate data
-        // ex) 48 81 EC D0 00 00 00 => sub rsp,0xd0
-        uint64_t v2 = get_code32(emu, 0);
-        uint64_t v1 = get_register64(emu, rm);
-        set_register64(emu, rm, v1 - v2);
-        emu->rip += 4;
-
-        int is_carry = carry_flag_sub(v1, v2);
-        update_rflags_sub(emu, v1, v2, v1 - v2, is_carry);
-    // } else if (po == 0x83 && modrm.mod == 0 && modrm.opecode == 7) {
-    //     // ex) 48 83 3d 02 2f 00 00 => cmp QWORD PTR [rip+0x2f02],0x0
-    } else if (po == 0x83 && modrm.mod == 3 && modrm.opecode == 4) {
-        // 48 83 e4 f0 => and rsp,0xf0
-        uint8_t imm8 = get_code8(emu, 0);
-        emu->rip += 1;
-        uint64_t value = get_register64(emu, rm) & imm8;
-        set_register64(emu, rm, value);
-    } else if (po == 0x83 && modrm.mod == 3 && modrm.opecode == 5) {
-        // 1000 00sw : 11 101 reg : immediate data
-        // ex) 48 83 EC 00 => sub rsp,byte +0x0
-        int8_t imm8 = get_sign_code8(emu, 0);
-        emu->rip += 1;
-        int64_t val = get_register64(emu, rm);
-        set_register64(emu, rm, val-imm8);
-
-        int is_carry = carry_flag_sub(val, imm8);
-        update_rflags_sub(emu, val, imm8, val - imm8, is_carry);
-    } else if (po == 0x83 && modrm.mod == 3 && modrm.opecode == 7) {
-        // 1000 00sw : 11 111 reg : immediate data
-        // ex) 48 83 F8 00 => cmp rax,byte +0x0
-        int64_t imm8 = (int64_t) get_sign_code8(emu, 0);
-        emu->rip += 1;
-        int64_t val = (int64_t) get_register64(emu, rm);
-        uint64_t result = val - imm8;
-
-        int is_carry = carry_flag_sub(val, imm8);
-        update_rflags_sub(emu, val, imm8, result, is_carry);
-    } else if (po == 0x89 && modrm.mod == 0) {
-        // ex) 48 89 07 => mov [rdi],rax
-        uint64_t addr = get_register64(emu, rm);
-        uint64_t val = get_register64(emu, reg);
-        set_memory64(emu, addr, val);
-    } else if (po == 0x89 && modrm.mod == 1) {
-        // 48 89 7d f8 => mov QWORD PTR [rbp-0x8],rdi
-        // ModRM=0x7d => 0111 1101 => mod 01, reg 111, rm 101
-        uint64_t addr = get_register64(emu, rm) + modrm.disp8;
-        uint64_t value = get_register64(emu, reg);
-        set_memory64(emu, addr, value);
-    } else if (po == 0x89 && modrm.mod == 3) {
-        // 48 89 C8 => mov rax, rdi
-        uint64_t value = get_register64(emu, reg);
-        set_register64(emu, rm, value);
-    } else if (po == 0x8B) {
-        // 1000 101w : mod reg r/m
-        // ex) 48 8B 07 => mov rax,[rdi]
-        uint64_t addr = get_register64(emu, rm);
-        uint64_t val = get_memory64(emu, addr);
-        set_register64(emu, reg, val);
-    } else if (po == 0x8D && modrm.mod == 1) {
-        // ex) 48 8D 45 F8 => lea rax,[rbp-0x8]
-        uint64_t addr = get_register64(emu, rm) + modrm.disp8;
-        set_register64(emu, reg, addr);
-    } else if (po == 0x8D && modrm.mod == 0 && modrm.rm == 5) {
-        // ex) 48 8d 05 68000000 => lea rax,[rip-0x68]
-        uint64_t addr = emu->rip + (int32_t) modrm.disp32;
-        set_register64(emu, reg, addr);
-    } else if (po == 0x8D && (modrm.mod == 2)) {
-        // ex) 48 8D 85 30FFFFFF => lea rax,[rbp-0xd0]
-        uint64_t addr = get_register64(emu, rm) + (int32_t) modrm.disp32;
-        set_register64(emu, reg, addr);
-    } else if (po == 0x8D) {
-        printf("not implemented: rex_prefix=0x8D / mod=%d rm=%d\n", modrm.mod, modrm.rm);
-        exit(1);
-    } else if (po == 0xC7) {
-        // ex) 48 c7 c0 0a 00 00 00 => movq $0xa, %rax
-        uint64_t value = get_sign_code32(emu, 0);
-        set_register64(emu, rm, value);
-        emu->rip += 4;
-    } else if (po == 0xF7 && modrm.opecode == 7) {
-        // Signed Divide - 1111 011w : 11 111 reg
-        // 48 F7 FF => idiv rdi(7)
-        //   B=0
-        //   ModRM = FF
-        //     mod(11)=3
-        //     reg(111)=7
-        //     rm(111)=7
-        // 49 F7 FB => idiv r11(11)
-        //   B=1
-        //   ModRM = FB  1111 1011
-        //     mod(11)=3
-        //     reg(111)=7
-        //     rm(011)=3
-        // TODO: Must calculate "(RDX, RAX) / rm64"
-        // uint64_t v1h = get_register64(emu, RDX);
-        int64_t v1l = get_register64(emu, RAX);
-        int64_t v2 = get_register64(emu, rm);
-
-        uint64_t q = v1l / v2;
-        uint64_t rem = v1l % v2;
-        set_register64(emu, RAX, q);
-        set_register64(emu, RDX, rem);
-    } else if (po == 0xF7 && modrm.opecode == 3) {
-        // Two's Complement Negation - 1111 011w : 11 011 reg
-        // 49 F7 DA => code_f7 r10
-        int64_t value = get_register64(emu, rm);
-        set_register64(emu, rm, -value);
-    } else {
-        printf("not implemented: rex_prefix=%02x / w=1 rex_opcode=%02x\n",
-               0x40 + wrxb, po);
-        exit(1);
     }
+    return -1;
+}
+
+int fuse_instrs(Instr* instr, int n) {
+    Instr* next = &instr[1];
+    if (n >= 3 && instr->op == OP_PUSH_R && instr->reg == RBP
+        && is_register(&instr[1], OP_MOV_RM_R, RBP) && instr[1].modrm.reg_index == RSP
+        && is_register(&instr[2], OP_SUB_RM_IMM, RSP)) {
+        instr->thread = prologue_threaded;
+        return FUSE_PROLOGUE;
+    }
+    if (n < 2) {
+        return FUSE_NONE;
+    }
+    if (instr->op == OP_PUSH_R && next->op == OP_POP_R) {
+        instr->thread = push_pop_threaded;
+        return FUSE_PUSH_POP;
+    }
+    int cc = condition_of(next->exec, jcc);
+    if (cc >= 0 && (instr->op == OP_CMP_RM_R || instr->op == OP_CMP_R_RM || instr->op == OP_CMP_RM_IMM
+                    || instr->op == OP_TEST_RM_R || instr->op == OP_TEST_RM_IMM)) {
+        instr->thread = cmp_jcc[cc];
+        return FUSE_CMP_JCC;
+    }
+    cc = condition_of(instr->exec, setcc);
+    if (cc >= 0 && instr->modrm.mod == 3 && next->modrm.mod == 3 && next->modrm.rm == instr->modrm.rm
+        && (next->exec == movzx_r_rm8_handler.exec[2] || next->exec == movzx_r_rm8_handler.exec[3])) {
+        instr->thread = setcc_movzx[cc];
+        return FUSE_SETCC_MOVZX;
+    }
+    return FUSE_NONE;
 }
 
-static void push_r64(Emulator *emu) {
-    uint8_t reg = get_code8(emu, 0) - 0x50;
-    push64(emu, get_register64(emu, reg));
-    emu->rip += 1;
+int fusion_length(int fusion) {
+    return fusion == FUSE_NONE ? 1 : fusion == FUSE_PROLOGUE ? 3 : 2;
 }
 
-static void push_imm32(Emulator *emu) {
-    uint32_t value = get_code32(emu, 1);
-    push32(emu, value);
-    emu->rip += 5;
+uint64_t fusion_run_count(int fusion) {
+    return fusion_runs[fusion];
 }
 
-static void push_imm8(Emulator *emu) {
-    uint8_t value = get_code8(emu, 1);
-    push64(emu, value);
-    emu->rip += 2;
+// Without REX, byte registers 4-7 are AH, CH, DH and BH rather than SPL,
+// BPL, SIL and DIL.
+static uint8_t byte_register(uint8_t index, Prefixes* prefixes) {
+    if (prefixes->rex == 0 && index >= 4 && index < 8) {
+        return index - 4 + AH;
+    }
+    return index;
 }
 
-static void pop_r64(Emulator* emu) {
-    uint8_t reg = get_code8(emu, 0) - 0x58;
-    set_register64(emu, reg, pop64(emu));
-    emu->rip += 1;
+// Reads an immediate of size bytes at emu->rip, sign-extended to 64 bits.
+static uint64_t fetch_imm(Emulator* emu, int size) {
+    uint64_t imm;
+    switch (size) {
+        case 1: imm = get_sign_code8(emu, 0); break;
+        case 2: imm = (int16_t) get_code16(emu, 0); break;
+        case 4: imm = get_sign_code32(emu, 0); break;
+        default: imm = get_code64(emu, 0); break;
+    }
+    emu->rip += size;
+    return imm;
 }
 
-static void call_rel32(Emulator* emu) {
-    int32_t diff = get_sign_code32(emu, 1);
-    push32(emu, emu->rip + 5);
-    emu->rip += (diff + 5);  // jump
+// 0, 1, 2 and 3 for operand sizes of 1, 2, 4 and 8 bytes.
+static int size_index(int size) {
+    return size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
 }
 
-static void endbr64(Emulator* emu) {
-    // TODO(c-bata): Implement here. Currently just skips 4 bytes.
-    fprintf(stderr, "CPU Warning: endbr64 is skipped.\n");
-    emu->rip += 4;
+// Picks the variant of handler for instr->size.
+static void set_handler(Instr* instr, const Handler* handler) {
+    int index = size_index(instr->size);
+    instr->exec = handler->exec[index];
+    instr->thread = handler->thread[index];
+    instr->ends_block = handler->ends_block;
+    instr->op = handler->op;
 }
 
-static void code_f7(Emulator* emu) {
-    emu->rip += 1; // opcode
-    ModRM modrm;
-    parse_modrm(emu, &modrm);
-    switch (modrm.opecode) {
-        // Table A-6, Vol. 2D
-        case 3: {
-            int32_t rm32 = (int32_t) get_rm32(emu, &modrm);
-            set_rm32(emu, &modrm, (uint32_t) -rm32);
-            return;
+// Decodes the instruction at emu->rip and advances emu->rip past it.
+// Returns 0 if its primary opcode is unknown.
+static int decode(Emulator* emu, Instr* instr) {
+    Prefixes prefixes = {0};
+    uint8_t code;
+    for (;; emu->rip++) {
+        code = get_code8(emu, 0);
+        if (code == 0x66) {
+            prefixes.operand_size = 1;
+        } else if (code == 0x67) {
+            prefixes.address_size = 1;
+        } else if (code == 0xF2 || code == 0xF3) {
+            prefixes.rep = code;
+        } else if (code == 0x26 || code == 0x2E || code == 0x36 || code == 0x3E || code == 0x64 || code == 0x65) {
+            prefixes.segment = code;
+        } else if (code != 0xF0) {  // lock means nothing to a single thread
+            break;
+        }
+    }
+    // REX must be the last prefix.
+    if ((code & 0xF0) == 0x40) {
+        prefixes.rex = code;
+        emu->rip++;
+        code = get_code8(emu, 0);
+    }
+    emu->rip++;
+
+    OpcodeEntry* entry;
+    if (code == 0x0F) {
+        code = get_code8(emu, 0);
+        emu->rip++;
+        if (code == 0x38 || code == 0x3A) {
+            entry = code == 0x38 ? &three_byte_38[get_code8(emu, 0)] : &three_byte_3a[get_code8(emu, 0)];
+            emu->rip++;
+        } else {
+            entry = &two_byte[code];
+        }
+        if (entry->handler == NULL && entry->group == NULL) {
+            set_handler(instr, &not_implemented_handler);
+            return 1;
         }
-        case 0: // TEST
-        case 2: // NOT
-        case 4: // MUL AL/rAX
-        case 5: // IMUL AL/rAX
-        case 6: // DIV AL/rAX
-        case 7: // IDIV AL/rAX
+    } else {
+        entry = &primary[code];
+        if (entry->handler == NULL && entry->group == NULL) {
+            return 0;
+        }
+    }
+
+    int rex_w = prefixes.rex & 0x08;
+    int rex_r = (prefixes.rex & 0x04) << 1;
+    int rex_x = (prefixes.rex & 0x02) << 2;
+    int rex_b = (prefixes.rex & 0x01) << 3;
+    switch (entry->width) {
+        case W_BYTE:
+            instr->size = 1;
+            break;
+        case W_V:
+            instr->size = rex_w ? 8 : prefixes.operand_size ? 2 : 4;
+            break;
         default:
-            fprintf(stderr, "Not implemented 0xF7 modrm.opecode=%d\n", modrm.opecode);
-            exit(EXIT_FAILURE);
+            instr->size = 8;
+            break;
+    }
+    instr->rep = prefixes.rep;
+    const Handler* handler = entry->handler;
+    int unsupported = prefixes.address_size || (entry->width == W_D64 && prefixes.operand_size);
+
+    int encoding = entry->encoding;
+    ModRM* modrm = &instr->modrm;
+    switch (encoding) {
+        case ENC_MODRM:
+        case ENC_MODRM_1:
+        case ENC_MODRM_IB:
+        case ENC_MODRM_IZ:
+        case ENC_MODRM_GROUP3:
+            parse_modrm(emu, modrm);
+            if (entry->group != NULL) {
+                handler = entry->group[modrm->opecode];
+            }
+            if (encoding == ENC_MODRM_GROUP3) {
+                encoding = modrm->opecode > 1 ? ENC_MODRM : instr->size == 1 ? ENC_MODRM_IB : ENC_MODRM_IZ;
+            }
+            modrm->reg_index |= rex_r;
+            if (instr->size == 1) {
+                modrm->reg_index = byte_register(modrm->reg_index, &prefixes);
+            }
+            if (modrm->mod == 3) {
+                modrm->rm |= rex_b;
+                if (instr->size == 1 || (entry->flags & F_RM_BYTE)) {
+                    modrm->rm = byte_register(modrm->rm, &prefixes);
+                }
+                unsupported |= entry->flags & F_MEM_ONLY;
+            } else {
+                if (modrm->rm == 4) {
+                    modrm->index |= rex_x;
+                    modrm->base |= rex_b;
+                } else if (!(modrm->mod == 0 && modrm->rm == 5)) {
+                    modrm->rm |= rex_b;
+                }
+                // fs and gs have a base address; the others are flat.
+                unsupported |= prefixes.segment == 0x64 || prefixes.segment == 0x65;
+            }
+            break;
+        case ENC_ACC_IB:
+        case ENC_ACC_IZ:
+            modrm->mod = 3;
+            modrm->rm = RAX;
+            break;
+        case ENC_OPREG:
+        case ENC_OPREG_IV:
+            instr->reg = (code & 0x07) | rex_b;
+            if (instr->size == 1) {
+                instr->reg = byte_register(instr->reg, &prefixes);
+            }
+            break;
+    }
+
+    switch (encoding) {
+        case ENC_MODRM_1:
+            instr->imm = 1;
+            break;
+        case ENC_MODRM_IB:
+        case ENC_ACC_IB:
+        case ENC_IB:
+            instr->imm = fetch_imm(emu, 1);
+            break;
+        case ENC_MODRM_IZ:
+        case ENC_ACC_IZ:
+        case ENC_IZ:
+            instr->imm = fetch_imm(emu, instr->size == 2 ? 2 : 4);
+            break;
+        case ENC_IW:
+            instr->imm = (uint16_t) fetch_imm(emu, 2);
+            break;
+        case ENC_REL8:
+            instr->imm = fetch_imm(emu, 1);
+            instr->imm += emu->rip;
+            break;
+        case ENC_REL32:
+            instr->imm = fetch_imm(emu, 4);
+            instr->imm += emu->rip;
+            break;
+        case ENC_OPREG_IV:
+            instr->imm = fetch_imm(emu, instr->size);
+            break;
+    }
+
+    // Now that the end of the instruction is known, which [rip + disp32]
+    // is relative to.
+    if (encoding >= ENC_MODRM && encoding <= ENC_MODRM_IZ) {
+        init_address_form(modrm, emu->rip);
+    }
+
+    if (unsupported || handler == NULL || handler->exec[size_index(instr->size)] == NULL) {
+        handler = &not_implemented_handler;
     }
+    set_handler(instr, handler);
+    return 1;
 }
 
-static void nop(Emulator* emu) {
-    emu->rip += 1;
+int decode_instruction(Emulator* emu, uint64_t rip, Instr* instr) {
+    memset(instr, 0, sizeof(Instr));
+    // Decoding reads relative to emu->rip like the handlers used to.
+    uint64_t saved_rip = emu->rip;
+    emu->rip = rip;
+    int known = decode(emu, instr);
+    instr->len = emu->rip - rip;
+    emu->rip = saved_rip;
+    return known;
 }
 
-static void ret(Emulator* emu) {
-    emu->rip = pop32(emu);
+static void set_opcode(OpcodeEntry* table, int code, const Handler* handler, int encoding, int width, int flags) {
+    table[code].handler = handler;
+    table[code].group = NULL;
+    table[code].encoding = encoding;
+    table[code].width = width;
+    table[code].flags = flags;
 }
 
-static void leave(Emulator* emu) {
-    fprintf(stderr, "CPU Warning: leave may be wrong behavior.\n");
-    emu->rip += 1;
-    set_register64(emu, RSP, get_register64(emu, RBP));
-    set_register32(emu, RBP, pop32(emu));
+static void set_group(OpcodeEntry* table, int code, const Handler* const* group, int encoding, int width) {
+    set_opcode(table, code, NULL, encoding, width, 0);
+    table[code].group = group;
+}
+
+// The six forms of add, or, adc, sbb, and, sub, xor and cmp at base+0 to base+5.
+static void set_alu_opcodes(int base, const Handler* rm_r, const Handler* r_rm, const Handler* rm_imm) {
+    set_opcode(primary, base + 0, rm_r, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, base + 1, rm_r, ENC_MODRM, W_V, 0);
+    set_opcode(primary, base + 2, r_rm, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, base + 3, r_rm, ENC_MODRM, W_V, 0);
+    set_opcode(primary, base + 4, rm_imm, ENC_ACC_IB, W_BYTE, 0);
+    set_opcode(primary, base + 5, rm_imm, ENC_ACC_IZ, W_V, 0);
 }
 
 void init_instructions(void) {
     int i;
-    memset(instructions, 0, sizeof(instructions));
-
-    instructions[0x01] = add_rm32_r32;
-    instructions[0x03] = add_r32_rm32;
-    instructions[0x0F] = code_0f;
-    instructions[0x2B] = sub_r32_rm32;
-    instructions[0x31] = xor_rm32_r32;
-    instructions[0x3B] = cmp_r32_rm32;
-    instructions[0x3C] = cmp_al_imm8;
-
-    // REX prefixes are a set of 16 opcodes that span one row of the opcode map and occupy entries 40H to 4FH.
-    for (i=0; i<16; i++) {
-        instructions[0x40+i] = rex_prefix;
-    }
-
-    for (i=0; i<8; i++) {
-        instructions[0x50 + i] = push_r64;
-    }
-    for (i=0; i<8; i++) {
-        instructions[0x58 + i] = pop_r64;
-    }
-
-    instructions[0x68] = push_imm32;
-    instructions[0x6a] = push_imm8;
-
-    instructions[0x70] = jo;
-    instructions[0x71] = jno;
-    instructions[0x72] = jc;
-    instructions[0x73] = jnc;
-    instructions[0x74] = jz;
-    instructions[0x75] = jnz;
-    instructions[0x78] = js;
-    instructions[0x79] = jns;
-    instructions[0x7C] = jl;
-    instructions[0x7E] = jle;
-
-    instructions[0x83] = code_83;
-    instructions[0x88] = mov_rm8_r8;
-    instructions[0x89] = mov_rm32_r32;
-    instructions[0x8a] = mov_r8_rm8;
-    instructions[0x8B] = mov_r32_rm32;
-    instructions[0x90] = nop;
-
-    for (i=0; i<8; i++) {
-        instructions[0xB0+i] = mov_r8_imm8;
-    }
-
-    for (i=0; i<8; i++) {
-        instructions[0xB8 + i] = mov_r32_imm32;
-    }
-    instructions[0xC3] = ret;
-    instructions[0xC7] = mov_rm32_imm32;
-    instructions[0xC9] = leave;
-    instructions[0xE8] = call_rel32;
-    instructions[0xE9] = near_jump;
-    instructions[0xEB] = short_jump;
-    instructions[0xF3] = endbr64;
-    instructions[0xF7] = code_f7;
-    instructions[0xFE] = code_fe;
-    instructions[0xFF] = code_ff;
+    memset(primary, 0, sizeof(primary));
+    memset(two_byte, 0, sizeof(two_byte));
+    memset(three_byte_38, 0, sizeof(three_byte_38));
+    memset(three_byte_3a, 0, sizeof(three_byte_3a));
+
+    set_alu_opcodes(0x00, &add_rm_r_handler, &add_r_rm_handler, &add_rm_imm_handler);
+    set_alu_opcodes(0x08, &or_rm_r_handler, &or_r_rm_handler, &or_rm_imm_handler);
+    set_alu_opcodes(0x10, &adc_rm_r_handler, &adc_r_rm_handler, &adc_rm_imm_handler);
+    set_alu_opcodes(0x18, &sbb_rm_r_handler, &sbb_r_rm_handler, &sbb_rm_imm_handler);
+    set_alu_opcodes(0x20, &and_rm_r_handler, &and_r_rm_handler, &and_rm_imm_handler);
+    set_alu_opcodes(0x28, &sub_rm_r_handler, &sub_r_rm_handler, &sub_rm_imm_handler);
+    set_alu_opcodes(0x30, &xor_rm_r_handler, &xor_r_rm_handler, &xor_rm_imm_handler);
+    set_alu_opcodes(0x38, &cmp_rm_r_handler, &cmp_r_rm_handler, &cmp_rm_imm_handler);
+
+    for (i = 0; i < 8; i++) {
+        set_opcode(primary, 0x50 + i, &push_r_handler, ENC_OPREG, W_D64, 0);
+        set_opcode(primary, 0x58 + i, &pop_r_handler, ENC_OPREG, W_D64, 0);
+    }
+    set_opcode(primary, 0x63, &movsxd_r_rm32_handler, ENC_MODRM, W_V, 0);
+    set_opcode(primary, 0x68, &push_imm_handler, ENC_IZ, W_D64, 0);
+    set_opcode(primary, 0x69, &imul_r_rm_imm_handler, ENC_MODRM_IZ, W_V, 0);
+    set_opcode(primary, 0x6A, &push_imm_handler, ENC_IB, W_D64, 0);
+    set_opcode(primary, 0x6B, &imul_r_rm_imm_handler, ENC_MODRM_IB, W_V, 0);
+    for (i = 0; i < 16; i++) {
+        set_opcode(primary, 0x70 + i, jcc[i], ENC_REL8, W_D64, 0);
+    }
+    set_group(primary, 0x80, group1, ENC_MODRM_IB, W_BYTE);
+    set_group(primary, 0x81, group1, ENC_MODRM_IZ, W_V);
+    set_group(primary, 0x83, group1, ENC_MODRM_IB, W_V);
+    set_opcode(primary, 0x84, &test_rm_r_handler, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, 0x85, &test_rm_r_handler, ENC_MODRM, W_V, 0);
+    set_opcode(primary, 0x86, &xchg_rm_r_handler, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, 0x87, &xchg_rm_r_handler, ENC_MODRM, W_V, 0);
+    set_opcode(primary, 0x88, &mov_rm_r_handler, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, 0x89, &mov_rm_r_handler, ENC_MODRM, W_V, 0);
+    set_opcode(primary, 0x8A, &mov_r_rm_handler, ENC_MODRM, W_BYTE, 0);
+    set_opcode(primary, 0x8B, &mov_r_rm_handler, ENC_MODRM, W_V, 0);
+    set_opcode(primary, 0x8D, &lea_r_m_handler, ENC_MODRM, W_V, F_MEM_ONLY);
+    set_group(primary, 0x8F, group1a, ENC_MODRM, W_D64);
+    for (i = 0; i < 8; i++) {
+        set_opcode(primary, 0x90 + i, &xchg_r_rax_handler, ENC_OPREG, W_V, 0);
+    }
+    set_opcode(primary, 0x98, &cdqe_handler, ENC_NONE, W_V, 0);
+    set_opcode(primary, 0x99, &cqo_handler, ENC_NONE, W_V, 0);
+    set_opcode(primary, 0x9C, &pushf_handler, ENC_NONE, W_D64, 0);
+    set_opcode(primary, 0x9D, &popf_handler, ENC_NONE, W_D64, 0);
+    set_opcode(primary, 0xA4, &movs_handler, ENC_NONE, W_BYTE, 0);
+    set_opcode(primary, 0xA5, &movs_handler, ENC_NONE, W_V, 0);
+    set_opcode(primary, 0xA6, &cmps_handler, ENC_NONE, W_BYTE, 0);
+    set_opcode(primary, 0xA7, &cmps_handler, ENC_NONE, W_V, 0);
+    set_opcode(primary, 0xA8, &test_rm_imm_handler, ENC_ACC_IB, W_BYTE, 0);
+    set_opcode(primary, 0xAA, &stos_handler, ENC_NONE, W_BYTE, 0);
+    set_opcode(primary, 0xAB, &stos_handler, ENC_NONE, W_V, 0);
+    set_opcode(primary, 0xA9, &test_rm_imm_handler, ENC_ACC_IZ, W_V, 0);
+    for (i = 0; i < 8; i++) {
+        set_opcode(primary, 0xB0 + i, &mov_r_imm_handler, ENC_OPREG_IV, W_BYTE, 0);
+        set_opcode(primary, 0xB8 + i, &mov_r_imm_handler, ENC_OPREG_IV, W_V, 0);
+    }
+    set_group(primary, 0xC0, group2, ENC_MODRM_IB, W_BYTE);
+    set_group(primary, 0xC1, group2, ENC_MODRM_IB, W_V);
+    set_opcode(primary, 0xC2, &ret_imm_handler, ENC_IW, W_D64, 0);
+    set_opcode(primary, 0xC3, &ret_handler, ENC_NONE, W_D64, 0);
+    set_group(primary, 0xC6, group11, ENC_MODRM_IB, W_BYTE);
+    set_group(primary, 0xC7, group11, ENC_MODRM_IZ, W_V);
+    set_opcode(primary, 0xC9, &leave_handler, ENC_NONE, W_D64, 0);
+    set_group(primary, 0xD0, group2, ENC_MODRM_1, W_BYTE);
+    set_group(primary, 0xD1, group2, ENC_MODRM_1, W_V);
+    set_group(primary, 0xD2, group2_cl, ENC_MODRM, W_BYTE);
+    set_group(primary, 0xD3, group2_cl, ENC_MODRM, W_V);
+    set_opcode(primary, 0xE8, &call_rel_handler, ENC_REL32, W_D64, 0);
+    set_opcode(primary, 0xE9, &jump_handler, ENC_REL32, W_D64, 0);
+    set_opcode(primary, 0xEB, &jump_handler, ENC_REL8, W_D64, 0);
+    set_opcode(primary, 0xF5, &cmc_handler, ENC_NONE, W_NONE, 0);
+    set_group(primary, 0xF6, group3, ENC_MODRM_GROUP3, W_BYTE);
+    set_group(primary, 0xF7, group3, ENC_MODRM_GROUP3, W_V);
+    set_opcode(primary, 0xF8, &clc_handler, ENC_NONE, W_NONE, 0);
+    set_opcode(primary, 0xF9, &stc_handler, ENC_NONE, W_NONE, 0);
+    set_opcode(primary, 0xFC, &cld_handler, ENC_NONE, W_NONE, 0);
+    set_opcode(primary, 0xFD, &std_handler, ENC_NONE, W_NONE, 0);
+    set_group(primary, 0xFE, group4, ENC_MODRM, W_BYTE);
+    set_group(primary, 0xFF, group5, ENC_MODRM, W_V);
+
+    // 0F 1E FA, with F3 => endbr64, which is a hint nop.
+    set_opcode(two_byte, 0x1E, &nop_handler, ENC_MODRM, W_V, 0);
+    set_opcode(two_byte, 0x1F, &nop_handler, ENC_MODRM, W_V, 0);
+    for (i = 0; i < 16; i++) {
+        set_opcode(two_byte, 0x40 + i, cmovcc[i], ENC_MODRM, W_V, 0);
+        set_opcode(two_byte, 0x80 + i, jcc[i], ENC_REL32, W_D64, 0);
+        set_opcode(two_byte, 0x90 + i, setcc[i], ENC_MODRM, W_BYTE, 0);
+    }
+    set_opcode(two_byte, 0xAF, &imul_r_rm_handler, ENC_MODRM, W_V, 0);
+    set_opcode(two_byte, 0xB6, &movzx_r_rm8_handler, ENC_MODRM, W_V, F_RM_BYTE);
+    set_opcode(two_byte, 0xB7, &movzx_r_rm16_handler, ENC_MODRM, W_V, 0);
+    set_opcode(two_byte, 0xBE, &movsx_r_rm8_handler, ENC_MODRM, W_V, F_RM_BYTE);
+    set_opcode(two_byte, 0xBF, &movsx_r_rm16_handler, ENC_MODRM, W_V, 0);
 }
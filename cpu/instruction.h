@@ -2,10 +2,104 @@
 #define INSTRUCTION_H_
 
 #include "emulator.h"
+#include "modrm.h"
+
+typedef struct Instr_t Instr;
+
+// Instructions that the JIT (see jit.h) translates itself, or that the code
+// cache tells apart (OP_CALL_RM, OP_INC, OP_DEC and OP_MOVZX_R_RM8).
+// Everything else is OP_OTHER and runs through its handler.
+enum Op {
+    OP_OTHER,
+    OP_MOV_RM_R, OP_MOV_R_RM, OP_MOV_RM_IMM, OP_MOV_R_IMM,
+    OP_MOVSXD, OP_LEA,
+    OP_PUSH_R, OP_POP_R, OP_PUSH_IMM,
+    OP_ADD_RM_R, OP_ADD_R_RM, OP_ADD_RM_IMM,
+    OP_OR_RM_R, OP_OR_R_RM, OP_OR_RM_IMM,
+    OP_ADC_RM_R, OP_ADC_R_RM, OP_ADC_RM_IMM,
+    OP_SBB_RM_R, OP_SBB_R_RM, OP_SBB_RM_IMM,
+    OP_AND_RM_R, OP_AND_R_RM, OP_AND_RM_IMM,
+    OP_SUB_RM_R, OP_SUB_R_RM, OP_SUB_RM_IMM,
+    OP_XOR_RM_R, OP_XOR_R_RM, OP_XOR_RM_IMM,
+    OP_CMP_RM_R, OP_CMP_R_RM, OP_CMP_RM_IMM,
+    OP_TEST_RM_R, OP_TEST_RM_IMM,
+    OP_JMP, OP_CALL, OP_CALL_RM, OP_RET,
+    // Conditional jumps in the order of their condition codes.
+    OP_JO, OP_JNO, OP_JB, OP_JAE, OP_JE, OP_JNE, OP_JBE, OP_JA,
+    OP_JS, OP_JNS, OP_JP, OP_JNP, OP_JL, OP_JGE, OP_JLE, OP_JG,
+    OP_INC, OP_DEC, OP_MOVZX_R_RM8,
+};
+
+// Executes a decoded instruction. emu->rip already points to the next one.
+typedef void instruction_func_t(Emulator* emu, Instr* instr);
+
+// A guest instruction decoded once, so that executing it again does not
+// touch the code bytes.
+struct Instr_t {
+    instruction_func_t* exec;
+    // Same as exec, then continues with the next Instr in the array.
+    instruction_func_t* thread;
+    ModRM modrm;    // reg_index, rm, index and base already include REX
+    uint8_t reg;    // register encoded in the opcode byte
+    uint8_t size;   // operand size in bytes: 1, 2, 4 or 8
+    uint8_t rep;    // 0xF2 or 0xF3 if prefixed, otherwise 0
+    uint8_t len;
+    uint8_t ends_block;  // may change rip to anything but the next instruction
+    uint8_t op;     // enum Op
+    uint8_t trace_dir;  // enum TraceDirection
+    uint8_t flags_dead;  // the flags it sets are set again before any use
+    uint64_t imm;   // immediate, or the target address of a branch
+};
+
+// The way a trace (see code_cache.h) goes on past one of its jumps. A jump
+// to anywhere else leaves the trace.
+enum TraceDirection {
+    TRACE_NONE,        // not a jump inside a trace
+    TRACE_TAKEN,       // at the target
+    TRACE_FALLTHROUGH  // at the next instruction
+};
 
 void init_instructions(void);
-typedef void instruction_func_t(Emulator*);
+// Decodes the instruction at rip. Returns 0 if the opcode is unknown.
+// Known opcodes with unsupported operands decode to a handler that reports
+// them when executed.
+int decode_instruction(Emulator* emu, uint64_t rip, Instr* instr);
+// Makes instr the sentinel that stops a threaded block (see Instr.thread).
+void init_block_end(Instr* instr);
+// Makes the jump instr continue with the next Instr of a trace when it goes
+// in direction dir.
+void init_trace_jump(Instr* instr, int dir);
+
+// What instr does to the arithmetic flags, as far as the code cache can
+// tell: READS_FLAGS unless it is known not to look at them, and
+// WRITES_FLAGS if it sets all of them.
+#define READS_FLAGS 0x1
+#define WRITES_FLAGS 0x2
+int flags_access(const Instr* instr);
+// Switches the flag-setting instr to a handler that leaves the flags
+// alone, because nothing reads them before they are set again. Returns 0
+// if it has no such handler.
+int drop_flags(Instr* instr);
+
+// Sequences of instructions that 9cc emits a lot and that run as one
+// superinstruction in a threaded block.
+enum Fusion {
+    FUSE_NONE,
+    FUSE_PUSH_POP,     // push r1; pop r2
+    FUSE_CMP_JCC,      // cmp or test, then jcc
+    FUSE_PROLOGUE,     // push rbp; mov rbp, rsp; sub rsp, imm
+    FUSE_SETCC_MOVZX,  // setcc r8; movzx r, r8
+    NUM_FUSIONS
+};
 
-extern instruction_func_t* instructions[256];
+// Makes the threaded variant of instr run the instructions after it too if
+// they start with one of the sequences of enum Fusion, and returns which.
+// n counts the instructions of the block from instr on.
+int fuse_instrs(Instr* instr, int n);
+// The number of instructions in a sequence of enum Fusion.
+int fusion_length(int fusion);
+// How many times superinstructions of the fusion have run, each saving
+// fusion_length() - 1 dispatches. Translated blocks do not run them.
+uint64_t fusion_run_count(int fusion);
 
-#endif
\ No newline at end of file
+#endif
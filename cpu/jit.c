@@ -0,0 +1,830 @@
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "emulator_function.h"
+#include "instruction.h"
+#include "virtual_memory.h"
+
+// Translated blocks are never freed. Once the buffer is full, the blocks
+// built afterwards stay interpreted.
+#define JIT_BUFFER_SIZE (64 << 20)
+// Upper bound of the host code for one guest instruction, with room for
+// the prologue and the exit of the block.
+#define JIT_MAX_INSTR_BYTES 256
+
+// Host registers. rbx holds the Emulator* for the whole block; the others
+// are scratch and do not survive calls.
+enum HostRegister {
+    HOST_RAX, HOST_RCX, HOST_RDX, HOST_RBX, HOST_RSP, HOST_RBP, HOST_RSI, HOST_RDI};
+
+#define REG_OFFSET(index) ((int) (offsetof(Emulator, registers) + (index) * sizeof(uint64_t)))
+#define RIP_OFFSET ((int) offsetof(Emulator, rip))
+#define MEMORY_OFFSET ((int) offsetof(Emulator, memory))
+#define LINK_OFFSET(field) ((int) offsetof(BlockLink, field))
+#define RAS_OFFSET ((int) offsetof(Emulator, ras))
+#define RAS_TOP_OFFSET ((int) offsetof(Emulator, ras_top))
+#define RAS_COUNT_OFFSET ((int) offsetof(Emulator, ras_count))
+
+// Linked blocks enter past the prologue, which pushes rbx only once per
+// call from run().
+#define ENTRY_OFFSET 4
+
+// ADD, OR, ADC, SBB, AND, SUB, XOR and CMP are ModR/M.reg 0-7 of group 1,
+// and (index * 8 + 1) is their "op Ev, Gv" opcode.
+#define ALU_ADC 2
+#define ALU_SBB 3
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_CMP 7
+
+// The forms in enum Op order.
+#define FORM_RM_R 0
+#define FORM_R_RM 1
+#define FORM_RM_IMM 2
+
+// The buffer and stats belong to the compiler thread.
+static uint8_t* buffer;
+static size_t buffer_used;
+static JitStats stats;
+
+// Blocks waiting for the compiler thread, as a ring. lock guards the queue,
+// current and stopping.
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compiled = PTHREAD_COND_INITIALIZER;
+static Block** queue;
+static int queue_size;
+static int queue_head;
+static int queue_count;
+static Block* current;  // being translated
+static int stopping;
+
+typedef struct {
+    uint8_t* p;
+    // The host status flags equal the guest ones: the last guest instruction
+    // that wrote them was translated, and nothing changed them since.
+    int host_flags;
+} Code;
+
+static void emit8(Code* code, uint8_t value) {
+    *code->p++ = value;
+}
+
+static void emit32(Code* code, uint32_t value) {
+    memcpy(code->p, &value, sizeof(value));
+    code->p += sizeof(value);
+}
+
+static void emit64(Code* code, uint64_t value) {
+    memcpy(code->p, &value, sizeof(value));
+    code->p += sizeof(value);
+}
+
+// Omitted when it would be a plain 0x40.
+static void emit_rex(Code* code, int w, int reg, int rm) {
+    uint8_t rex = 0x40 | (w ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) {
+        emit8(code, rex);
+    }
+}
+
+// ModR/M and displacement of [rbx + disp].
+static void emit_rbx_operand(Code* code, int reg, int disp) {
+    if (disp >= -128 && disp < 128) {
+        emit8(code, 0x40 | ((reg & 7) << 3) | HOST_RBX);
+        emit8(code, disp);
+    } else {
+        emit8(code, 0x80 | ((reg & 7) << 3) | HOST_RBX);
+        emit32(code, disp);
+    }
+}
+
+// mov reg, [rbx + disp]. A 4-byte load zero-extends like a 32-bit write.
+static void emit_load(Code* code, int size, int reg, int disp) {
+    emit_rex(code, size == 8, reg, 0);
+    emit8(code, 0x8B);
+    emit_rbx_operand(code, reg, disp);
+}
+
+// mov [rbx + disp], reg
+static void emit_store(Code* code, int size, int reg, int disp) {
+    emit_rex(code, size == 8, reg, 0);
+    emit8(code, 0x89);
+    emit_rbx_operand(code, reg, disp);
+}
+
+// mov [rbx + disp], imm32, sign-extended if size is 8.
+static void emit_store_imm(Code* code, int size, int disp, int32_t imm) {
+    emit_rex(code, size == 8, 0, 0);
+    emit8(code, 0xC7);
+    emit_rbx_operand(code, 0, disp);
+    emit32(code, imm);
+}
+
+// op dst, src for a "op Ev, Gv" opcode such as 01 (add) or 89 (mov).
+static void emit_op_reg(Code* code, int opcode, int size, int dst, int src) {
+    emit_rex(code, size == 8, src, dst);
+    emit8(code, opcode);
+    emit8(code, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// mov reg, imm with the shortest encoding. Size 4 takes the low half of imm
+// and clears the upper one.
+static void emit_mov_imm(Code* code, int size, int reg, uint64_t imm) {
+    if (size == 4 || imm <= UINT32_MAX) {
+        emit_rex(code, 0, 0, reg);
+        emit8(code, 0xB8 | (reg & 7));
+        emit32(code, imm);
+    } else if ((int64_t) imm == (int32_t) imm) {
+        emit_rex(code, 1, 0, reg);
+        emit8(code, 0xC7);
+        emit8(code, 0xC0 | (reg & 7));
+        emit32(code, imm);
+    } else {
+        emit_rex(code, 1, 0, reg);
+        emit8(code, 0xB8 | (reg & 7));
+        emit64(code, imm);
+    }
+}
+
+static void emit_call(Code* code, uintptr_t function) {
+    emit_mov_imm(code, 8, HOST_RAX, function);
+    emit8(code, 0xFF);  // call rax
+    emit8(code, 0xD0);
+    code->host_flags = 0;
+}
+
+static void emit_set_rip(Code* code, uint64_t rip) {
+    if (rip <= INT32_MAX) {
+        emit_store_imm(code, 8, RIP_OFFSET, rip);
+    } else {
+        emit_mov_imm(code, 8, HOST_RAX, rip);
+        emit_store(code, 8, HOST_RAX, RIP_OFFSET);
+    }
+}
+
+// Returns block to run(). emu->rip must hold the next block by now.
+static void emit_exit(Code* code, Block* block) {
+    emit_mov_imm(code, 8, HOST_RAX, (uintptr_t) block);
+    emit8(code, 0x5B);  // pop rbx
+    emit8(code, 0xC3);  // ret
+}
+
+// A jcc (or jmp if cc is -1) with a rel32 to fill in by patch_rel32().
+static uint8_t* emit_branch(Code* code, int cc) {
+    if (cc < 0) {
+        emit8(code, 0xE9);
+    } else {
+        emit8(code, 0x0F);
+        emit8(code, 0x80 | cc);
+    }
+    emit32(code, 0);
+    return code->p - 4;
+}
+
+static void patch_rel32(uint8_t* rel, uint8_t* target) {
+    int32_t value = target - (rel + 4);
+    memcpy(rel, &value, sizeof(value));
+}
+
+// eax = vm_code_epoch(), and rcx = link. A link made under another epoch
+// may lead to a block that is gone.
+static void emit_link_epoch(Code* code, BlockLink* link) {
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, (uintptr_t) vm_code_epoch);
+    emit_mov_imm(code, 8, HOST_RCX, (uintptr_t) link);
+    emit8(code, 0x3B);  // cmp eax, [rcx + epoch]
+    emit8(code, 0x41);
+    emit8(code, LINK_OFFSET(epoch));
+}
+
+static BlockLink* find_link(Block* block, uint64_t rip) {
+    for (int i = 0; i < BLOCK_LINKS; i++) {
+        if (block->links[i].rip == rip) {
+            return &block->links[i];
+        }
+    }
+    return NULL;
+}
+
+// Leaves the block for rip, a direct target. The jmp goes on to the exit
+// until jit_link() points it at the translated successor.
+static void emit_exit_to(Code* code, Block* block, uint64_t rip) {
+    emit_set_rip(code, rip);
+    BlockLink* link = find_link(block, rip);
+    if (link != NULL) {
+        emit_link_epoch(code, link);
+        emit8(code, 0x75);  // jne over the jmp
+        emit8(code, 5);
+        link->jump = emit_branch(code, -1);
+    }
+    emit_exit(code, block);
+}
+
+// Calls the handler with emu->rip at the next instruction, as run_block()
+// would.
+static void emit_handler_call(Code* code, Instr* instr, uint64_t next_rip) {
+    emit_set_rip(code, next_rip);
+    emit_op_reg(code, 0x89, 8, HOST_RDI, HOST_RBX);
+    emit_mov_imm(code, 8, HOST_RSI, (uintptr_t) instr);
+    emit_call(code, (uintptr_t) instr->exec);
+}
+
+// Leaves a trace where one of its inner jumps goes the other way, and counts
+// that in the link.
+static void emit_side_exit(Code* code, Block* block, uint64_t rip) {
+    emit_mov_imm(code, 8, HOST_RAX, (uintptr_t) &find_link(block, rip)->count);
+    emit8(code, 0x48);  // inc qword [rax]
+    emit8(code, 0xFF);
+    emit8(code, 0x00);
+    emit_exit_to(code, block, rip);
+}
+
+// A jump inside a trace (see init_trace_jump()). Returns the address the
+// trace goes on at.
+static uint64_t emit_trace_jump(Code* code, Block* block, Instr* instr, uint64_t next_rip) {
+    uint64_t on_trace = instr->trace_dir == TRACE_TAKEN ? instr->imm : next_rip;
+    uint64_t off_trace = instr->trace_dir == TRACE_TAKEN ? next_rip : instr->imm;
+    if (instr->op == OP_JMP) {
+        stats.native_instrs++;
+        return on_trace;
+    }
+    uint8_t* stay;
+    if (code->host_flags) {
+        int cc = instr->op - OP_JO;
+        stay = emit_branch(code, instr->trace_dir == TRACE_TAKEN ? cc : cc ^ 1);
+        stats.native_instrs++;
+    } else {
+        emit_handler_call(code, instr, next_rip);
+        emit_mov_imm(code, 8, HOST_RAX, on_trace);
+        emit_rex(code, 1, HOST_RAX, 0);  // cmp [rbx + rip], rax
+        emit8(code, 0x39);
+        emit_rbx_operand(code, HOST_RAX, RIP_OFFSET);
+        stay = emit_branch(code, 0x4);  // je
+        stats.fallback_instrs++;
+    }
+    // Only the side exit calls anything, so the flags survive on the trace.
+    int host_flags = code->host_flags;
+    emit_side_exit(code, block, off_trace);
+    code->host_flags = host_flags;
+    patch_rel32(stay, code->p);
+    return on_trace;
+}
+
+// Leaves the block for emu->rip, which is only known at run time, through
+// whichever link has that rip.
+static void emit_exit_lookup(Code* code, Block* block) {
+    uint8_t* exits[BLOCK_LINKS * 2];
+    int n = 0;
+    emit_link_epoch(code, &block->links[0]);
+    emit_load(code, 8, HOST_RDX, RIP_OFFSET);
+    for (int i = 0; i < BLOCK_LINKS; i++) {
+        BlockLink* link = &block->links[i];
+        emit_mov_imm(code, 8, HOST_RCX, (uintptr_t) link);
+        emit8(code, 0x48);  // cmp rdx, [rcx + rip]
+        emit8(code, 0x3B);
+        emit8(code, 0x51);
+        emit8(code, LINK_OFFSET(rip));
+        uint8_t* next = emit_branch(code, 0x5);  // jne
+        emit8(code, 0x3B);  // cmp eax, [rcx + epoch]
+        emit8(code, 0x41);
+        emit8(code, LINK_OFFSET(epoch));
+        exits[n++] = emit_branch(code, 0x5);  // jne
+        emit8(code, 0x48);  // mov rsi, [rcx + native]
+        emit8(code, 0x8B);
+        emit8(code, 0x71);
+        emit8(code, LINK_OFFSET(native));
+        emit8(code, 0x48);  // test rsi, rsi
+        emit8(code, 0x85);
+        emit8(code, 0xF6);
+        exits[n++] = emit_branch(code, 0x4);  // je
+        emit8(code, 0xFF);  // jmp rsi
+        emit8(code, 0xE6);
+        patch_rel32(next, code->p);
+    }
+    for (int i = 0; i < n; i++) {
+        patch_rel32(exits[i], code->p);
+    }
+    emit_exit(code, block);
+}
+
+// Pushes the return address of the call that ends block and its return
+// link on the return-address stack, like ras_push() of code_cache.c.
+static void emit_ras_push(Code* code, Block* block) {
+    emit_load(code, 4, HOST_RAX, RAS_TOP_OFFSET);
+    emit8(code, 0x83);  // add eax, 1
+    emit8(code, 0xC0);
+    emit8(code, 1);
+    emit8(code, 0x83);  // and eax, RAS_SIZE - 1
+    emit8(code, 0xE0);
+    emit8(code, RAS_SIZE - 1);
+    emit_store(code, 4, HOST_RAX, RAS_TOP_OFFSET);
+    emit8(code, 0xC1);  // shl eax, 4
+    emit8(code, 0xE0);
+    emit8(code, 4);
+    emit_mov_imm(code, 8, HOST_RCX, block->return_link.rip);
+    emit8(code, 0x48);  // mov [rbx + rax + ras], rcx
+    emit8(code, 0x89);
+    emit8(code, 0x8C);
+    emit8(code, 0x03);
+    emit32(code, RAS_OFFSET + offsetof(ReturnAddress, rip));
+    emit_mov_imm(code, 8, HOST_RCX, (uintptr_t) &block->return_link);
+    emit8(code, 0x48);  // mov [rbx + rax + ras + 8], rcx
+    emit8(code, 0x89);
+    emit8(code, 0x8C);
+    emit8(code, 0x03);
+    emit32(code, RAS_OFFSET + offsetof(ReturnAddress, link));
+    emit8(code, 0x83);  // cmp dword [rbx + ras_count], RAS_SIZE
+    emit_rbx_operand(code, 7, RAS_COUNT_OFFSET);
+    emit8(code, RAS_SIZE);
+    emit8(code, 0x73);  // jae over the inc
+    uint8_t* skip = code->p;
+    emit8(code, 0);
+    emit8(code, 0xFF);  // inc dword [rbx + ras_count]
+    emit_rbx_operand(code, 0, RAS_COUNT_OFFSET);
+    *skip = code->p - (skip + 1);
+}
+
+// Leaves a block that ends in ret for the block that the top of the
+// return-address stack predicts, and pops it. Any other case goes back to
+// run(), which pops the entry itself.
+static void emit_exit_return(Code* code, Block* block) {
+    uint8_t* exits[5];
+    int n = 0;
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, (uintptr_t) vm_code_epoch);
+    emit_load(code, 8, HOST_RDX, RIP_OFFSET);
+    emit8(code, 0x83);  // cmp dword [rbx + ras_count], 0
+    emit_rbx_operand(code, 7, RAS_COUNT_OFFSET);
+    emit8(code, 0);
+    exits[n++] = emit_branch(code, 0x4);  // je
+    emit_load(code, 4, HOST_RCX, RAS_TOP_OFFSET);
+    emit8(code, 0xC1);  // shl ecx, 4
+    emit8(code, 0xE1);
+    emit8(code, 4);
+    emit8(code, 0x48);  // cmp rdx, [rbx + rcx + ras]
+    emit8(code, 0x3B);
+    emit8(code, 0x94);
+    emit8(code, 0x0B);
+    emit32(code, RAS_OFFSET + offsetof(ReturnAddress, rip));
+    exits[n++] = emit_branch(code, 0x5);  // jne
+    emit8(code, 0x48);  // mov rcx, [rbx + rcx + ras + 8]
+    emit8(code, 0x8B);
+    emit8(code, 0x8C);
+    emit8(code, 0x0B);
+    emit32(code, RAS_OFFSET + offsetof(ReturnAddress, link));
+    emit8(code, 0x3B);  // cmp eax, [rcx + epoch]
+    emit8(code, 0x41);
+    emit8(code, LINK_OFFSET(epoch));
+    exits[n++] = emit_branch(code, 0x5);  // jne
+    emit8(code, 0x48);  // mov rsi, [rcx + native]
+    emit8(code, 0x8B);
+    emit8(code, 0x71);
+    emit8(code, LINK_OFFSET(native));
+    emit8(code, 0x48);  // test rsi, rsi
+    emit8(code, 0x85);
+    emit8(code, 0xF6);
+    exits[n++] = emit_branch(code, 0x4);  // je
+    emit8(code, 0xFF);  // dec dword [rbx + ras_count]
+    emit_rbx_operand(code, 1, RAS_COUNT_OFFSET);
+    emit_load(code, 4, HOST_RCX, RAS_TOP_OFFSET);
+    emit8(code, 0x83);  // sub ecx, 1
+    emit8(code, 0xE9);
+    emit8(code, 1);
+    emit8(code, 0x83);  // and ecx, RAS_SIZE - 1
+    emit8(code, 0xE1);
+    emit8(code, RAS_SIZE - 1);
+    emit_store(code, 4, HOST_RCX, RAS_TOP_OFFSET);
+    emit8(code, 0xFF);  // jmp rsi
+    emit8(code, 0xE6);
+    for (int i = 0; i < n; i++) {
+        patch_rel32(exits[i], code->p);
+    }
+    emit_exit(code, block);
+}
+
+// lea rsi, [rsi + disp] or [rsi + rdi * scale + disp], whose ModR/M is
+// modrm without the displacement bits, and whose SIB is sib if not 0.
+static void emit_lea_disp(Code* code, int modrm, int sib, int64_t disp) {
+    emit8(code, 0x48);
+    emit8(code, 0x8D);
+    if (disp >= -128 && disp < 128) {
+        emit8(code, 0x40 | modrm);
+        if (sib) {
+            emit8(code, sib);
+        }
+        emit8(code, disp);
+    } else {
+        emit8(code, 0x80 | modrm);
+        if (sib) {
+            emit8(code, sib);
+        }
+        emit32(code, disp);
+    }
+}
+
+// Computes the address of a memory operand into rsi the way
+// calc_memory_address() does, with rdi as scratch.
+static void emit_address(Code* code, ModRM* modrm) {
+    switch (modrm->form) {
+        case EA_ABS:
+            emit_mov_imm(code, 8, HOST_RSI, modrm->disp);
+            break;
+        case EA_BASE:
+            emit_load(code, 8, HOST_RSI, REG_OFFSET(modrm->base));
+            break;
+        case EA_BASE_DISP:
+            emit_load(code, 8, HOST_RSI, REG_OFFSET(modrm->base));
+            emit_lea_disp(code, 0x36, 0, modrm->disp);  // lea rsi, [rsi + disp]
+            break;
+        case EA_INDEX:
+            emit_load(code, 8, HOST_RSI, REG_OFFSET(modrm->index));
+            emit8(code, 0x48);  // lea rsi, [rsi * scale + disp32]
+            emit8(code, 0x8D);
+            emit8(code, 0x34);
+            emit8(code, (modrm->scale << 6) | 0x35);
+            emit32(code, modrm->disp);
+            break;
+        case EA_BASE_INDEX:
+            emit_load(code, 8, HOST_RSI, REG_OFFSET(modrm->base));
+            emit_load(code, 8, HOST_RDI, REG_OFFSET(modrm->index));
+            // lea rsi, [rsi + rdi * scale + disp]
+            emit_lea_disp(code, 0x34, (modrm->scale << 6) | 0x3E, modrm->disp);
+            break;
+    }
+}
+
+// rax = r/m. Memory goes through the same accessors as the handlers.
+static void emit_load_rm(Code* code, Instr* instr, int size) {
+    ModRM* modrm = &instr->modrm;
+    if (modrm->mod == 3) {
+        emit_load(code, size, HOST_RAX, REG_OFFSET(modrm->rm));
+        return;
+    }
+    emit_address(code, modrm);
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, size == 8 ? (uintptr_t) vm_get_memory64 : (uintptr_t) vm_get_memory32);
+}
+
+// r/m = rax. A 4-byte value must already be zero-extended in rax.
+static void emit_store_rm(Code* code, Instr* instr) {
+    ModRM* modrm = &instr->modrm;
+    if (modrm->mod == 3) {
+        emit_store(code, 8, HOST_RAX, REG_OFFSET(modrm->rm));
+        return;
+    }
+    emit_op_reg(code, 0x89, 8, HOST_RDX, HOST_RAX);
+    emit_address(code, modrm);
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, instr->size == 8 ? (uintptr_t) vm_set_memory64 : (uintptr_t) vm_set_memory32);
+}
+
+// Pushes rdx like push64().
+static void emit_push(Code* code) {
+    emit_load(code, 8, HOST_RSI, REG_OFFSET(RSP));
+    emit8(code, 0x48);  // sub rsi, 8
+    emit8(code, 0x83);
+    emit8(code, 0xEE);
+    emit8(code, 8);
+    emit_store(code, 8, HOST_RSI, REG_OFFSET(RSP));
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, (uintptr_t) vm_set_memory64);
+}
+
+// Pops into rax like pop64().
+static void emit_pop(Code* code) {
+    emit_load(code, 8, HOST_RSI, REG_OFFSET(RSP));
+    emit_load(code, 8, HOST_RDI, MEMORY_OFFSET);
+    emit_call(code, (uintptr_t) vm_get_memory64);
+    emit_rex(code, 1, 0, 0);  // add qword [rbx + rsp], 8
+    emit8(code, 0x83);
+    emit_rbx_operand(code, 0, REG_OFFSET(RSP));
+    emit8(code, 8);
+}
+
+// Computes the operation with the host instruction of the same width, whose
+// flags are the guest flags, and records them for the interpreter the way
+// the alu_* functions of instruction.c do, unless they are dead.
+static int emit_alu(Code* code, Instr* instr) {
+    int size = instr->size;
+    int alu, form;
+    if (instr->op == OP_TEST_RM_R || instr->op == OP_TEST_RM_IMM) {
+        alu = ALU_AND;
+        form = instr->op == OP_TEST_RM_R ? FORM_RM_R : FORM_RM_IMM;
+    } else {
+        alu = (instr->op - OP_ADD_RM_R) / 3;
+        form = (instr->op - OP_ADD_RM_R) % 3;
+    }
+    if (alu == ALU_ADC || alu == ALU_SBB) {
+        return 0;  // they read CF
+    }
+    int writes = alu != ALU_CMP && instr->op != OP_TEST_RM_R && instr->op != OP_TEST_RM_IMM;
+    if (instr->flags_dead && !writes) {
+        return 1;  // a cmp or test that nothing reads
+    }
+    int flags_op = alu == 0 ? FLAGS_ADD : (alu == ALU_SUB || alu == ALU_CMP) ? FLAGS_SUB : FLAGS_RESULT;
+    int opcode = (alu == ALU_CMP ? ALU_SUB : alu) * 8 + 1;
+
+    // rax = v1, rcx = v2
+    emit_load_rm(code, instr, size);
+    if (form == FORM_RM_R) {
+        emit_load(code, size, HOST_RCX, REG_OFFSET(instr->modrm.reg_index));
+    } else if (form == FORM_R_RM) {
+        emit_op_reg(code, 0x89, 8, HOST_RCX, HOST_RAX);
+        emit_load(code, size, HOST_RAX, REG_OFFSET(instr->modrm.reg_index));
+    } else {
+        emit_mov_imm(code, size, HOST_RCX, instr->imm);
+    }
+    emit_op_reg(code, 0x89, 8, HOST_RDX, HOST_RAX);
+    emit_op_reg(code, opcode, size, HOST_RAX, HOST_RCX);
+    code->host_flags = 1;
+
+    if (!instr->flags_dead) {
+        emit_store_imm(code, 4, offsetof(Emulator, flags_op), flags_op);
+        emit_store_imm(code, 4, offsetof(Emulator, flags_size), size);
+        if (flags_op == FLAGS_RESULT) {
+            emit_store_imm(code, 8, offsetof(Emulator, flags_v1), 0);
+            emit_store_imm(code, 8, offsetof(Emulator, flags_v2), 0);
+        } else {
+            emit_store(code, 8, HOST_RDX, offsetof(Emulator, flags_v1));
+            emit_store(code, 8, HOST_RCX, offsetof(Emulator, flags_v2));
+        }
+        emit_store(code, 8, HOST_RAX, offsetof(Emulator, flags_result));
+    }
+    if (writes) {
+        if (form == FORM_R_RM) {
+            emit_store(code, 8, HOST_RAX, REG_OFFSET(instr->modrm.reg_index));
+        } else {
+            emit_store_rm(code, instr);
+        }
+    }
+    return 1;
+}
+
+// Guest and host condition codes are the same, so a jcc right after a
+// translated flag-setting instruction becomes a host jcc.
+static int emit_jcc(Code* code, Block* block, Instr* instr, uint64_t next_rip) {
+    if (!code->host_flags) {
+        return 0;
+    }
+    uint8_t* taken = emit_branch(code, instr->op - OP_JO);
+    emit_exit_to(code, block, next_rip);
+    patch_rel32(taken, code->p);
+    emit_exit_to(code, block, instr->imm);
+    return 1;
+}
+
+// Emits host code for instr. Returns 0 if it should run through its handler.
+// Instructions that end the block also leave it.
+static int translate(Code* code, Block* block, Instr* instr, uint64_t next_rip) {
+    ModRM* modrm = &instr->modrm;
+    int size = instr->size;
+    if (size != 4 && size != 8) {
+        return 0;
+    }
+    switch (instr->op) {
+        case OP_MOV_RM_R:
+            emit_load(code, size, HOST_RAX, REG_OFFSET(modrm->reg_index));
+            emit_store_rm(code, instr);
+            return 1;
+        case OP_MOV_R_RM:
+            emit_load_rm(code, instr, size);
+            emit_store(code, 8, HOST_RAX, REG_OFFSET(modrm->reg_index));
+            return 1;
+        case OP_MOV_RM_IMM:
+            emit_mov_imm(code, size, HOST_RAX, instr->imm);
+            emit_store_rm(code, instr);
+            return 1;
+        case OP_MOV_R_IMM:
+            emit_mov_imm(code, size, HOST_RAX, instr->imm);
+            emit_store(code, 8, HOST_RAX, REG_OFFSET(instr->reg));
+            return 1;
+        case OP_MOVSXD:
+            if (size != 8) {
+                return 0;
+            }
+            emit_load_rm(code, instr, 4);
+            emit8(code, 0x48);  // movsxd rax, eax
+            emit8(code, 0x63);
+            emit8(code, 0xC0);
+            emit_store(code, 8, HOST_RAX, REG_OFFSET(modrm->reg_index));
+            return 1;
+        case OP_LEA:
+            emit_address(code, modrm);
+            if (size == 4) {
+                emit8(code, 0x89);  // mov esi, esi
+                emit8(code, 0xF6);
+            }
+            emit_store(code, 8, HOST_RSI, REG_OFFSET(modrm->reg_index));
+            return 1;
+        case OP_PUSH_R:
+            emit_load(code, 8, HOST_RDX, REG_OFFSET(instr->reg));
+            emit_push(code);
+            return 1;
+        case OP_PUSH_IMM:
+            emit_mov_imm(code, 8, HOST_RDX, instr->imm);
+            emit_push(code);
+            return 1;
+        case OP_POP_R:
+            emit_pop(code);
+            emit_store(code, 8, HOST_RAX, REG_OFFSET(instr->reg));
+            return 1;
+        case OP_JMP:
+            emit_exit_to(code, block, instr->imm);
+            return 1;
+        case OP_CALL:
+            emit_mov_imm(code, 8, HOST_RDX, next_rip);
+            emit_push(code);
+            emit_ras_push(code, block);
+            emit_exit_to(code, block, instr->imm);
+            return 1;
+        case OP_RET:
+            emit_pop(code);
+            emit_store(code, 8, HOST_RAX, RIP_OFFSET);
+            emit_exit_return(code, block);
+            return 1;
+        default:
+            if (instr->op >= OP_JO && instr->op <= OP_JG) {
+                return emit_jcc(code, block, instr, next_rip);
+            }
+            if (instr->op >= OP_ADD_RM_R && instr->op <= OP_TEST_RM_IMM) {
+                return emit_alu(code, instr);
+            }
+            return 0;
+    }
+}
+
+static void compile(Block* block);
+
+static void* compiler_thread(void* arg) {
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (queue_count == 0 && !stopping) {
+            pthread_cond_wait(&queued, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        current = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_size;
+        queue_count--;
+        pthread_mutex_unlock(&lock);
+        compile(current);
+        pthread_mutex_lock(&lock);
+        current = NULL;
+        pthread_cond_broadcast(&compiled);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int jit_init(int max_queued) {
+#if defined(__x86_64__)
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_JIT
+    flags |= MAP_JIT;
+#endif
+    void* p = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    buffer = p;
+    buffer_used = 0;
+    queue = malloc(max_queued * sizeof(Block*));
+    queue_size = max_queued;
+    if (pthread_create(&thread, NULL, compiler_thread, NULL) != 0) {
+        return 0;
+    }
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void jit_shutdown(void) {
+    if (queue == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&queued);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    free(queue);
+    queue = NULL;
+}
+
+int jit_submit(Block* block) {
+    pthread_mutex_lock(&lock);
+    int ok = queue_count < queue_size;
+    if (ok) {
+        queue[(queue_head + queue_count) % queue_size] = block;
+        queue_count++;
+        block->jit_queued = 1;
+        pthread_cond_signal(&queued);
+    }
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+void jit_forget(Block* block) {
+    if (!block->jit_queued) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    int i, n = 0;
+    for (i = 0; i < queue_count; i++) {
+        Block* queued_block = queue[(queue_head + i) % queue_size];
+        if (queued_block != block) {
+            queue[(queue_head + n++) % queue_size] = queued_block;
+        }
+    }
+    queue_count = n;
+    while (current == block) {
+        pthread_cond_wait(&compiled, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void jit_drain(void) {
+    pthread_mutex_lock(&lock);
+    while (queue_count > 0 || current != NULL) {
+        pthread_cond_wait(&compiled, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Runs on the compiler thread. It reads only the parts of block that do not
+// change once it is built, and writes only the jumps of its links before it
+// publishes block->native.
+static void compile(Block* block) {
+    if (buffer == NULL || JIT_BUFFER_SIZE - buffer_used < (size_t) (block->num_instrs + 1) * JIT_MAX_INSTR_BYTES) {
+        return;
+    }
+    Code code = {buffer + buffer_used, 0};
+    emit8(&code, 0x53);  // push rbx, which also aligns the stack for calls
+    emit_op_reg(&code, 0x89, 8, HOST_RBX, HOST_RDI);
+    emit_mov_imm(&code, 8, HOST_RAX, (uintptr_t) &block->exec_count);
+    emit8(&code, 0x48);  // inc qword [rax]
+    emit8(&code, 0xFF);
+    emit8(&code, 0x00);
+
+    uint64_t rip = block->start;
+    int i;
+    for (i = 0; i < block->num_instrs; i++) {
+        // The handlers of a fallback keep pointing into block->instrs, which
+        // lives as long as this code is reachable from the block.
+        Instr* instr = &block->instrs[i];
+        rip += instr->len;
+        if (instr->trace_dir != TRACE_NONE) {
+            rip = emit_trace_jump(&code, block, instr, rip);
+            continue;
+        }
+        if (translate(&code, block, instr, rip)) {
+            stats.native_instrs++;
+            continue;
+        }
+        stats.fallback_instrs++;
+        emit_handler_call(&code, instr, rip);
+        if (instr->op == OP_CALL_RM) {
+            emit_ras_push(&code, block);
+        } else if (instr->op == OP_RET) {
+            emit_exit_return(&code, block);
+            continue;
+        }
+        if (instr->ends_block) {
+            emit_exit_lookup(&code, block);
+        }
+    }
+    if (!block->instrs[block->num_instrs - 1].ends_block) {
+        emit_exit_to(&code, block, rip);
+    }
+
+    size_t size = code.p - (buffer + buffer_used);
+    buffer_used += size;
+    stats.num_blocks++;
+    stats.code_size += size;
+    // Atomic, and the code and the jumps are written before it. run() links
+    // the block to the others the next time it gets there.
+    block->native = (Block* (*)(Emulator*)) (buffer + buffer_used - size);
+}
+
+void jit_link(Block* from, BlockLink* link) {
+    Block* (*native)(Emulator*) = link->block != NULL ? link->block->native : NULL;
+    link->native = native != NULL ? (uint8_t*) native + ENTRY_OFFSET : NULL;
+    if (from != NULL && from->native != NULL && link->jump != NULL) {
+        // A rel32 of 0 falls through to the exit.
+        patch_rel32(link->jump, link->native != NULL ? link->native : link->jump + 4);
+    }
+}
+
+void jit_get_stats(JitStats* jit_stats) {
+    *jit_stats = stats;
+}
@@ -0,0 +1,48 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stdint.h>
+
+#include "emulator.h"
+#include "code_cache.h"
+
+// Blocks are interpreted this many times before they are queued for
+// translation, and this many at most wait in the queue, unless set by
+// --jit-threshold and --jit-queue.
+#define JIT_THRESHOLD 16
+#define JIT_QUEUE_SIZE 64
+
+typedef struct {
+    uint64_t num_blocks;
+    uint64_t code_size;          // bytes of host code
+    uint64_t native_instrs;      // instructions translated into host code
+    uint64_t fallback_instrs;    // instructions that call their handler
+} JitStats;
+
+// Reserves the executable buffer for translated blocks and starts the
+// compiler thread. Returns 0 if the host cannot run them (it is not x86-64
+// or refuses an executable mapping).
+int jit_init(int max_queued);
+// Stops the compiler thread, dropping the blocks still queued.
+void jit_shutdown(void);
+// Queues block for translation on the compiler thread, which stores the
+// host code in block->native when done. Returns 0 if the queue is full.
+// block->native stays NULL once the buffer is full, so the block stays
+// interpreted.
+int jit_submit(Block* block);
+// Takes block out of the queue, or waits until it is translated, so that it
+// can be freed.
+void jit_forget(Block* block);
+// Waits until every queued block is translated. --jit-sync calls it after
+// each jit_submit() so that tests run translated code at the same points
+// every time.
+void jit_drain(void);
+// Points the translated exit of link at link->block, or back at run() if
+// either end is not translated. Called whenever link->block changes. from
+// is the block that owns link, or NULL for a return link, which has no
+// jump.
+void jit_link(Block* from, BlockLink* link);
+// Valid after jit_shutdown().
+void jit_get_stats(JitStats* stats);
+
+#endif
@@ -9,8 +9,19 @@
 #include "elf_loader.h"
 #include "macho_loader.h"
 #include "instruction.h"
+#include "code_cache.h"
+#include "disk_cache.h"
+#include "jit.h"
 
 bool quiet = false;
+bool show_stats = false;
+bool jit = false;
+int jit_threshold = JIT_THRESHOLD;
+int jit_queue = JIT_QUEUE_SIZE;
+bool jit_sync = false;
+int repeat = 1;
+char* disk_cache_path = NULL;
+DiskCache* disk_cache = NULL;
 
 enum formats {
     BIN,      // Flat raw binary [default]
@@ -48,6 +59,133 @@ static void dump_registers(Emulator* emu) {
     debugf("RIP = %08x\n", emu->rip);
 }
 
+static void dump_stats(Emulator* emu) {
+    static const char* access_name[] = {"read", "write", "fetch"};
+    VMStats stats;
+    vm_get_stats(emu->memory, &stats);
+    fprintf(stderr, "pages = %llu (shared = %llu)\n",
+            (unsigned long long) stats.num_pages,
+            (unsigned long long) stats.num_shared_pages);
+    for (int i = 0; i < VM_ACCESS_COUNT; i++) {
+        uint64_t total = stats.tlb_hits[i] + stats.tlb_misses[i];
+        fprintf(stderr, "TLB %-5s: hits = %llu, misses = %llu, hit rate = %.2f%%\n",
+                access_name[i],
+                (unsigned long long) stats.tlb_hits[i],
+                (unsigned long long) stats.tlb_misses[i],
+                total ? 100.0 * stats.tlb_hits[i] / total : 0.0);
+    }
+    CodeCacheStats cache_stats;
+    cache_get_stats(emu->cache, &cache_stats);
+    fprintf(stderr, "decode cache: hits = %llu, misses = %llu, invalidations = %llu\n",
+            (unsigned long long) cache_stats.hits,
+            (unsigned long long) cache_stats.misses,
+            (unsigned long long) cache_stats.invalidations);
+    fprintf(stderr, "blocks = %llu (invalidated = %llu), link hits = %llu\n",
+            (unsigned long long) cache_stats.num_blocks,
+            (unsigned long long) cache_stats.block_invalidations,
+            (unsigned long long) cache_stats.link_hits);
+    fprintf(stderr, "return-address stack: hits = %llu, misses = %llu\n",
+            (unsigned long long) cache_stats.ras_hits,
+            (unsigned long long) cache_stats.ras_misses);
+    uint64_t num_traces = cache_stats.num_traces;
+    uint64_t trace_runs = cache_stats.trace_runs;
+    fprintf(stderr, "traces = %llu (%.1f blocks, %.1f instructions each), runs = %llu, "
+            "side exits = %llu (%.2f%%), coverage = %.2f%%\n",
+            (unsigned long long) num_traces,
+            num_traces ? (double) cache_stats.trace_blocks / num_traces : 0.0,
+            num_traces ? (double) cache_stats.trace_instrs / num_traces : 0.0,
+            (unsigned long long) trace_runs,
+            (unsigned long long) cache_stats.side_exits,
+            trace_runs ? 100.0 * cache_stats.side_exits / trace_runs : 0.0,
+            cache_stats.instrs_run ? 100.0 * cache_stats.trace_instrs_run / cache_stats.instrs_run : 0.0);
+    fprintf(stderr, "flag writes = %llu, dead = %llu\n",
+            (unsigned long long) cache_stats.flag_writes,
+            (unsigned long long) cache_stats.dead_flag_writes);
+    static const char* fusion_names[NUM_FUSIONS] = {NULL, "push/pop", "cmp/jcc", "prologue", "setcc/movzx"};
+    uint64_t dispatches_saved = 0;
+    fprintf(stderr, "superinstructions:");
+    for (int i = FUSE_NONE + 1; i < NUM_FUSIONS; i++) {
+        fprintf(stderr, "%s %s = %llu (runs = %llu)", i == FUSE_NONE + 1 ? "" : ",", fusion_names[i],
+                (unsigned long long) cache_stats.fusions[i],
+                (unsigned long long) cache_stats.fusion_runs[i]);
+        dispatches_saved += cache_stats.fusion_runs[i] * (fusion_length(i) - 1);
+    }
+    fprintf(stderr, ", dispatches saved = %llu\n", (unsigned long long) dispatches_saved);
+    fprintf(stderr, "loop idioms: fill = %llu, copy = %llu, runs = %llu (%llu bytes)\n",
+            (unsigned long long) cache_stats.idioms[IDIOM_FILL],
+            (unsigned long long) cache_stats.idioms[IDIOM_COPY],
+            (unsigned long long) cache_stats.idiom_runs,
+            (unsigned long long) cache_stats.idiom_bytes);
+
+    if (disk_cache != NULL) {
+        DiskCacheStats disk_stats;
+        disk_cache_get_stats(disk_cache, &disk_stats);
+        fprintf(stderr, "disk cache: entries = %llu, loaded = %llu, stale = %llu\n",
+                (unsigned long long) disk_stats.entries,
+                (unsigned long long) disk_stats.loaded,
+                (unsigned long long) disk_stats.stale);
+    }
+
+    Block* hot[10];
+    int n = cache_hot_blocks(emu->cache, hot, 10);
+    for (int i = 0; i < n; i++) {
+        fprintf(stderr, "  block 0x%llx-0x%llx: %d instructions, executed %llu times\n",
+                (unsigned long long) hot[i]->start,
+                (unsigned long long) hot[i]->end,
+                hot[i]->num_instrs,
+                (unsigned long long) hot[i]->exec_count);
+    }
+
+    if (jit) {
+        JitStats jit_stats;
+        jit_get_stats(&jit_stats);
+        fprintf(stderr, "jit: blocks = %llu, code = %llu bytes, native instructions = %llu, fallbacks = %llu\n",
+                (unsigned long long) jit_stats.num_blocks,
+                (unsigned long long) jit_stats.code_size,
+                (unsigned long long) jit_stats.native_instrs,
+                (unsigned long long) jit_stats.fallback_instrs);
+    }
+}
+
+static void run(Emulator* emu) {
+    Block* block = NULL;
+    int native = 0;
+    while (1) {
+        block = cache_next_block(emu, block, native);
+        if (block == NULL) {
+            printf("\n\nNot Implemented: %x\n", get_code8(emu, 0));
+            break;
+        }
+        if (!quiet) {
+            debugf("RIP = %llx, Block = %d instructions\n", emu->rip, block->num_instrs);
+        }
+        // The compiler thread may set block->native at any time.
+        Block* (*code)(Emulator*) = block->native;
+        native = code != NULL;
+        if (native) {
+            // Continues with the blocks it is linked to.
+            block = code(emu);
+        } else {
+            run_block(emu, block);
+            // Loops of enum Idiom run faster as they are.
+            // Those translated in an earlier run go at once.
+            if (jit && !block->jit_queued && block->idiom.kind == IDIOM_NONE
+                && (block->exec_count >= jit_threshold || block->warm)) {
+                if (jit_submit(block) && jit_sync) {
+                    jit_drain();
+                }
+            }
+        }
+
+        // Only the last instruction of a block can jump, so checking here is
+        // enough. Exit if jump to 0x00
+        if (emu->rip == 0x00) {
+            debugf("\n\nend of program.\n\n");
+            break;
+        }
+    }
+}
+
 int opt_remove_at(int argc, char* argv[], int index) {
     if (index < 0 || argc <= index) {
         return argc;
@@ -68,6 +206,53 @@ int main(int argc, char* argv[]) {
         if (strcmp(argv[i], "-q") == 0 || strcmp(argv[i], "--quiet") == 0) {
             quiet = true;
             argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--memory") == 0) {
+            argc = opt_remove_at(argc, argv, i);
+
+            if (i >= argc)
+                errorf("invalid --memory option [paged, flat]");
+
+            if (strcmp(argv[i], "paged") == 0)
+                vm_set_default_mode(VM_PAGED);
+            else if (strcmp(argv[i], "flat") == 0)
+                vm_set_default_mode(VM_FLAT);
+            else
+                errorf("invalid --memory option [paged, flat]");
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--repeat") == 0) {
+            argc = opt_remove_at(argc, argv, i);
+
+            if (i >= argc || (repeat = atoi(argv[i])) < 1)
+                errorf("invalid --repeat option, must be a positive number");
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "--jit-threshold") == 0) {
+            argc = opt_remove_at(argc, argv, i);
+
+            if (i >= argc || (jit_threshold = atoi(argv[i])) < 1)
+                errorf("invalid --jit-threshold option, must be a positive number");
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "--jit-sync") == 0) {
+            jit_sync = true;
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "--jit-queue") == 0) {
+            argc = opt_remove_at(argc, argv, i);
+
+            if (i >= argc || (jit_queue = atoi(argv[i])) < 1)
+                errorf("invalid --jit-queue option, must be a positive number");
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "--disk-cache") == 0) {
+            argc = opt_remove_at(argc, argv, i);
+
+            if (i >= argc)
+                errorf("invalid --disk-cache option, must be a file name");
+            disk_cache_path = argv[i];
+            argc = opt_remove_at(argc, argv, i);
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0) {
+            show_stats = true;
+            argc = opt_remove_at(argc, argv, i);
         } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--format") == 0) {
             argc = opt_remove_at(argc, argv, i);
 
@@ -107,27 +292,42 @@ int main(int argc, char* argv[]) {
     }
 
     init_instructions();
-
-    while (1) {
-        uint8_t code = get_code8(emu, 0);
-        debugf("RIP = %llx, Code = %02X\n", emu->rip, code);
-
-        if (instructions[code] == NULL) {
-            printf("\n\nNot Implemented: %x\n", code);
-            break;
+    if (jit && !jit_init(jit_queue)) {
+        errorf("--jit is not supported on this host\n");
+    }
+    if (disk_cache_path != NULL) {
+        disk_cache = disk_cache_open(disk_cache_path);
+        if (disk_cache == NULL) {
+            errorf("--disk-cache is not supported on this host\n");
         }
-        instructions[code](emu);
+        cache_set_disk(emu->cache, disk_cache);
+    }
 
-        // Exit if jump to 0x00
-        if (emu->rip == 0x00) {
-            debugf("\n\nend of program.\n\n");
-            break;
+    if (repeat > 1) {
+        // Run the loaded program again and again from the same initial state
+        // without reloading it.
+        EmulatorSnapshot snapshot;
+        emu_snapshot(emu, &snapshot);
+        for (i = 1; i < repeat; i++) {
+            run(emu);
+            emu_restore(emu, &snapshot);
         }
     }
+    run(emu);
+    jit_shutdown();
+    if (disk_cache != NULL && disk_cache_save(disk_cache, emu) < 0) {
+        fprintf(stderr, "cannot write the disk cache '%s'\n", disk_cache_path);
+    }
 
     dump_registers(emu);
+    if (show_stats) {
+        dump_stats(emu);
+    }
 
     int exit_status = (int) emu->registers[RAX];
     destroy_emu(emu);
+    if (disk_cache != NULL) {
+        disk_cache_close(disk_cache);
+    }
     return exit_status;
 }
@@ -18,99 +18,113 @@ void parse_modrm(Emulator* emu, ModRM* modrm) {
 
     emu->rip += 1;
     if (modrm->mod != 3 && modrm->rm == 4) {
+        // | 7 6 | 5 4 3 | 2 1 0 |
+        // |Scale| Index |  Base |
         sib = get_code8(emu, 0);
         modrm->scale = (sib & 0xC0) >> 6;
         modrm->index = (sib & 0x38) >> 3;
-        modrm->base = (sib & 0x07) >> 3;
+        modrm->base = (sib & 0x07);
         emu->rip += 1;
     }
-    if ((modrm->mod == 0 && modrm->rm == 5) || modrm->mod == 2) {
-        modrm->disp32 = get_code32(emu, 0);
+    // mod = 0 with rm = 5, or with a SIB base of 5, has a disp32 instead
+    // of a base register.
+    if ((modrm->mod == 0 && (modrm->rm == 5 || (modrm->rm == 4 && modrm->base == 5))) || modrm->mod == 2) {
+        modrm->disp = (int32_t) get_code32(emu, 0);
         emu->rip += 4;
     } else if (modrm->mod == 1) {
-        modrm->disp8 = get_sign_code8(emu, 0);
+        modrm->disp = get_sign_code8(emu, 0);
         emu->rip += 1;
     }
 }
 
-uint32_t calc_memory_address(Emulator* emu, ModRM* modrm) {
-    if (modrm->mod == 0) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 0, rm = 4 (SIB)\n");
-            exit(1);
-        } else if (modrm->rm == 5) {
-            return modrm->disp32;
-        } else {
-            return get_register32(emu, modrm->rm);
-        }
-    } else if (modrm->mod == 1) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 1, rm = 4 (SIB)\n");
-            exit(1);
-        } else {
-            return get_register32(emu, modrm->rm) + modrm->disp8;
-        }
-    } else if (modrm->mod == 2) {
-        if (modrm->rm == 4) {
-            printf("not implemented ModRM mod = 1, rm = 4 (SIB)\n");
-            exit(1);
-        } else {
-            return get_register32(emu, modrm->rm) + modrm->disp32;
-        }
+void init_address_form(ModRM* modrm, uint64_t next_rip) {
+    if (modrm->mod == 3) {
+        modrm->form = EA_NONE;
+        return;
+    }
+    if (modrm->mod == 0 && modrm->rm == 5) {
+        modrm->disp += next_rip;
+        modrm->form = EA_ABS;
+        return;
+    }
+    int has_base = 1, has_index = 0;
+    if (modrm->rm == 4) {
+        // Index 4 is none, unless REX.X made it r12. Base 5 or 13 is none
+        // with mod = 0.
+        has_base = !(modrm->mod == 0 && (modrm->base & 7) == 5);
+        has_index = modrm->index != 4;
+    } else {
+        modrm->base = modrm->rm;
+    }
+    if (has_index) {
+        modrm->form = has_base ? EA_BASE_INDEX : EA_INDEX;
+    } else if (has_base) {
+        modrm->form = modrm->disp != 0 ? EA_BASE_DISP : EA_BASE;
     } else {
-        printf("must not reach here(invalid modrm->mod value).\n");
-        exit(1);
+        modrm->form = EA_ABS;
     }
 }
 
-uint8_t get_r8(Emulator* emu, ModRM* modrm) {
-    return get_register8(emu, modrm->reg_index);
+static uint64_t address_none(Emulator* emu, ModRM* modrm) {
+    printf("must not reach here(register operand has no address).\n");
+    exit(1);
 }
 
-void set_r8(Emulator* emu, ModRM* modrm, uint8_t value) {
-    set_register8(emu, modrm->reg_index, value);
+static uint64_t address_abs(Emulator* emu, ModRM* modrm) {
+    return modrm->disp;
 }
 
-uint8_t get_rm8(Emulator* emu, ModRM* modrm) {
-    if (modrm->mod == 3) {
-        return get_register8(emu, modrm->rm);
-    } else {
-        uint32_t address = calc_memory_address(emu, modrm);
-        return get_memory8(emu, address);
-    }
+static uint64_t address_base(Emulator* emu, ModRM* modrm) {
+    return emu->registers[modrm->base];
 }
 
-void set_rm8(Emulator* emu, ModRM* modrm, uint8_t value) {
-    if (modrm->mod == 3) {
-        set_register8(emu, modrm->rm, value);
-    } else {
-        uint32_t address = calc_memory_address(emu, modrm);
-        set_memory8(emu, address, value);
-    }
+static uint64_t address_base_disp(Emulator* emu, ModRM* modrm) {
+    return emu->registers[modrm->base] + modrm->disp;
 }
 
-uint32_t get_rm32(Emulator* emu, ModRM* modrm) {
-    if (modrm->mod == 3) {
-        return get_register32(emu, modrm->rm);
-    } else {
-        uint32_t address = calc_memory_address(emu, modrm);
-        return get_memory32(emu, address);
-    }
+static uint64_t address_index(Emulator* emu, ModRM* modrm) {
+    return (emu->registers[modrm->index] << modrm->scale) + modrm->disp;
 }
 
-void set_rm32(Emulator* emu, ModRM* modrm, uint32_t value) {
-    if (modrm->mod == 3) {
-        set_register32(emu, modrm->rm, value);
-    } else {
-        uint32_t address = calc_memory_address(emu, modrm);
-        set_memory32(emu, address, value);
-    }
+static uint64_t address_base_index(Emulator* emu, ModRM* modrm) {
+    return emu->registers[modrm->base] + (emu->registers[modrm->index] << modrm->scale) + modrm->disp;
 }
 
-uint32_t get_r32(Emulator* emu, ModRM* modrm) {
-    return get_register32(emu, modrm->reg_index);
+static uint64_t (*const address_functions[NUM_ADDRESS_FORMS])(Emulator* emu, ModRM* modrm) = {
+        address_none, address_abs, address_base, address_base_disp, address_index, address_base_index
+};
+
+uint64_t calc_memory_address(Emulator* emu, ModRM* modrm) {
+    return address_functions[modrm->form](emu, modrm);
 }
 
-void set_r32(Emulator* emu, ModRM* modrm, uint32_t value) {
-    set_register32(emu, modrm->reg_index, value);
+// The accessors of one operand width. Byte register indices may be AH..BH
+// (see get_register8).
+#define DEFINE_ACCESSORS(bits) \
+uint ## bits ## _t get_r ## bits(Emulator* emu, ModRM* modrm) { \
+    return get_register ## bits(emu, modrm->reg_index); \
+} \
+void set_r ## bits(Emulator* emu, ModRM* modrm, uint ## bits ## _t value) { \
+    set_register ## bits(emu, modrm->reg_index, value); \
+} \
+uint ## bits ## _t get_rm ## bits(Emulator* emu, ModRM* modrm) { \
+    if (modrm->mod == 3) { \
+        return get_register ## bits(emu, modrm->rm); \
+    } else { \
+        uint64_t address = calc_memory_address(emu, modrm); \
+        return get_memory ## bits(emu, address); \
+    } \
+} \
+void set_rm ## bits(Emulator* emu, ModRM* modrm, uint ## bits ## _t value) { \
+    if (modrm->mod == 3) { \
+        set_register ## bits(emu, modrm->rm, value); \
+    } else { \
+        uint64_t address = calc_memory_address(emu, modrm); \
+        set_memory ## bits(emu, address, value); \
+    } \
 }
+
+DEFINE_ACCESSORS(8)
+DEFINE_ACCESSORS(16)
+DEFINE_ACCESSORS(32)
+DEFINE_ACCESSORS(64)
@@ -3,6 +3,19 @@
 
 #include "emulator.h"
 
+// The forms of a memory operand, each with its own function that computes
+// the address, so that executing an instruction does not look at mod and
+// rm again.
+enum AddressForm {
+    EA_NONE,        // a register operand (mod = 3)
+    EA_ABS,         // [disp], also [rip + disp32] once resolved
+    EA_BASE,        // [base]
+    EA_BASE_DISP,   // [base + disp]
+    EA_INDEX,       // [index * scale + disp]
+    EA_BASE_INDEX,  // [base + index * scale + disp]
+    NUM_ADDRESS_FORMS
+};
+
 typedef struct {
     uint8_t mod;
     union {
@@ -12,28 +25,39 @@ typedef struct {
     uint8_t rm;
 
     // sib
-    uint8_t scale;
+    uint8_t scale;  // shift count: 0 to 3
     uint8_t index;
-    uint8_t base;
-    union {
-        int8_t disp8;
-        uint32_t disp32;
-    };
+    uint8_t base;   // also the register of rm without SIB
+
+    uint8_t form;   // enum AddressForm
+    int64_t disp;   // sign-extended
 } ModRM;
 
 void parse_modrm(Emulator* emu, ModRM* modrm);
-uint32_t calc_memory_address(Emulator* emu, ModRM* modrm);
+// Picks the form of the operand once REX has been applied to rm, index and
+// base, and resolves [rip + disp32] against next_rip, the address of the
+// next instruction.
+void init_address_form(ModRM* modrm, uint64_t next_rip);
+uint64_t calc_memory_address(Emulator* emu, ModRM* modrm);
 
 uint8_t get_r8(Emulator* emu, ModRM* modrm);
 void set_r8(Emulator* emu, ModRM* modrm, uint8_t value);
-
 uint8_t get_rm8(Emulator* emu, ModRM* modrm);
 void set_rm8(Emulator* emu, ModRM* modrm, uint8_t value);
 
-uint32_t get_rm32(Emulator* emu, ModRM* modrm);
-void set_rm32(Emulator* emu, ModRM* modrm, uint32_t value);
+uint16_t get_r16(Emulator* emu, ModRM* modrm);
+void set_r16(Emulator* emu, ModRM* modrm, uint16_t value);
+uint16_t get_rm16(Emulator* emu, ModRM* modrm);
+void set_rm16(Emulator* emu, ModRM* modrm, uint16_t value);
 
 uint32_t get_r32(Emulator* emu, ModRM* modrm);
 void set_r32(Emulator* emu, ModRM* modrm, uint32_t value);
+uint32_t get_rm32(Emulator* emu, ModRM* modrm);
+void set_rm32(Emulator* emu, ModRM* modrm, uint32_t value);
+
+uint64_t get_r64(Emulator* emu, ModRM* modrm);
+void set_r64(Emulator* emu, ModRM* modrm, uint64_t value);
+uint64_t get_rm64(Emulator* emu, ModRM* modrm);
+void set_rm64(Emulator* emu, ModRM* modrm, uint64_t value);
 
 #endif
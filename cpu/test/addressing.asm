@@ -0,0 +1,49 @@
+BITS 64
+  org 0x7c00
+start:
+  mov esp, 0x20000
+  mov r15d, 3000
+again:
+  mov r12d, 0x10000
+  mov qword [r12], 5       ; SIB base r12
+  mov r13d, 0x10010
+  mov qword [r13], 7       ; r13 with mod = 1
+  mov dword [0x10020], 3   ; SIB without base and index
+  mov rbx, 0x100000000
+  mov qword [rbx+0x10000], 100  ; above 4GB
+  mov r8d, 0x10000
+  mov r12d, 4
+  mov rax, [r8+r12*4]      ; REX.X index
+  mov esi, 4
+  add rax, [rsi*8+0x10000] ; index without base
+  add eax, [rel val]
+  push 11
+  push 0
+  add rax, [rsp+8]
+  add rsp, 16
+  add rax, [rbx+0x10000]
+  mov r12d, 0x10000
+  add rax, [r12]
+  mov r9, rax
+  mov edi, 0x11000
+  mov ecx, 0x40
+  mov eax, 2
+  rep stosb
+  mov esi, 0x11000
+  mov edi, 0x12000
+  xor eax, eax
+  mov edx, 0x40
+copy:                      ; a copy loop through base + index
+  movzx ecx, byte [rsi+rax]
+  mov [rdi+rax], cl
+  add rax, 1
+  cmp rdx, rax
+  jne copy
+  movzx eax, byte [0x1203f]
+  add al, [0x12040]
+  add rax, r9
+  sub r15d, 1
+  jne again
+  jmp 0
+val:
+  dd 40
@@ -0,0 +1,29 @@
+BITS 64
+  org 0x7c00
+start:
+  mov esp, 0x20000
+  mov edi, 0x10000  ; rep stosb
+  mov ecx, 0x1800
+  mov eax, 0x41
+  rep stosb
+  mov eax, 0x10800
+  mov edi, 0x10923
+fill:               ; a fill loop
+  mov byte [rax], 0x5a
+  add rax, 1
+  cmp rax, rdi
+  jne fill
+  mov ebx, 0x10900
+  mov r10d, 0x10932
+copy:               ; a copy loop onto itself 3 bytes up
+  mov dl, [rbx]
+  add rbx, 1
+  mov [rbx+2], dl
+  cmp r10, rbx
+  jne copy
+  mov esi, 0x10800  ; repe cmpsb: 0x35 bytes match
+  mov edi, 0x10900
+  mov ecx, 0x100
+  repe cmpsb
+  mov eax, ecx
+  jmp 0
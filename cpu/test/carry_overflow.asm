@@ -0,0 +1,71 @@
+BITS 64
+  org 0x7c00
+start:
+  mov ecx, 4
+  mov edx, 0
+loop:
+  mov eax, 0xffffffff
+  add eax, 1        ; CF: carries out of 32 bits
+  jnc case2
+  add edx, 1
+case2:
+  mov eax, 0xffffffff
+  add rax, 1        ; no CF: the same values do not carry out of 64 bits
+  jc case3
+  add edx, 1
+case3:
+  mov eax, 0
+  sub eax, 1        ; CF: borrows at 32 bits
+  jnc case4
+  add edx, 1
+case4:
+  mov rax, 0x100000000
+  sub rax, 1        ; no CF: the low half borrows, but not the whole value
+  jc case5
+  add edx, 1
+case5:
+  mov eax, 1
+  cmp rax, 2        ; CF: borrows at 64 bits
+  jnc case6
+  add edx, 1
+case6:
+  mov eax, 0x80000000
+  cmp eax, 1        ; OF: INT_MIN - 1
+  jno case7
+  add edx, 1
+case7:
+  mov eax, 0x80000000
+  cmp rax, 1        ; no OF: 0x80000000 is positive at 64 bits
+  jo case8
+  add edx, 1
+case8:
+  mov rax, 0x8000000000000000
+  sub rax, 1        ; OF: INT64_MIN - 1
+  jno case9
+  add edx, 1
+case9:
+  mov eax, 0x7fffffff
+  add eax, 1        ; OF: INT_MAX + 1
+  jno case10
+  add edx, 1
+case10:
+  mov eax, 0x80000000
+  add eax, eax      ; CF and OF: two negative operands
+  jnc case11
+  jno case11
+  add edx, 1
+case11:
+  mov rax, -1
+  add rax, 1        ; CF: carries out of 64 bits
+  jnc case12
+  add edx, 1
+case12:
+  mov al, 0xff
+  add al, 1         ; CF: carries out of 8 bits
+  jnc next
+  add edx, 1
+next:
+  sub ecx, 1
+  jne loop
+  mov eax, edx
+  jmp 0
@@ -0,0 +1,17 @@
+BITS 64
+  org 0x7c00
+start:
+  mov ecx, 0
+  mov edx, 0
+loop:
+  add edx, 3        ; its flags are dead: the sub sets them again
+  sub edx, 2        ; and the cmp sets them again
+  cmp ecx, 30       ; CF = ecx < 30
+  inc edx           ; leaves CF for the adc
+  adc edx, 0
+  inc edx           ; dead: the add sets the flags again
+  add ecx, 1
+  cmp ecx, 50
+  jne loop
+  mov eax, edx
+  jmp 0
@@ -0,0 +1,12 @@
+BITS 64
+  org 0x7c00
+start:
+  mov eax, 1        ; patched to "mov eax, 7" after it has been run once
+  mov cl, 7
+  mov ebx, start + 1
+  mov [rbx], cl
+  cmp al, 7
+  je done
+  jmp start
+done:
+  jmp 0
@@ -0,0 +1,24 @@
+BITS 64
+  org 0x7c00
+start:
+  mov edx, 0
+  mov edi, 0
+loop:
+  push rdx
+  call f
+  pop rdx
+  add edx, eax
+  add edi, 1
+  cmp edi, 50
+  jne skip
+  mov cl, 2         ; f returns 2 from now on, while its block is hot
+  mov ebx, f + 1
+  mov [rbx], cl
+skip:
+  cmp edi, 100
+  jne loop
+  mov eax, edx
+  jmp 0
+f:
+  mov eax, 1
+  ret
@@ -0,0 +1,30 @@
+BITS 64
+  org 0x7c00
+start:
+  mov esp, 0x10000  ; keeps the stack off the code page
+  mov ecx, 0
+  mov ebx, 0
+loop:
+  push rcx          ; push/pop
+  pop rdi
+  call f
+  add ebx, eax
+  add ecx, 1
+  cmp rcx, 100      ; cmp/jcc
+  jne loop
+  mov eax, ebx
+  jmp 0
+f:
+  push rbp          ; prologue
+  mov rbp, rsp
+  sub rsp, 16
+  cmp rdi, 10
+  setl al           ; setcc/movzx
+  movzx eax, al
+  test rdi, 1       ; cmp/jcc
+  je even
+  add eax, 2
+even:
+  mov rsp, rbp
+  pop rbp
+  ret
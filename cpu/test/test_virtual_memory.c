@@ -7,5 +7,210 @@ int main() {
     vm_set_memory8(vm, 0xfffffff8, 0x10);
     uint64_t val = vm_get_memory8(vm, 0xfffffff8);
     assert(val == 0x10);
+
+    // More pages than the old fixed-size page array could hold.
+    uint64_t addr;
+    for (addr = 0; addr < 4096 * 2048; addr += 4096) {
+        vm_set_memory8(vm, addr, (addr >> 12) & 0xFF);
+    }
+    for (addr = 0; addr < 4096 * 2048; addr += 4096) {
+        assert(vm_get_memory8(vm, addr) == ((addr >> 12) & 0xFF));
+    }
+
+    // Addresses above 4GB and in the upper canonical half do not alias.
+    vm_set_memory64(vm, 0x7ffffffff000, 0x1122334455667788);
+    vm_set_memory64(vm, 0xfffffffffffff000, 0x8877665544332211);
+    assert(vm_get_memory64(vm, 0x7ffffffff000) == 0x1122334455667788);
+    assert(vm_get_memory64(vm, 0xfffffffffffff000) == 0x8877665544332211);
+    assert(vm_get_memory8(vm, 0xfffffff8) == 0x10);
+
+    // Word accesses are little endian, including ones crossing a page boundary.
+    vm_set_memory32(vm, 0x2000, 0xdeadbeef);
+    assert(vm_get_memory8(vm, 0x2000) == 0xef);
+    assert(vm_get_memory16(vm, 0x2002) == 0xdead);
+    vm_set_memory64(vm, 0x2ffd, 0x0102030405060708);
+    assert(vm_get_memory64(vm, 0x2ffd) == 0x0102030405060708);
+    assert(vm_get_memory8(vm, 0x2fff) == 0x06);
+    assert(vm_get_memory32(vm, 0x3000) == 0x02030405);
+    assert(vm_fetch32(vm, 0x2ffe) == 0x04050607);
+
+    // Repeated accesses to the same page hit the TLB.
+    VMStats before, after;
+    vm_get_stats(vm, &before);
+    vm_set_memory8(vm, 0x1000, 1);
+    vm_set_memory8(vm, 0x1001, 2);
+    assert(vm_get_memory8(vm, 0x1000) == 1);
+    assert(vm_get_memory8(vm, 0x1001) == 2);
+    vm_get_stats(vm, &after);
+    assert(after.tlb_hits[VM_WRITE] - before.tlb_hits[VM_WRITE] >= 1);
+    assert(after.tlb_hits[VM_READ] - before.tlb_hits[VM_READ] >= 1);
+
+    // Flat mode behaves the same behind the vm_* API.
+    VirtualMemory* flat = vm_init_mode(VM_FLAT);
+    vm_set_memory64(flat, 0x8000000 - 4, 0x1122334455667788);
+    assert(vm_get_memory64(flat, 0x8000000 - 4) == 0x1122334455667788);
+    assert(vm_get_memory32(flat, 0x8000000) == 0x11223344);
+    vm_set_memory8(flat, 0xfffffffffffff000, 0x42);
+    assert(vm_get_memory8(flat, 0xfffffffffffff000) == 0x42);
+    // Loaders may still write to pages the guest cannot.
+    static uint8_t text[4096] = {1};
+    vm_map(flat, 0x10000, 4096, text, 4096, VM_PROT_READ | VM_PROT_EXEC);
+    vm_memcpy(flat, 0x10001, "\x90", 1);
+    assert(vm_get_memory16(flat, 0x10000) == 0x9001);
+    vm_destroy(flat);
+
+    // Pages spanning more than one arena chunk.
+    VirtualMemory* vm2 = vm_init_mode(VM_PAGED);
+    for (addr = 0; addr < 4096 * 300; addr += 4096) {
+        vm_set_memory64(vm2, addr, addr);
+    }
+    for (addr = 0; addr < 4096 * 300; addr += 4096) {
+        assert(vm_get_memory64(vm2, addr) == addr);
+    }
+    vm_destroy(vm2);
+
+    // Mapped pages are filled in on first touch and copied on first write.
+    static uint8_t image[4096 * 2 + 16];
+    for (int i = 0; i < sizeof(image); i++) {
+        image[i] = i & 0xFF;
+    }
+    VirtualMemory* vm3 = vm_init_mode(VM_PAGED);
+    vm_map(vm3, 0x400000, sizeof(image) + 4096, image, sizeof(image), VM_PROT_READ | VM_PROT_WRITE);
+    VMStats stats;
+    vm_get_stats(vm3, &stats);
+    assert(stats.num_pages == 0);
+    assert(vm_get_memory8(vm3, 0x400001) == 1);
+    assert(vm_get_memory8(vm3, 0x40200f) == 0x0f);
+    assert(vm_get_memory8(vm3, 0x402010) == 0);  // bss
+    assert(vm_get_memory8(vm3, 0x403000) == 0);  // bss
+    vm_set_memory8(vm3, 0x402020, 7);
+    assert(vm_get_memory8(vm3, 0x402020) == 7);
+    vm_set_memory8(vm3, 0x401000, 0xAA);
+    assert(vm_get_memory8(vm3, 0x401000) == 0xAA);
+    assert(image[4096] == 0);
+    vm_destroy(vm3);
+
+    // Untouched memory reads as zero without allocating a private page.
+    VirtualMemory* vm4 = vm_init_mode(VM_PAGED);
+    for (addr = 0x10000; addr < 0x20000; addr += 4096) {
+        assert(vm_get_memory64(vm4, addr) == 0);
+    }
+    vm_get_stats(vm4, &stats);
+    assert(stats.num_pages == 16 && stats.num_shared_pages == 16);
+    vm_set_memory8(vm4, 0x10008, 1);
+    assert(vm_get_memory64(vm4, 0x10008) == 1);
+    assert(vm_get_memory64(vm4, 0x11008) == 0);
+    vm_get_stats(vm4, &stats);
+    assert(stats.num_shared_pages == 15);
+    vm_destroy(vm4);
+
+    // Stores to a page that code was decoded from bump its write generation.
+    VirtualMemory* vm5 = vm_init_mode(VM_PAGED);
+    vm_map(vm5, 0x1000, 4096, image, 4096, VM_PROT_READ | VM_PROT_EXEC);
+    vm_set_memory8(vm5, 0x2000, 0x90);
+    uint32_t gen = vm_code_gen(vm5, 0x2000);
+    uint32_t epoch = vm_code_epoch(vm5);
+    assert(vm_code_gen(vm5, 0x2000) == gen);
+    vm_set_memory8(vm5, 0x3000, 0);
+    assert(vm_code_epoch(vm5) == epoch);
+    vm_set_memory8(vm5, 0x2800, 0);
+    assert(vm_code_gen(vm5, 0x2000) != gen);
+    assert(vm_code_epoch(vm5) != epoch);
+    assert(vm_fetch8(vm5, 0x1001) == 1);
+    gen = vm_code_gen(vm5, 0x1000);
+    vm_memcpy(vm5, 0x1000, "\x90", 1);
+    assert(vm_code_gen(vm5, 0x1000) != gen);
+    assert(vm_fetch8(vm5, 0x1000) == 0x90);
+    vm_destroy(vm5);
+
+    VirtualMemory* flat2 = vm_init_mode(VM_FLAT);
+    vm_set_memory8(flat2, 0x2000, 0x90);
+    gen = vm_code_gen(flat2, 0x2000);
+    epoch = vm_code_epoch(flat2);
+    assert(vm_code_gen(flat2, 0x2000) == gen);
+    vm_set_memory8(flat2, 0x2800, 0);
+    assert(vm_code_gen(flat2, 0x2000) != gen);
+    assert(vm_code_epoch(flat2) != epoch);
+    assert(vm_get_memory8(flat2, 0x2000) == 0x90);
+    vm_destroy(flat2);
+
+    // Restoring a snapshot only touches pages written or created since.
+    VirtualMemory* vm6 = vm_init_mode(VM_PAGED);
+    vm_map(vm6, 0x400000, 4096 * 2, image, 4096 * 2, VM_PROT_READ | VM_PROT_WRITE);
+    vm_set_memory64(vm6, 0x7000, 0x1234);
+    assert(vm_get_memory8(vm6, 0x400005) == 5);
+    vm_snapshot(vm6);
+    vm_get_stats(vm6, &stats);
+    uint64_t num_pages = stats.num_pages;
+    vm_set_memory64(vm6, 0x7000, 0x5678);
+    vm_set_memory8(vm6, 0x400005, 0xff);
+    vm_set_memory8(vm6, 0x900000, 0xff);
+    assert(vm_get_memory64(vm6, 0x7000) == 0x5678);
+    gen = vm_code_gen(vm6, 0x7000);
+    vm_restore(vm6);
+    assert(vm_code_gen(vm6, 0x7000) != gen);
+    assert(vm_get_memory64(vm6, 0x7000) == 0x1234);
+    assert(vm_get_memory8(vm6, 0x400005) == 5);
+    assert(image[5] == 5);
+    vm_get_stats(vm6, &stats);
+    assert(stats.num_pages == num_pages);
+    assert(vm_get_memory8(vm6, 0x900000) == 0);
+    for (int run = 0; run < 3; run++) {
+        vm_set_memory64(vm6, 0x7000, run);
+        vm_restore(vm6);
+        assert(vm_get_memory64(vm6, 0x7000) == 0x1234);
+    }
+    vm_set_memory64(vm6, 0x7000, 0x9abc);
+    vm_snapshot(vm6);
+    vm_set_memory64(vm6, 0x7000, 0);
+    vm_restore(vm6);
+    assert(vm_get_memory64(vm6, 0x7000) == 0x9abc);
+    // A second snapshot before any store keeps the buffer of the first, so
+    // that the snapshot after the next store frees it again.
+    vm_get_stats(vm6, &stats);
+    uint64_t num_buffers = stats.num_buffers;
+    for (int run = 0; run < 100; run++) {
+        vm_snapshot(vm6);
+        vm_snapshot(vm6);
+        vm_set_memory64(vm6, 0x7000, run);
+    }
+    vm_snapshot(vm6);
+    vm_get_stats(vm6, &stats);
+    assert(stats.num_buffers <= num_buffers + 1);
+    assert(vm_get_memory64(vm6, 0x7000) == 99);
+    vm_destroy(vm6);
+
+    // The dirty bitmap records pages written since it was cleared.
+    VirtualMemory* vm7 = vm_init_mode(VM_PAGED);
+    uint64_t dirty[8];
+    vm_set_memory8(vm7, 0x5000, 1);
+    assert(vm_dirty_pages(vm7, dirty, 8) == 1 && dirty[0] == 0x5000);
+    vm_dirty_clear(vm7);
+    assert(vm_dirty_pages(vm7, dirty, 8) == 0);
+    assert(vm_get_memory8(vm7, 0x5000) == 1);
+    assert(vm_get_memory8(vm7, 0x6000) == 0);
+    assert(vm_dirty_pages(vm7, dirty, 8) == 0);
+    vm_set_memory8(vm7, 0x5001, 2);
+    vm_set_memory8(vm7, 0x5002, 3);
+    vm_set_memory64(vm7, 0x7ffffff8, 4);
+    vm_set_memory8(vm7, 0xffffffffffffe000, 5);
+    assert(vm_dirty_pages(vm7, dirty, 2) == 3);
+    assert(vm_dirty_pages(vm7, dirty, 8) == 3);
+    int found = 0;
+    for (int i = 0; i < 3; i++) {
+        found |= (dirty[i] == 0x5000) << 0;
+        found |= (dirty[i] == 0x7ffff000) << 1;
+        found |= (dirty[i] == 0xffffffffffffe000) << 2;
+    }
+    assert(found == 7);
+    vm_dirty_clear(vm7);
+    vm_snapshot(vm7);
+    vm_set_memory8(vm7, 0x5000, 6);
+    vm_set_memory8(vm7, 0x9000, 7);
+    vm_restore(vm7);
+    assert(vm_dirty_pages(vm7, dirty, 8) == 1 && dirty[0] == 0x5000);
+    vm_destroy(vm7);
+
+    vm_destroy(vm);
     return 0;
 }
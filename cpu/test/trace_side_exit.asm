@@ -0,0 +1,19 @@
+BITS 64
+  org 0x7c00
+start:
+  mov ecx, 0
+  mov edx, 0
+  jmp loop
+loop:
+  add ecx, 1        ; the trace starts here, as this block gets hot first
+  cmp ecx, 20
+  ja high           ; not taken while the trace is built, a side exit later
+  add edx, 1
+  jmp next
+high:
+  add edx, 3
+next:
+  cmp ecx, 40
+  jne loop
+  mov eax, edx
+  jmp 0
@@ -19,6 +19,19 @@ check_asm_test() {
   fi
 }
 
+# Checks that the statistics of the last check_asm_test, which must have
+# run with -s, have a line matching pattern.
+check_stats() {
+  local pattern="$1"
+
+  if grep -q -E "$pattern" $log; then
+    echo "[passed] $pattern"
+  else
+    echo "[failed] no line matches \"$pattern\""
+    cat $log
+  fi
+}
+
 run_c_test() {
   local c_file="$1"
   gcc -g $c_file virtual_memory.o -o $output
@@ -35,6 +48,67 @@ run_c_test() {
 # hello.asm
 check_asm_test "test/hello.bin" 20
 
+# self_modify.asm: rewrites an instruction after it has been decoded
+check_asm_test "test/self_modify.bin" 7
+
+# self_modify_loop.asm: rewrites a block that others are linked to
+check_asm_test "test/self_modify_loop.bin" 150
+
+# flags_liveness.asm: flag setters whose flags are dead next to ones that are not
+check_asm_test "test/flags_liveness.bin" 180
+
+# carry_overflow.asm: CF and OF at the edges of 8-, 32- and 64-bit operands
+check_asm_test "test/carry_overflow.bin" 48
+
+# superinstructions.asm: each sequence that runs as a superinstruction
+emulator="./cpu -q -s"
+check_asm_test "test/superinstructions.bin" 110
+check_stats "dispatches saved = 600$"
+emulator="./cpu"
+
+# bulk_memory.asm: string instructions and loops that run as bulk copies and fills
+check_asm_test "test/bulk_memory.bin" 202
+
+# addressing.asm: SIB, rip-relative and 64-bit memory operands
+check_asm_test "test/addressing.bin" 168
+
+# trace_side_exit.asm: a branch in a trace that changes direction after
+# the trace is built, and leaves it through a side exit 20 times
+emulator="./cpu -q -s"
+check_asm_test "test/trace_side_exit.bin" 80
+check_stats "side exits = 20 "
+emulator="./cpu"
+
+# The same programs with each block translated by the JIT after its first
+# run. --jit-sync waits for each translation, so the host code always runs.
+emulator="./cpu --jit --jit-threshold 1 --jit-sync"
+check_asm_test "test/self_modify.bin" 7
+check_asm_test "test/self_modify_loop.bin" 150
+check_asm_test "test/flags_liveness.bin" 180
+check_asm_test "test/carry_overflow.bin" 48
+check_asm_test "test/superinstructions.bin" 110
+check_asm_test "test/bulk_memory.bin" 202
+check_asm_test "test/addressing.bin" 168
+# With the default threshold, so that the trace is built before it is translated
+emulator="./cpu --jit --jit-sync"
+check_asm_test "test/trace_side_exit.bin" 80
+emulator="./cpu"
+
+# superinstructions.asm twice over a disk cache, the second time from the
+# blocks that the first run saved
+disk_cache="test/disk_cache.tmp"
+rm -f $disk_cache
+emulator="./cpu -q -s --disk-cache $disk_cache"
+check_asm_test "test/superinstructions.bin" 110
+check_asm_test "test/superinstructions.bin" 110
+check_stats "disk cache: entries = [0-9]+, loaded = [1-9][0-9]*, stale = 0$"
+# flags_liveness.asm over the same file. Its code is where the saved blocks
+# were, so their entries are stale and it runs its own.
+check_asm_test "test/flags_liveness.bin" 180
+check_stats "disk cache: entries = [0-9]+, loaded = 0, stale = [1-9][0-9]*$"
+emulator="./cpu"
+rm -f $disk_cache
+
 # test_virtual_memory.c
 run_c_test test/test_virtual_memory.c
 
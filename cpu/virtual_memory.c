@@ -1,53 +1,850 @@
+#define _DEFAULT_SOURCE  // MAP_ANONYMOUS, MAP_NORESERVE and siginfo_t
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "virtual_memory.h"
 
-#define PAGE_SIZE 4096
-#define MAX_PAGES 1024
+#define PAGE_SIZE VM_PAGE_SIZE
+#define PAGE_SHIFT 12
+
+// Guest addresses are translated by a 4-level radix table like x86-64 paging.
+// Each level consumes 9 bits of the virtual page number, so the table covers
+// the 48-bit canonical address space (9 * 4 + 12 = 48 bits).
+#define PT_LEVELS 4
+#define PT_BITS 9
+#define PT_ENTRIES (1 << PT_BITS)
+#define VADDR_BITS 48
+#define VADDR_MASK ((1ULL << VADDR_BITS) - 1)
+
+// Direct-mapped software TLB indexed by the low bits of the virtual page number.
+#define TLB_BITS 8
+#define TLB_ENTRIES (1 << TLB_BITS)
+// Virtual page numbers are at most 52 bits, so this tag never matches.
+#define TLB_INVALID_TAG UINT64_MAX
+
+// Flat mode reserves one contiguous host range for the low part of the guest
+// address space, so that a guest address is just `base + addr`. The range is
+// reserved with PROT_NONE and committed in FLAT_COMMIT_SIZE chunks from the
+// SIGSEGV handler on first touch. Adjacent chunks end up with the same
+// protection, so the kernel merges them instead of creating a mapping per page.
+// Addresses beyond the reservation still go through the page table.
+#define FLAT_RESERVE_SIZE (1ULL << 36)  // 64GB
+#define FLAT_COMMIT_SIZE (16 * PAGE_SIZE)
+// Slack after the reservation so that a word access starting right below
+// FLAT_RESERVE_SIZE stays inside the host mapping.
+#define FLAT_SLACK_SIZE FLAT_COMMIT_SIZE
+#define MAX_FLAT_REGIONS 16
+
+// Per-page state of the flat region, kept in a side array indexed by page.
+#define FLAT_COMMITTED 0x01
+#define FLAT_READONLY 0x02   // mapped by vm_map() without VM_PROT_WRITE
+#define FLAT_WRITABLE 0x04   // mapped by vm_map() with VM_PROT_WRITE
+#define FLAT_CODE 0x08       // write protected by vm_code_gen()
 
 typedef struct {
+    uint8_t* base;
+    uint64_t size;  // including FLAT_SLACK_SIZE
+    volatile uint64_t committed;  // in pages
+    uint8_t* page_flags;
+    uint32_t* page_gen;
+    volatile uint32_t code_epoch;  // see vm_code_epoch()
+} FlatRegion;
+
+// Page buffers and Page records are carved out of large chunks instead of
+// two mallocs per page.
+#define ARENA_CHUNK_PAGES 256  // 1MB of guest memory per chunk
+
+// The buffer is shared (the zero page or the mmap-ed ELF file) and must be
+// copied before the first write.
+#define PAGE_COW 0x01
+// Someone cached code decoded from this page (see vm_code_gen). The page is
+// kept out of the write TLB so that the next store bumps write_gen.
+#define PAGE_CODE 0x02
+// The page existed when vm_snapshot() was taken, and snap_buffer holds its
+// contents at that time. PAGE_SNAP_OWNED means snap_buffer is an arena
+// buffer that belongs to the snapshot rather than the zero page or the file.
+#define PAGE_SNAP 0x04
+#define PAGE_SNAP_OWNED 0x08
+// Written since the snapshot, and linked on the dirty list.
+#define PAGE_DIRTY 0x10
+
+typedef struct Page_t {
     uint64_t offset;
     uint8_t* buffer;
+    uint8_t flags;
+    uint8_t prot;  // VM_PROT_*
+    uint32_t write_gen;
+    uint8_t* snap_buffer;
+    // Links the dirty list, the list of pages created since the snapshot,
+    // or the free list.
+    struct Page_t* next;
 } Page;
 
+typedef struct ArenaChunk_t {
+    struct ArenaChunk_t* next;
+    uint8_t* buffers;  // ARENA_CHUNK_PAGES page-aligned buffers
+    int used;
+} ArenaChunk;
+
+typedef struct PageChunk_t {
+    struct PageChunk_t* next;
+    int used;
+    Page pages[ARENA_CHUNK_PAGES];
+} PageChunk;
+
+// A range registered by vm_map(). Its pages are filled in on first touch.
+typedef struct {
+    uint64_t start;  // masked by VADDR_MASK
+    uint64_t memsz;
+    uint8_t* src;
+    uint64_t filesz;
+    int prot;
+} Mapping;
+
+// Host memory owned by VirtualMemory, released by vm_destroy().
+typedef struct {
+    void* addr;
+    size_t len;
+} HostMapping;
+
+typedef struct {
+    uint64_t tag;  // vmaddr >> PAGE_SHIFT
+    uint8_t* buffer;
+} TLBEntry;
+
+// Inner tables point to the next level, and the last level is a LeafTable.
+typedef struct {
+    void* entries[PT_ENTRIES];
+} PageTable;
+
+// Leaf tables point to Page and also keep the dirty bitmap for those pages.
+// A bit is set whenever a page is made writable for a store (a write TLB
+// miss or a loader write), so stores that hit the TLB pay nothing.
+// vm_dirty_clear() flushes the write TLB to start over.
+typedef struct LeafTable_t {
+    Page* entries[PT_ENTRIES];
+    uint64_t dirty[PT_ENTRIES / 64];
+    // Leaf tables with any dirty bit set are linked from the VirtualMemory.
+    struct LeafTable_t* next_dirty;
+    int on_dirty_list;
+} LeafTable;
+
 struct VirtualMemory_t {
-    // The size of page table is 16MB to allocate 8GB virtual memory,
-    // if page size is 4096 bytes.
-    Page* pages[MAX_PAGES];
+    // Guest addresses below flat_size are served by the flat region.
+    // flat_size is 0 in paged mode, so the check is a single compare.
+    uint8_t* flat_base;
+    uint64_t flat_size;
+    FlatRegion flat;
+
+    PageTable* root;
     uint64_t num_pages;
+    uint64_t num_shared_pages;
+    uint64_t num_buffers;
+    ArenaChunk* arena;
+    PageChunk* page_chunks;
+    uint8_t* free_buffers;  // linked through the first bytes of each buffer
+    Page* free_pages;
+    // Source of write generations. Every bump takes a fresh value, so a page
+    // that is dropped and faulted in again never repeats an old generation.
+    uint32_t gen_clock;
+    // Bumped together with the write_gen of any PAGE_CODE page.
+    uint32_t code_epoch;
+
+    int has_snapshot;
+    Page* dirty_pages;
+    Page* new_pages;
+    LeafTable* dirty_leaves;
+
+    Mapping* mappings;
+    int num_mappings;
+    HostMapping* host_mappings;
+    int num_host_mappings;
+
+    // Reads, writes and instruction fetches have their own entries so that
+    // a store does not evict the code page the emulator is executing.
+    TLBEntry tlb[VM_ACCESS_COUNT][TLB_ENTRIES];
+    VMStats stats;
 };
 
+static int default_mode = VM_PAGED;
+static FlatRegion* flat_regions[MAX_FLAT_REGIONS];
+
+static void flat_fault_handler(int sig, siginfo_t* info, void* context) {
+    uint8_t* addr = info->si_addr;
+    int i;
+    for (i = 0; i < MAX_FLAT_REGIONS; i++) {
+        FlatRegion* region = flat_regions[i];
+        if (region == NULL || addr < region->base || addr >= region->base + region->size) {
+            continue;
+        }
+        uint64_t page = (addr - region->base) >> PAGE_SHIFT;
+        uint8_t flags = region->page_flags[page];
+        if (!(flags & FLAT_COMMITTED)) {
+            uint64_t first = page & ~(uint64_t) (FLAT_COMMIT_SIZE / PAGE_SIZE - 1);
+            if (mprotect(region->base + first * PAGE_SIZE, FLAT_COMMIT_SIZE, PROT_READ | PROT_WRITE) != 0) {
+                break;
+            }
+            memset(region->page_flags + first, FLAT_COMMITTED, FLAT_COMMIT_SIZE / PAGE_SIZE);
+            region->committed += FLAT_COMMIT_SIZE / PAGE_SIZE;
+            return;
+        }
+        if (flags & FLAT_READONLY) {
+            static const char msg[] = "Virtual Memory: write to read-only page\n";
+            write(STDERR_FILENO, msg, sizeof(msg) - 1);
+            _exit(1);
+        }
+        if (flags & FLAT_CODE) {
+            // A store to a page holding cached code.
+            region->page_gen[page]++;
+            region->code_epoch++;
+            region->page_flags[page] &= ~FLAT_CODE;
+            if (mprotect(region->base + page * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE) == 0) {
+                return;
+            }
+        }
+        break;
+    }
+    // Not a guest memory access. Fall back to the default action, which
+    // kills the process when the faulting instruction is restarted.
+    signal(sig, SIG_DFL);
+}
+
+static int flat_reserve(VirtualMemory* vm) {
+    int i;
+    for (i = 0; i < MAX_FLAT_REGIONS; i++) {
+        if (flat_regions[i] == NULL) {
+            break;
+        }
+    }
+    if (i == MAX_FLAT_REGIONS) {
+        return 0;
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#endif
+    uint64_t size = FLAT_RESERVE_SIZE + FLAT_SLACK_SIZE;
+    uint64_t num_pages = size / PAGE_SIZE;
+    void* base = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+    void* page_flags = mmap(NULL, num_pages, PROT_READ | PROT_WRITE, flags, -1, 0);
+    void* page_gen = mmap(NULL, num_pages * sizeof(uint32_t), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (base == MAP_FAILED || page_flags == MAP_FAILED || page_gen == MAP_FAILED) {
+        if (base != MAP_FAILED) munmap(base, size);
+        if (page_flags != MAP_FAILED) munmap(page_flags, num_pages);
+        if (page_gen != MAP_FAILED) munmap(page_gen, num_pages * sizeof(uint32_t));
+        return 0;
+    }
+
+    static int handler_installed = 0;
+    if (!handler_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = flat_fault_handler;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, NULL);
+        sigaction(SIGBUS, &sa, NULL);  // macOS reports PROT_NONE faults as SIGBUS
+        handler_installed = 1;
+    }
+
+    vm->flat.base = base;
+    vm->flat.size = size;
+    vm->flat.committed = 0;
+    vm->flat.page_flags = page_flags;
+    vm->flat.page_gen = page_gen;
+    flat_regions[i] = &vm->flat;
+    vm->flat_base = base;
+    vm->flat_size = FLAT_RESERVE_SIZE;
+    return 1;
+}
+
+void vm_set_default_mode(int mode) {
+    default_mode = mode;
+}
+
 VirtualMemory* vm_init() {
+    return vm_init_mode(default_mode);
+}
+
+VirtualMemory* vm_init_mode(int mode) {
     VirtualMemory* vm = malloc(sizeof(VirtualMemory));
-    for (int i = 0; i<MAX_PAGES; i++) {
-        vm->pages[i] = NULL;
-    }
+    vm->flat_base = NULL;
+    vm->flat_size = 0;
+    memset(&vm->flat, 0, sizeof(FlatRegion));
+    vm->root = calloc(1, sizeof(PageTable));
     vm->num_pages = 0;
+    vm->num_shared_pages = 0;
+    vm->num_buffers = 0;
+    vm->arena = NULL;
+    vm->page_chunks = NULL;
+    vm->free_buffers = NULL;
+    vm->free_pages = NULL;
+    vm->gen_clock = 0;
+    vm->code_epoch = 0;
+    vm->has_snapshot = 0;
+    vm->dirty_pages = NULL;
+    vm->new_pages = NULL;
+    vm->dirty_leaves = NULL;
+    vm->mappings = NULL;
+    vm->num_mappings = 0;
+    vm->host_mappings = NULL;
+    vm->num_host_mappings = 0;
+    vm_tlb_flush(vm);
+    memset(&vm->stats, 0, sizeof(VMStats));
+
+    if (mode == VM_FLAT && !flat_reserve(vm)) {
+        fprintf(stderr, "Virtual Memory: cannot reserve flat address space, using paged mode.\n");
+    }
     return vm;
 }
 
-Page* get_page(VirtualMemory* vm, uint32_t vmaddr) {
-    uint64_t offset = vmaddr / PAGE_SIZE;
-    // Find page
-    for (int i=0; i<vm->num_pages; i++) {
-        if (offset == vm->pages[i]->offset) {
-            return vm->pages[i];
+static void free_page_table(PageTable* table, int level) {
+    int i;
+    if (level > 0) {
+        for (i = 0; i < PT_ENTRIES; i++) {
+            if (table->entries[i] != NULL) {
+                free_page_table(table->entries[i], level - 1);
+            }
+        }
+    }
+    // Leaf entries point into arena chunks, which are released separately.
+    free(table);
+}
+
+void vm_destroy(VirtualMemory* vm) {
+    int i;
+    free_page_table(vm->root, PT_LEVELS - 1);
+
+    ArenaChunk* chunk = vm->arena;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        free(chunk->buffers);
+        free(chunk);
+        chunk = next;
+    }
+    PageChunk* page_chunk = vm->page_chunks;
+    while (page_chunk != NULL) {
+        PageChunk* next = page_chunk->next;
+        free(page_chunk);
+        page_chunk = next;
+    }
+
+    for (i = 0; i < vm->num_host_mappings; i++) {
+        munmap(vm->host_mappings[i].addr, vm->host_mappings[i].len);
+    }
+    free(vm->host_mappings);
+    free(vm->mappings);
+
+    if (vm->flat_base != NULL) {
+        for (i = 0; i < MAX_FLAT_REGIONS; i++) {
+            if (flat_regions[i] == &vm->flat) {
+                flat_regions[i] = NULL;
+            }
+        }
+        uint64_t num_pages = vm->flat.size / PAGE_SIZE;
+        munmap(vm->flat.base, vm->flat.size);
+        munmap(vm->flat.page_flags, num_pages);
+        munmap(vm->flat.page_gen, num_pages * sizeof(uint32_t));
+    }
+    free(vm);
+}
+
+void vm_tlb_flush(VirtualMemory* vm) {
+    int i, j;
+    for (i = 0; i < VM_ACCESS_COUNT; i++) {
+        for (j = 0; j < TLB_ENTRIES; j++) {
+            vm->tlb[i][j].tag = TLB_INVALID_TAG;
+            vm->tlb[i][j].buffer = NULL;
+        }
+    }
+}
+
+void vm_get_stats(VirtualMemory* vm, VMStats* stats) {
+    *stats = vm->stats;
+    stats->num_pages = vm->num_pages + vm->flat.committed;
+    stats->num_shared_pages = vm->num_shared_pages;
+    stats->num_buffers = vm->num_buffers;
+}
+
+static int is_canonical(uint64_t vmaddr) {
+    // Bits 63 through 47 must be all zeros or all ones.
+    uint64_t upper = vmaddr >> (VADDR_BITS - 1);
+    return upper == 0 || upper == (UINT64_MAX >> (VADDR_BITS - 1));
+}
+
+static uint8_t* arena_alloc_buffer(VirtualMemory* vm) {
+    vm->num_buffers++;
+    if (vm->free_buffers != NULL) {
+        uint8_t* buffer = vm->free_buffers;
+        memcpy(&vm->free_buffers, buffer, sizeof(uint8_t*));
+        return buffer;
+    }
+    ArenaChunk* chunk = vm->arena;
+    if (chunk == NULL || chunk->used == ARENA_CHUNK_PAGES) {
+        chunk = malloc(sizeof(ArenaChunk));
+        chunk->buffers = aligned_alloc(PAGE_SIZE, ARENA_CHUNK_PAGES * PAGE_SIZE);
+        if (chunk->buffers == NULL) {
+            fprintf(stderr, "Virtual Memory: out of memory\n");
+            exit(1);
         }
+        chunk->used = 0;
+        chunk->next = vm->arena;
+        vm->arena = chunk;
+    }
+    return chunk->buffers + (uint64_t) PAGE_SIZE * chunk->used++;
+}
+
+static void arena_free_buffer(VirtualMemory* vm, uint8_t* buffer) {
+    vm->num_buffers--;
+    memcpy(buffer, &vm->free_buffers, sizeof(uint8_t*));
+    vm->free_buffers = buffer;
+}
+
+static Page* arena_alloc_page(VirtualMemory* vm) {
+    Page* page;
+    if (vm->free_pages != NULL) {
+        page = vm->free_pages;
+        vm->free_pages = page->next;
+    } else {
+        PageChunk* chunk = vm->page_chunks;
+        if (chunk == NULL || chunk->used == ARENA_CHUNK_PAGES) {
+            chunk = malloc(sizeof(PageChunk));
+            chunk->used = 0;
+            chunk->next = vm->page_chunks;
+            vm->page_chunks = chunk;
+        }
+        page = &chunk->pages[chunk->used++];
+    }
+    page->buffer = NULL;
+    page->flags = 0;
+    page->prot = VM_PROT_ALL;
+    page->write_gen = ++vm->gen_clock;
+    page->snap_buffer = NULL;
+    page->next = NULL;
+    return page;
+}
+
+static void arena_free_page(VirtualMemory* vm, Page* page) {
+    page->next = vm->free_pages;
+    vm->free_pages = page;
+}
+
+static void flat_map(VirtualMemory* vm, uint64_t vmaddr, uint64_t memsz, void* src, uint64_t filesz, int prot) {
+    // The flat region is one host mapping, so the image is copied eagerly.
+    // Touching the range also commits it before the protection changes.
+    memcpy(vm->flat_base + vmaddr, src, filesz);
+    memset(vm->flat_base + vmaddr + filesz, 0, memsz - filesz);
+
+    // Only W is enforced in flat mode. A page shared with a writable
+    // mapping stays writable.
+    uint64_t page;
+    for (page = vmaddr >> PAGE_SHIFT; page < (vmaddr + memsz + PAGE_SIZE - 1) >> PAGE_SHIFT; page++) {
+        uint8_t* flags = &vm->flat.page_flags[page];
+        if (prot & VM_PROT_WRITE) {
+            *flags = (*flags & ~FLAT_READONLY) | FLAT_WRITABLE;
+            mprotect(vm->flat_base + page * PAGE_SIZE, PAGE_SIZE, PROT_READ | PROT_WRITE);
+        } else if (!(*flags & FLAT_WRITABLE)) {
+            *flags |= FLAT_READONLY;
+            mprotect(vm->flat_base + page * PAGE_SIZE, PAGE_SIZE, PROT_READ);
+        }
+    }
+}
+
+// Loader writes are not checked, so the read-only pages of the range are
+// made writable around them. Pass restore = 1 to protect them again.
+static void flat_loader_write(VirtualMemory* vm, uint64_t vmaddr, size_t size, int restore) {
+    uint64_t page;
+    for (page = vmaddr >> PAGE_SHIFT; page < (vmaddr + size + PAGE_SIZE - 1) >> PAGE_SHIFT; page++) {
+        if (vm->flat.page_flags[page] & FLAT_READONLY) {
+            mprotect(vm->flat_base + page * PAGE_SIZE, PAGE_SIZE, restore ? PROT_READ : PROT_READ | PROT_WRITE);
+        }
+    }
+}
+
+void vm_map(VirtualMemory* vm, uint64_t vmaddr, uint64_t memsz, void* src, uint64_t filesz, int prot) {
+    if (vmaddr + memsz <= vm->flat_size) {
+        flat_map(vm, vmaddr, memsz, src, filesz, prot);
+        return;
+    }
+    vm->mappings = realloc(vm->mappings, sizeof(Mapping) * (vm->num_mappings + 1));
+    Mapping* m = &vm->mappings[vm->num_mappings++];
+    m->start = vmaddr & VADDR_MASK;
+    m->memsz = memsz;
+    m->src = src;
+    m->filesz = filesz;
+    m->prot = prot;
+}
+
+void vm_adopt_mmap(VirtualMemory* vm, void* addr, size_t len) {
+    vm->host_mappings = realloc(vm->host_mappings, sizeof(HostMapping) * (vm->num_host_mappings + 1));
+    vm->host_mappings[vm->num_host_mappings].addr = addr;
+    vm->host_mappings[vm->num_host_mappings].len = len;
+    vm->num_host_mappings++;
+}
+
+// Backs every page that has not been written yet and holds no file data:
+// untouched memory, the stack before it is used, and pages entirely in .bss.
+// It lives in .rodata, and writes go through the copy-on-write path.
+static const _Alignas(PAGE_SIZE) uint8_t zero_page[PAGE_SIZE];
+
+// Sets up the buffer of a page touched for the first time. Its protection
+// is the union of the mappings covering it, or VM_PROT_ALL for memory nobody
+// mapped (the stack, or code loaded with vm_fread). A page with no
+// file data maps the shared zero page. A page lying entirely inside the file
+// part of a single mapping points straight into the file. Both are copied on
+// the first write. Other pages get a private copy whose bss tail is cleared.
+static void fill_page(VirtualMemory* vm, Page* page) {
+    uint64_t page_start = page->offset << PAGE_SHIFT;
+    uint64_t page_end = page_start + PAGE_SIZE;
+    Mapping* sole = NULL;
+    int i, overlaps = 0, file_overlaps = 0;
+    for (i = 0; i < vm->num_mappings; i++) {
+        Mapping* m = &vm->mappings[i];
+        if (m->start < page_end && page_start < m->start + m->memsz) {
+            page->prot = overlaps == 0 ? m->prot : (page->prot | m->prot);
+            sole = m;
+            overlaps++;
+            if (page_start < m->start + m->filesz) {
+                file_overlaps++;
+            }
+        }
+    }
+
+    page->flags |= PAGE_COW;
+    vm->num_shared_pages++;
+    if (file_overlaps == 0) {
+        page->buffer = (uint8_t*) zero_page;
+        return;
+    }
+    if (overlaps == 1 && sole->start <= page_start && page_end <= sole->start + sole->filesz) {
+        page->buffer = sole->src + (page_start - sole->start);
+        return;
+    }
+    page->flags &= ~PAGE_COW;
+    vm->num_shared_pages--;
+
+    page->buffer = arena_alloc_buffer(vm);
+    memset(page->buffer, 0, PAGE_SIZE);
+    for (i = 0; i < vm->num_mappings; i++) {
+        Mapping* m = &vm->mappings[i];
+        uint64_t file_end = m->start + m->filesz;
+        uint64_t from = m->start > page_start ? m->start : page_start;
+        uint64_t to = file_end < page_end ? file_end : page_end;
+        if (from < to) {
+            memcpy(page->buffer + (from - page_start), m->src + (from - m->start), to - from);
+        }
+    }
+}
+
+// Returns the leaf table covering the page number, or NULL if it does not
+// exist and create is false.
+static LeafTable* get_leaf_table(VirtualMemory* vm, uint64_t offset, int create) {
+    PageTable* table = vm->root;
+    int level;
+    for (level = PT_LEVELS - 1; level > 0; level--) {
+        int index = (offset >> (level * PT_BITS)) & (PT_ENTRIES - 1);
+        if (table->entries[index] == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            table->entries[index] = calloc(1, level == 1 ? sizeof(LeafTable) : sizeof(PageTable));
+        }
+        table = table->entries[index];
+    }
+    return (LeafTable*) table;
+}
+
+Page* get_page(VirtualMemory* vm, uint64_t vmaddr) {
+    if (!is_canonical(vmaddr)) {
+        fprintf(stderr, "Virtual Memory: non-canonical address 0x%016llx\n", (unsigned long long) vmaddr);
+        exit(1);
+    }
+    // Canonical addresses are mapped one-to-one into the lower 48 bits.
+    uint64_t offset = (vmaddr & VADDR_MASK) >> PAGE_SHIFT;
+    LeafTable* table = get_leaf_table(vm, offset, 1);
+
+    int index = offset & (PT_ENTRIES - 1);
+    Page* page = table->entries[index];
+    if (page != NULL) {
+        return page;
+    }
+    // Page fault. Allocate memory buffer.
+    page = arena_alloc_page(vm);
+    page->offset = offset;
+    fill_page(vm, page);
+    table->entries[index] = page;
+    vm->num_pages++;
+    if (vm->has_snapshot) {
+        // Dropped again by vm_restore().
+        page->next = vm->new_pages;
+        vm->new_pages = page;
+    }
+    return page;
+}
+
+// Drops cached translations of the page from every TLB. The index only
+// depends on the low bits of the page number, which masking does not change.
+static void tlb_invalidate(VirtualMemory* vm, Page* page) {
+    int i;
+    for (i = 0; i < VM_ACCESS_COUNT; i++) {
+        TLBEntry* entry = &vm->tlb[i][page->offset & (TLB_ENTRIES - 1)];
+        entry->tag = TLB_INVALID_TAG;
+        entry->buffer = NULL;
+    }
+}
+
+static void mark_dirty(VirtualMemory* vm, Page* page) {
+    LeafTable* leaf = get_leaf_table(vm, page->offset, 0);
+    int index = page->offset & (PT_ENTRIES - 1);
+    leaf->dirty[index / 64] |= 1ULL << (index % 64);
+    if (!leaf->on_dirty_list) {
+        leaf->on_dirty_list = 1;
+        leaf->next_dirty = vm->dirty_leaves;
+        vm->dirty_leaves = leaf;
+    }
+}
+
+static Page* get_writable_page(VirtualMemory* vm, uint64_t vmaddr) {
+    Page* page = get_page(vm, vmaddr);
+    mark_dirty(vm, page);
+    if (page->flags & PAGE_COW) {
+        uint8_t* buffer = arena_alloc_buffer(vm);
+        memcpy(buffer, page->buffer, PAGE_SIZE);
+        page->buffer = buffer;
+        page->flags &= ~PAGE_COW;
+        vm->num_shared_pages--;
+        tlb_invalidate(vm, page);
+        if ((page->flags & PAGE_SNAP) && !(page->flags & PAGE_DIRTY)) {
+            page->flags |= PAGE_DIRTY;
+            page->next = vm->dirty_pages;
+            vm->dirty_pages = page;
+        }
+    }
+    if (page->flags & PAGE_CODE) {
+        // Cached code on this page may be stale from now on. The page can go
+        // back into the write TLB until someone decodes from it again.
+        page->write_gen = ++vm->gen_clock;
+        page->flags &= ~PAGE_CODE;
+        vm->code_epoch++;
+    }
+    return page;
+}
+
+static const int access_prot[VM_ACCESS_COUNT] = {VM_PROT_READ, VM_PROT_WRITE, VM_PROT_EXEC};
+
+// Returns the host buffer of the page containing vmaddr.
+static uint8_t* tlb_lookup(VirtualMemory* vm, int access, uint64_t vmaddr) {
+    static const char* access_name[VM_ACCESS_COUNT] = {"read", "write", "fetch"};
+    uint64_t tag = vmaddr >> PAGE_SHIFT;
+    TLBEntry* entry = &vm->tlb[access][tag & (TLB_ENTRIES - 1)];
+    if (entry->tag == tag) {
+        vm->stats.tlb_hits[access]++;
+        return entry->buffer;
+    }
+    vm->stats.tlb_misses[access]++;
+    Page* page = get_page(vm, vmaddr);
+    if (!(page->prot & access_prot[access])) {
+        fprintf(stderr, "Virtual Memory: %s access violation at 0x%016llx\n",
+                access_name[access], (unsigned long long) vmaddr);
+        exit(1);
+    }
+    if (access == VM_WRITE) {
+        page = get_writable_page(vm, vmaddr);
+    }
+    entry->tag = tag;
+    entry->buffer = page->buffer;
+    return page->buffer;
+}
+
+uint32_t vm_code_gen(VirtualMemory* vm, uint64_t vmaddr) {
+    if (vmaddr < vm->flat_size) {
+        uint64_t page = vmaddr >> PAGE_SHIFT;
+        uint8_t* flags = &vm->flat.page_flags[page];
+        if (!(*flags & (FLAT_CODE | FLAT_READONLY))) {
+            // Commit the page first so that the next fault means a store.
+            volatile uint8_t touch = vm->flat_base[vmaddr];
+            (void) touch;
+            mprotect(vm->flat_base + page * PAGE_SIZE, PAGE_SIZE, PROT_READ);
+            *flags |= FLAT_CODE;
+        }
+        return vm->flat.page_gen[page];
+    }
+    Page* page = get_page(vm, vmaddr);
+    if (!(page->flags & PAGE_CODE)) {
+        page->flags |= PAGE_CODE;
+        TLBEntry* entry = &vm->tlb[VM_WRITE][page->offset & (TLB_ENTRIES - 1)];
+        entry->tag = TLB_INVALID_TAG;
+        entry->buffer = NULL;
+    }
+    return page->write_gen;
+}
+
+uint32_t vm_code_epoch(VirtualMemory* vm) {
+    return vm->code_epoch + vm->flat.code_epoch;
+}
+
+static void snapshot_table(VirtualMemory* vm, void* table, int level) {
+    int i;
+    for (i = 0; i < PT_ENTRIES; i++) {
+        if (level > 0) {
+            PageTable* inner = table;
+            if (inner->entries[i] != NULL) {
+                snapshot_table(vm, inner->entries[i], level - 1);
+            }
+            continue;
+        }
+        Page* page = ((LeafTable*) table)->entries[i];
+        if (page == NULL) {
+            continue;
+        }
+        if (page->snap_buffer != page->buffer) {
+            // Contents saved by the previous snapshot are not needed anymore.
+            if (page->flags & PAGE_SNAP_OWNED) {
+                arena_free_buffer(vm, page->snap_buffer);
+            }
+            page->flags &= ~PAGE_SNAP_OWNED;
+        }
+        // Otherwise the page was not written since, and the snapshot keeps
+        // the buffer it already owned.
+        page->flags &= ~PAGE_DIRTY;
+        page->flags |= PAGE_SNAP;
+        page->snap_buffer = page->buffer;
+        if (!(page->flags & PAGE_COW)) {
+            // The current buffer now belongs to the snapshot. The next store
+            // copies it just like a file-backed page.
+            page->flags |= PAGE_COW | PAGE_SNAP_OWNED;
+            vm->num_shared_pages++;
+        }
+        page->next = NULL;
+    }
+}
+
+static void require_paged_mode(VirtualMemory* vm, const char* feature) {
+    if (vm->flat_base != NULL) {
+        fprintf(stderr, "Virtual Memory: %s is not supported in flat mode.\n", feature);
+        exit(1);
+    }
+}
+
+void vm_snapshot(VirtualMemory* vm) {
+    require_paged_mode(vm, "snapshot");
+    snapshot_table(vm, vm->root, PT_LEVELS - 1);
+    vm->has_snapshot = 1;
+    vm->dirty_pages = NULL;
+    vm->new_pages = NULL;
+    // Pages that were writable are copy-on-write now.
+    vm_tlb_flush(vm);
+}
+
+void vm_restore(VirtualMemory* vm) {
+    require_paged_mode(vm, "snapshot");
+    if (!vm->has_snapshot) {
+        fprintf(stderr, "Virtual Memory: no snapshot to restore.\n");
+        exit(1);
+    }
+    Page* page = vm->dirty_pages;
+    while (page != NULL) {
+        Page* next = page->next;
+        // A dirty page always has a private copy, which is discarded.
+        arena_free_buffer(vm, page->buffer);
+        if (page->flags & PAGE_CODE) {
+            vm->code_epoch++;
+        }
+        page->buffer = page->snap_buffer;
+        page->flags = (page->flags & (PAGE_SNAP | PAGE_SNAP_OWNED)) | PAGE_COW;
+        page->write_gen = ++vm->gen_clock;
+        page->next = NULL;
+        vm->num_shared_pages++;
+        tlb_invalidate(vm, page);
+        page = next;
+    }
+    page = vm->new_pages;
+    while (page != NULL) {
+        Page* next = page->next;
+        LeafTable* table = get_leaf_table(vm, page->offset, 0);
+        int index = page->offset & (PT_ENTRIES - 1);
+        table->entries[index] = NULL;
+        // The page no longer exists, so it cannot be dirty either. Restored
+        // pages keep their dirty bit since their contents changed back.
+        table->dirty[index / 64] &= ~(1ULL << (index % 64));
+        if (page->flags & PAGE_CODE) {
+            vm->code_epoch++;
+        }
+        if (page->flags & PAGE_COW) {
+            vm->num_shared_pages--;
+        } else {
+            arena_free_buffer(vm, page->buffer);
+        }
+        tlb_invalidate(vm, page);
+        arena_free_page(vm, page);
+        vm->num_pages--;
+        page = next;
+    }
+    vm->dirty_pages = NULL;
+    vm->new_pages = NULL;
+}
+
+size_t vm_dirty_pages(VirtualMemory* vm, uint64_t* addrs, size_t max) {
+    require_paged_mode(vm, "dirty page tracking");
+    size_t count = 0;
+    LeafTable* leaf;
+    int i;
+    for (leaf = vm->dirty_leaves; leaf != NULL; leaf = leaf->next_dirty) {
+        for (i = 0; i < PT_ENTRIES; i++) {
+            if (!(leaf->dirty[i / 64] & (1ULL << (i % 64)))) {
+                continue;
+            }
+            if (count < max) {
+                uint64_t addr = leaf->entries[i]->offset << PAGE_SHIFT;
+                if (addr & (1ULL << (VADDR_BITS - 1))) {
+                    addr |= ~VADDR_MASK;  // back to the canonical upper half
+                }
+                addrs[count] = addr;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+void vm_dirty_clear(VirtualMemory* vm) {
+    require_paged_mode(vm, "dirty page tracking");
+    LeafTable* leaf = vm->dirty_leaves;
+    while (leaf != NULL) {
+        LeafTable* next = leaf->next_dirty;
+        memset(leaf->dirty, 0, sizeof(leaf->dirty));
+        leaf->on_dirty_list = 0;
+        leaf->next_dirty = NULL;
+        leaf = next;
+    }
+    vm->dirty_leaves = NULL;
+
+    int i;
+    for (i = 0; i < TLB_ENTRIES; i++) {
+        vm->tlb[VM_WRITE][i].tag = TLB_INVALID_TAG;
+        vm->tlb[VM_WRITE][i].buffer = NULL;
     }
-    // Cache miss. Allocate memory buffer.
-    vm->pages[vm->num_pages] = malloc(sizeof(Page));
-    vm->pages[vm->num_pages]->offset = offset;
-    vm->pages[vm->num_pages]->buffer = malloc(sizeof(uint8_t) * PAGE_SIZE);
-    return vm->pages[vm->num_pages++];
 }
 
 void vm_fread(VirtualMemory* vm, uint64_t vmaddr, FILE* src, size_t size) {
+    if (vmaddr + size <= vm->flat_size) {
+        // Touch the range first since read(2) into a PROT_NONE page fails
+        // with EFAULT instead of raising SIGSEGV.
+        flat_loader_write(vm, vmaddr, size, 0);
+        memset(vm->flat_base + vmaddr, 0, size);
+        fread(vm->flat_base + vmaddr, 1, size, src);
+        flat_loader_write(vm, vmaddr, size, 1);
+        return;
+    }
     uint64_t pos_start = vmaddr;
     uint64_t pos_end = vmaddr + size;
 
     size_t n_bytes;
     while (size > 0) {
-        Page* page = get_page(vm, pos_start);
+        Page* page = get_writable_page(vm, pos_start);
         uint64_t pos_page_end = (pos_start / PAGE_SIZE +1) * PAGE_SIZE;
 
         if (pos_end >= pos_page_end) {
@@ -58,10 +855,17 @@ void vm_fread(VirtualMemory* vm, uint64_t vmaddr, FILE* src, size_t size) {
         uint16_t page_offset = pos_start % PAGE_SIZE;
         fread(page->buffer + page_offset, 1, n_bytes, src);
         size -= n_bytes;
+        pos_start += n_bytes;
     }
 }
 
 void vm_memcpy(VirtualMemory* vm, uint64_t vmaddr, void* src, size_t size) {
+    if (vmaddr + size <= vm->flat_size) {
+        flat_loader_write(vm, vmaddr, size, 0);
+        memcpy(vm->flat_base + vmaddr, src, size);
+        flat_loader_write(vm, vmaddr, size, 1);
+        return;
+    }
     uint64_t pos_start = vmaddr;
     uint64_t pos_end = vmaddr + size;
     void* src_start = src;
@@ -69,7 +873,7 @@ void vm_memcpy(VirtualMemory* vm, uint64_t vmaddr, void* src, size_t size) {
     int64_t rest, n_bytes;
     rest = (int64_t) size;
     while (rest > 0) {
-        Page* page = get_page(vm, pos_start);
+        Page* page = get_writable_page(vm, pos_start);
         uint64_t pos_page_end = (pos_start / PAGE_SIZE +1) * PAGE_SIZE;
 
         if (pos_end >= pos_page_end) {
@@ -86,47 +890,138 @@ void vm_memcpy(VirtualMemory* vm, uint64_t vmaddr, void* src, size_t size) {
     }
 }
 
-uint64_t vm_get_memory8(VirtualMemory* vm, uint64_t addr) {
-    Page* page = get_page(vm, addr);
-    uint16_t pos = addr % PAGE_SIZE;
-    uint8_t v = page->buffer[pos];
-    return v;
+// The host address of vmaddr for access, and in *avail how many bytes from
+// there on are contiguous on the host.
+static uint8_t* host_range(VirtualMemory* vm, int access, uint64_t vmaddr, uint64_t* avail) {
+    if (vmaddr < vm->flat_size) {
+        *avail = vm->flat_size - vmaddr;
+        return vm->flat_base + vmaddr;
+    }
+    uint64_t pos = vmaddr % PAGE_SIZE;
+    *avail = PAGE_SIZE - pos;
+    return tlb_lookup(vm, access, vmaddr) + pos;
 }
 
-uint64_t vm_get_memory32(VirtualMemory* vm, uint64_t addr) {
-    int i;
-    uint32_t ret = 0;
-    for (i=0;i<4; i++) {  // little endian
-        ret |= vm_get_memory8(vm, addr+i) << (i * 8);
+static uint64_t min_size(uint64_t a, uint64_t b) {
+    return a < b ? a : b;
+}
+
+void vm_fill(VirtualMemory* vm, uint64_t vmaddr, uint8_t value, uint64_t size) {
+    while (size > 0) {
+        uint64_t n;
+        uint8_t* dst = host_range(vm, VM_WRITE, vmaddr, &n);
+        n = min_size(n, size);
+        memset(dst, value, n);
+        vmaddr += n;
+        size -= n;
     }
-    return ret;
 }
 
-uint64_t vm_get_memory64(VirtualMemory* vm, uint64_t addr) {
-    int i;
-    uint64_t ret = 0;
-    for (i=0;i<8; i++) {  // little endian
-        ret |= vm_get_memory8(vm, addr+i) << (i * 8);
+void vm_copy(VirtualMemory* vm, uint64_t dst_addr, uint64_t src_addr, uint64_t size) {
+    // A destination less than size bytes above the source reads bytes
+    // copied before, so no chunk may be longer than the distance.
+    uint64_t distance = dst_addr - src_addr;
+    uint64_t max_chunk = distance != 0 && distance < size ? distance : size;
+    while (size > 0) {
+        uint64_t n, src_n;
+        // The destination first: making it writable may copy the page the
+        // source is on.
+        uint8_t* dst = host_range(vm, VM_WRITE, dst_addr, &n);
+        uint8_t* src = host_range(vm, VM_READ, src_addr, &src_n);
+        n = min_size(min_size(n, src_n), min_size(max_chunk, size));
+        memmove(dst, src, n);
+        dst_addr += n;
+        src_addr += n;
+        size -= n;
     }
-    return ret;
 }
 
-void vm_set_memory8(VirtualMemory* vm, uint64_t addr, uint8_t val) {
-    Page* page = get_page(vm, addr);
-    uint16_t pos = addr % PAGE_SIZE;
-    page->buffer[pos] = val & 0xFF;
+uint64_t vm_mismatch(VirtualMemory* vm, uint64_t addr1, uint64_t addr2, uint64_t size) {
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t n, n2;
+        uint8_t* p1 = host_range(vm, VM_READ, addr1 + done, &n);
+        uint8_t* p2 = host_range(vm, VM_READ, addr2 + done, &n2);
+        n = min_size(min_size(n, n2), size - done);
+        if (memcmp(p1, p2, n) != 0) {
+            while (*p1 == *p2) {
+                p1++;
+                p2++;
+                done++;
+            }
+            return done;
+        }
+        done += n;
+    }
+    return size;
 }
 
-void vm_set_memory32(VirtualMemory* vm, uint64_t addr, uint32_t val) {
+// Accesses that stay within one page are a single unaligned load or store on
+// the host buffer. Guest memory is little endian, and so is every host this
+// emulator runs on.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "virtual_memory.c assumes a little-endian host"
+#endif
+
+static uint64_t load_slow(VirtualMemory* vm, int access, uint64_t addr, int size) {
     int i;
-    for (i = 0; i<4; i++) {
-        vm_set_memory8(vm, addr+i, val >> (i*8));
+    uint64_t ret = 0;
+    for (i = 0; i < size; i++) {  // little endian
+        uint8_t* buffer = tlb_lookup(vm, access, addr + i);
+        ret |= (uint64_t) buffer[(addr + i) % PAGE_SIZE] << (i * 8);
     }
+    return ret;
 }
 
-void vm_set_memory64(VirtualMemory* vm, uint64_t addr, uint64_t val) {
+static void store_slow(VirtualMemory* vm, uint64_t addr, uint64_t val, int size) {
     int i;
-    for (i = 0; i<8; i++) {
-        vm_set_memory8(vm, addr+i, val >> (i*8));
+    for (i = 0; i < size; i++) {
+        uint8_t* buffer = tlb_lookup(vm, VM_WRITE, addr + i);
+        buffer[(addr + i) % PAGE_SIZE] = (val >> (i * 8)) & 0xFF;
     }
 }
+
+#define DEFINE_VM_ACCESSORS(bits) \
+uint64_t vm_fetch ## bits(VirtualMemory* vm, uint64_t addr) { \
+    if (addr < vm->flat_size) { \
+        uint ## bits ## _t v; \
+        memcpy(&v, vm->flat_base + addr, sizeof(v)); \
+        return v; \
+    } \
+    uint16_t pos = addr % PAGE_SIZE; \
+    if (pos > PAGE_SIZE - (bits / 8)) \
+        return load_slow(vm, VM_FETCH, addr, bits / 8); \
+    uint ## bits ## _t v; \
+    memcpy(&v, tlb_lookup(vm, VM_FETCH, addr) + pos, sizeof(v)); \
+    return v; \
+} \
+uint64_t vm_get_memory ## bits(VirtualMemory* vm, uint64_t addr) { \
+    if (addr < vm->flat_size) { \
+        uint ## bits ## _t v; \
+        memcpy(&v, vm->flat_base + addr, sizeof(v)); \
+        return v; \
+    } \
+    uint16_t pos = addr % PAGE_SIZE; \
+    if (pos > PAGE_SIZE - (bits / 8)) \
+        return load_slow(vm, VM_READ, addr, bits / 8); \
+    uint ## bits ## _t v; \
+    memcpy(&v, tlb_lookup(vm, VM_READ, addr) + pos, sizeof(v)); \
+    return v; \
+} \
+void vm_set_memory ## bits(VirtualMemory* vm, uint64_t addr, uint ## bits ## _t val) { \
+    if (addr < vm->flat_size) { \
+        memcpy(vm->flat_base + addr, &val, sizeof(val)); \
+        return; \
+    } \
+    uint16_t pos = addr % PAGE_SIZE; \
+    if (pos > PAGE_SIZE - (bits / 8)) { \
+        store_slow(vm, addr, val, bits / 8); \
+        return; \
+    } \
+    memcpy(tlb_lookup(vm, VM_WRITE, addr) + pos, &val, sizeof(val)); \
+}
+
+DEFINE_VM_ACCESSORS(8)
+DEFINE_VM_ACCESSORS(16)
+DEFINE_VM_ACCESSORS(32)
+DEFINE_VM_ACCESSORS(64)
@@ -7,15 +7,89 @@
 struct VirtualMemory_t;
 typedef struct VirtualMemory_t VirtualMemory;
 
+enum VMAccess {
+    VM_READ, VM_WRITE, VM_FETCH,
+    VM_ACCESS_COUNT};
+
+#define VM_PAGE_SIZE 4096
+
+#define VM_PROT_READ 0x1
+#define VM_PROT_WRITE 0x2
+#define VM_PROT_EXEC 0x4
+#define VM_PROT_ALL (VM_PROT_READ | VM_PROT_WRITE | VM_PROT_EXEC)
+
+typedef struct {
+    uint64_t num_pages;
+    uint64_t num_shared_pages;  // pages still backed by a shared buffer
+    uint64_t num_buffers;       // private page buffers, including those of a snapshot
+    uint64_t tlb_hits[VM_ACCESS_COUNT];
+    uint64_t tlb_misses[VM_ACCESS_COUNT];
+} VMStats;
+
+// VM_PAGED translates addresses through a page table and works everywhere.
+// VM_FLAT maps guest memory onto one reserved host range (see virtual_memory.c).
+enum VMMode {
+    VM_PAGED, VM_FLAT};
+
+void vm_set_default_mode(int mode);
 VirtualMemory* vm_init();
+VirtualMemory* vm_init_mode(int mode);
+void vm_destroy(VirtualMemory* vm);
+void vm_tlb_flush(VirtualMemory* vm);
+void vm_get_stats(VirtualMemory* vm, VMStats* stats);
+// Maps [vmaddr, vmaddr + memsz) lazily with VM_PROT_* permissions. The first
+// filesz bytes are read from src, which must stay valid until vm_destroy(),
+// and the rest reads as zero. Guest accesses that the permissions do not
+// allow terminate the emulator. Loader writes (vm_memcpy, vm_fread) are not
+// checked, in either mode.
+void vm_map(VirtualMemory* vm, uint64_t vmaddr, uint64_t memsz, void* src, uint64_t filesz, int prot);
+// Hands a host mmap over to the VirtualMemory, which munmaps it in vm_destroy().
+void vm_adopt_mmap(VirtualMemory* vm, void* addr, size_t len);
+// Returns the write generation of the page containing vmaddr, and starts
+// counting stores to it. The value changes whenever the page is written
+// afterwards, so a cache of decoded code compares it with the value it saw
+// at decode time. Pages nobody decoded from keep the plain fast store path.
+uint32_t vm_code_gen(VirtualMemory* vm, uint64_t vmaddr);
+// Changes whenever the generation of any page passed to vm_code_gen() does,
+// so a cache only has to recheck its pages after this value moves.
+uint32_t vm_code_epoch(VirtualMemory* vm);
+// Saves the contents of every page. Nothing is copied at this point; pages
+// become copy-on-write and the first store to each one is recorded. A later
+// vm_restore() puts back only the pages written or created since the
+// snapshot, so its cost is proportional to the dirty set. Taking a new
+// snapshot replaces the previous one. Not supported in flat mode.
+void vm_snapshot(VirtualMemory* vm);
+void vm_restore(VirtualMemory* vm);
+// Dirty page bitmap. vm_dirty_pages() stores the addresses of the pages
+// written since the last vm_dirty_clear() (or since vm_init) into addrs, up
+// to max entries and in no particular order, and returns how many there are.
+// The bitmap is independent of vm_snapshot(), which keeps its own record.
+// Not supported in flat mode.
+size_t vm_dirty_pages(VirtualMemory* vm, uint64_t* addrs, size_t max);
+void vm_dirty_clear(VirtualMemory* vm);
 void vm_fread(VirtualMemory* vm, uint64_t vmaddr, FILE* stream, size_t size);
 void vm_memcpy(VirtualMemory* vm, uint64_t vmaddr, void* src, size_t size);
+// Bulk guest accesses, a page at a time, with the same permission checks
+// and write tracking as the accessors below. vm_copy() gives the result of
+// copying a byte at a time upwards, so a destination just above the source
+// repeats its first bytes like rep movsb. vm_mismatch() returns the offset
+// of the first byte that differs between the two ranges, or size.
+void vm_fill(VirtualMemory* vm, uint64_t vmaddr, uint8_t value, uint64_t size);
+void vm_copy(VirtualMemory* vm, uint64_t dst, uint64_t src, uint64_t size);
+uint64_t vm_mismatch(VirtualMemory* vm, uint64_t addr1, uint64_t addr2, uint64_t size);
+
+uint64_t vm_fetch8(VirtualMemory* vm, uint64_t vmaddr);
+uint64_t vm_fetch16(VirtualMemory* vm, uint64_t vmaddr);
+uint64_t vm_fetch32(VirtualMemory* vm, uint64_t vmaddr);
+uint64_t vm_fetch64(VirtualMemory* vm, uint64_t vmaddr);
 
 uint64_t vm_get_memory8(VirtualMemory* vm, uint64_t vmaddr);
+uint64_t vm_get_memory16(VirtualMemory* vm, uint64_t vmaddr);
 uint64_t vm_get_memory32(VirtualMemory* vm, uint64_t vmaddr);
 uint64_t vm_get_memory64(VirtualMemory* vm, uint64_t vmaddr);
 
 void vm_set_memory8(VirtualMemory* vm, uint64_t vmaddr, uint8_t val);
+void vm_set_memory16(VirtualMemory* vm, uint64_t vmaddr, uint16_t val);
 void vm_set_memory32(VirtualMemory* vm, uint64_t vmaddr, uint32_t val);
 void vm_set_memory64(VirtualMemory* vm, uint64_t vmaddr, uint64_t val);
 
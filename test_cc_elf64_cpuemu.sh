@@ -1,6 +1,8 @@
 #!/bin/bash
 
 cpu=./cpu/cpu
+# Extra emulator options, e.g. CPU_FLAGS="--memory flat" ./test_cc_elf64_cpuemu.sh
+cpu_flags=${CPU_FLAGS:-}
 compiler=./cc/9cc
 
 tmpdir=`mktemp -d /tmp/cc-elf64-test-XXXXXX`
@@ -27,7 +29,7 @@ assert() {
 
   $compiler "$input" > $asm_file || exit
   gcc -o $exe_file $asm_file $tmpdir/tmp2.o  || exit
-  $cpu -f elf64 $exe_file 2> $log_file
+  $cpu $cpu_flags -f elf64 $exe_file 2> $log_file
   local actual=$?
 
   if [ $actual == $expected ]; then